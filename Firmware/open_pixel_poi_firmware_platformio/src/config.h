@@ -14,7 +14,7 @@
 #define OUTPUT_SK9822_2020_DRAW 0.060
 #define OUTPUT_SK9822_2020_LIMIT 100 // Data sheet says max brightness = 10/32 = 79/255, but yolo we do 100/255
 
-// These limits max out the available space in the current partition scheme. They are also hardcoded in the app.
+// Layout of a new pattern library, and of the patterns from before there was one. The app can change it (CC_SET_LIBRARY_LAYOUT).
 #define PATTERN_BANK_SIZE 5
 #define PATTERN_BANK_COUNT 3
 #define PATTERN_PIXEL_LIMIT 40000
@@ -31,24 +31,28 @@ void setup() {
   config.setup();
   led.setup();
   ble.setup();
+  config.setupPrefetch();
   button.setup();
+  led.startRenderTask();
   debugf("- Setup Complete\n");
 }
 
 void loop() {
   // Redundent loop to avoid a lag every 2 seconds caused by 
   // https://github.com/espressif/arduino-esp32/blob/50ef6f4369fb85139f000f7bbc5a9f9d5bc02b9f/cores/esp32/main.cpp#L68
+  // LEDs are driven by the render task (see OpenPixelPoiLED::startRenderTask), everything here runs below it
+  // BLE packets are handled here too, queued by the BLE task (see OpenPixelPoiBLE::queuePacket)
   while(true){
-    if(ble.multipartPattern == 0){
-      ble.loop();
-      config.loop();
-      led.loop();
-      button.loop();
-    }else{
-      delay(250);
+    ble.processPackets();
+    // Battery, button and pattern transitions keep going during uploads too
+    ble.loop();
+    config.loop();
+    button.loop();
+    if(ble.receiving()){
+      ble.waitForPackets(10);
       // jammed
       if(millis() - ble.bleLastReceived > 5000){
-        ble.multipartPattern = 0;
+        ble.cancelMessage();
       }
     }
   }
@@ -3,12 +3,15 @@
 #include <Update.h>
 #include "config.h"
 #include "open_pixel_poi_config.cpp"
+#include "open_pixel_poi_parser.cpp"
 
 // BLE
 #include <BLEDevice.h>
 #include <BLEServer.h>
 #include <BLEUtils.h>
 #include <BLE2902.h>
+#include <BLESecurity.h>
+#include <atomic>
 
 //#define DEBUG  // Comment this line out to remove printf statements in released version
 #ifdef DEBUG
@@ -27,6 +30,19 @@
 //  Set Pattern      = 04
 // Message-specific payload (1 or more bytes) = <see message examples below>
 // End (1 byte)      = D1   
+// Messages longer than a packet carry on in the following packets, a packet shorter than 509 bytes ends them.
+
+// Protocol v2 framing, for messages sent over several packets without response
+// Start (1 byte)    = D2
+// Flags (1 byte)    = 01 first packet of a message, 02 last packet of a message
+// Sequence (2 bytes), counting up packet by packet, see CC_GET_PROTOCOL
+// Length (2 bytes) of the payload, at most V2_PAYLOAD_LIMIT
+// Payload, the message's CommCode and payload (without D0 / D1) split over the packets
+// CRC32 (4 bytes) of everything before it
+// D2 03 00 00 00 02 02 40 <crc> (Set Brightness to 64 in one packet)
+// Packets that arrive ahead of a lost one are held, up to V2_WINDOW. Damaged packets are dropped.
+// Acks are sent with the notify characteristic: D3, next sequence expected (2 bytes), bit n set = sequence + 1 + n is held.
+// One goes out every V2_ACK_EVERY packets, after the last packet of a message and when a packet is out of order.
 
 // Set Brightness - 0 (off) to 255 (100%)
 //   MessageType = 02
@@ -51,6 +67,69 @@
 // D0 04 01 02 FF FF FF 00 00 00 D1 (1 Blinking Red Pixel)
 // D0 04 03 03 00 00 FF 00 00 00 00 00 FF 00 00 00 00 00 FF 00 00 00 00 00 FF 00 00 00 00 00 FF D1 (solid blue x)
 
+// Set indexed display pattern, stored as is (see INDEXED_PATTERN_HEADER_SIZE)
+//   MessageType = 16
+//   FrameHeight = 1 byte
+//   FrameCount = 2 bytes
+//   'O', 'I', bits per index (4 or 8), palette size - 1, palette cycle speed (2 bytes, colors per second, 0 = static)
+//   Palette 3 bytes * palette size = R,G,B
+//   Indices, frameHeight per frame, each frame padded to whole bytes (4 bit indices are packed high nibble first)
+// D0 16 02 00 02 4F 49 08 01 00 00 FF 00 00 00 00 FF 00 01 01 00 D1 (red/blue, then blue/red)
+
+// Set compressed display pattern, stored as is and decoded frame by frame (see COMPRESSED_PATTERN_HEADER_SIZE)
+//   MessageType = 17
+//   FrameHeight = 1 byte
+//   FrameCount = 2 bytes
+//   'O', 'Z', length of the frame data (4 bytes)
+//   Frames, each a 2 byte length followed by ops (op << 6 | pixel count - 1): 0 = keep previous, 1 = run of R,G,B, 2 = literal R,G,B * count
+// D0 17 02 00 02 4F 5A 00 00 00 0C 00 04 41 FF 00 00 00 04 41 00 00 FF D1 (red, then blue)
+
+// Set sequencer, compiled into the timeline on the poi
+//   MessageType = 0E
+//   Length = 2 bytes, then 7 bytes per step: pattern slot, pattern bank, brightness, speed (2 bytes), duration in ms (2 bytes)
+
+// Set timeline, stored as is and read step by step while it plays (see TIMELINE_HEADER_SIZE). Started with CC_START_SEQUENCER.
+//   MessageType = 18
+//   'O', 'T', version, 0, step count (4 bytes), length of the steps (4 bytes)
+//   Steps: record length, start (4 bytes, ms from the start; us in version 1 timelines), pattern (library position, slot + bank * 5 in the default layout), flags (1 = brightness, 2 = speed), [brightness], [speed (2 bytes)]
+// D0 18 4F 54 02 00 00 00 00 02 00 00 00 0F 07 00 00 00 00 00 00 08 00 00 03 E8 01 01 40 D1 (slot 1, then slot 2 at brightness 64 after 1s)
+
+// Get pattern library (slot and bank numbers wrap around the library's layout)
+//   MessageType = 19
+// D0 19 D1
+//   Response payload = free bytes (4), pattern bytes (4), bank count, slot count of each bank,
+//   then for every slot (bank by bank) its pattern id and pattern size (4 bytes)
+
+// Set pattern library layout
+//   MessageType = 1A
+//   Bank count, slot count of each bank, then the pattern id (0 to 63) of every slot, bank by bank
+// D0 1A 02 02 01 00 01 07 D1 (bank 1 = patterns 0 and 1, bank 2 = pattern 7)
+
+// Get pattern hashes, the content hash (CRC32 of the 16 byte .oppp header) of every stored pattern
+//   MessageType = 1B
+// D0 1B D1
+//   Response payload = pattern count, then for every pattern its id and hash (4 bytes)
+
+// Link pattern, the current slot shows the stored pattern with the .oppp header instead of it being uploaded again.
+// The header's hash finds the pattern, its size and stored header must match as well. Errors if there is none.
+// Uploading to a slot that shares its pattern gives the slot a pattern of its own.
+//   MessageType = 1C
+//   Header = 16 bytes, see PATTERN_FILE_HEADER_SIZE
+// D0 1C 4F 50 01 00 05 00 05 00 00 00 00 4B 12 34 56 78 D1
+
+// Get protocol, starts a new v2 transfer: packets held for the previous one are dropped (v1 firmware answers with an error)
+//   MessageType = 1D
+// D0 1D D1
+//   Response payload = protocol version (2), window size in packets, payload limit (2 bytes), next sequence expected (2 bytes)
+
+// Get frame stats (counters since the previous request, reading them starts a new measurement window)
+//   MessageType = 15
+// D0 15 D1
+//   Response payload = 29 x 4 bytes, big endian
+//   window us, frames shown, frames skipped, max frame gap us, bus blocked count, bus wait us, loop histogram x 8,
+//   max frame latency us, frame latency histogram x 8, pattern transitions, transitions not prefetched, max transition latency us,
+//   loader stalls, loader stall us, settings writes avoided
+
 enum CommCode {
   CC_SUCCESS,                     // 0
   CC_ERROR,                       // 1
@@ -73,14 +152,64 @@ enum CommCode {
   CC_SET_SPEED_OPTION,            // 18
   CC_SET_SPEED_OPTIONS,           // 19
   CC_SET_PATTERN_SHUFFLE_DURATION,// 20
+  CC_GET_FRAME_STATS,             // 21
+  CC_SET_INDEXED_PATTERN,         // 22
+  CC_SET_COMPRESSED_PATTERN,      // 23
+  CC_SET_TIMELINE,                // 24
+  CC_GET_LIBRARY,                 // 25
+  CC_SET_LIBRARY_LAYOUT,          // 26
+  CC_GET_PATTERN_HASHES,          // 27
+  CC_LINK_PATTERN,                // 28
+  CC_GET_PROTOCOL,                // 29
+  CC_TEST_THROUGHPUT,             // 30
+};
+
+#define V2_HEADER_SIZE 6
+#define V2_CRC_SIZE 4
+#define V2_PACKET_LIMIT 512
+#define V2_PAYLOAD_LIMIT (V2_PACKET_LIMIT - V2_HEADER_SIZE - V2_CRC_SIZE)
+#define V2_WINDOW 8
+#define V2_ACK_EVERY 4
+
+enum V2Flags {
+  V2_FIRST = 1 << 0,
+  V2_LAST = 1 << 1,
 };
 
-class OpenPixelPoiBLE : public BLEServerCallbacks, public BLECharacteristicCallbacks{
+// Packets wait here between the BLE stack's task and the main loop, which handles them
+#define PACKET_QUEUE_SIZE 16
+// Slots only connection markers may take, so a disconnect isn't lost behind an upload. Two cover the connect and
+// disconnect that can be outstanding while the main loop is busy.
+#define PACKET_QUEUE_RESERVE 2
+
+// Link parameters, intervals in 1.25 ms units. Bulk transfers ask for the shortest interval, otherwise the link idles
+// at a longer one to save power. The phone has the final say on all of them.
+#define LINK_MTU 517
+#define LINK_DATA_LENGTH 251 // Bytes per link layer packet with data length extension
+#define LINK_FAST_INTERVAL_MIN 6 // 7.5 ms
+#define LINK_FAST_INTERVAL_MAX 12 // 15 ms
+#define LINK_SLOW_INTERVAL_MIN 24 // 30 ms
+#define LINK_SLOW_INTERVAL_MAX 48 // 60 ms
+#define LINK_TIMEOUT 400 // 4 s, in 10 ms units
+#define LINK_RELAX_AFTER 2000 // ms without packets before a fast link is relaxed
+
+// Advertising intervals in 0.625 ms units. Fast right after power up or a disconnect so the phone finds the poi again
+// quickly, then slow to save power.
+#define ADVERTISING_FAST_INTERVAL_MIN 32 // 20 ms
+#define ADVERTISING_FAST_INTERVAL_MAX 48 // 30 ms
+#define ADVERTISING_SLOW_INTERVAL_MIN 668 // 417.5 ms, one of the intervals Apple recommends
+#define ADVERTISING_SLOW_INTERVAL_MAX 688 // 430 ms
+#define ADVERTISING_FAST_FOR 30000 // ms
+
+struct QueuedPacket {
+  uint16_t length; // 0 = connection marker, data[0] is 1 when connected and 0 when disconnected
+  uint8_t data[V2_PACKET_LIMIT];
+};
+
+class OpenPixelPoiBLE : public BLEServerCallbacks, public BLECharacteristicCallbacks, public OpenPixelPoiParserListener{
   
   private:
     OpenPixelPoiConfig& config;
-
-    int multipartPatternOffset = 0;
     
     // Nordic nRF
     BLEUUID pixelPoiServiceUUID = BLEUUID("6E400001-B5A3-F393-E0A9-E50E24DCCA9E");
@@ -91,12 +220,43 @@ class OpenPixelPoiBLE : public BLEServerCallbacks, public BLECharacteristicCallb
     BLEServer* server;
     bool deviceConnected = false;
     bool oldDeviceConnected = false;
+    esp_bd_addr_t peerAddress;
+    uint16_t peerMtu = 23;
+    bool linkFast = false;
+    bool advertisingFast = false;
+    uint32_t advertisingSince = 0;
+    #ifdef DEBUG
+    uint32_t disconnectedAt = 0;
+    #endif
     
     BLEService* pixelPoiService;
     BLECharacteristic* pixelPoiRxCharacteristic;
     BLECharacteristic* pixelPoiTxCharacteristic;
     BLECharacteristic* pixelPoiNotifyCharacteristic;
 
+    // Protocol v2 receive state, packets ahead of v2Expected wait in v2Window[sequence % V2_WINDOW]
+    uint16_t v2Expected = 0;
+    uint8_t v2Window[V2_WINDOW][V2_PACKET_LIMIT];
+    uint16_t v2WindowLength[V2_WINDOW] = {}; // 0 = empty
+    uint8_t v2Unacked = 0;
+    OpenPixelPoiParser parser;
+    // Single producer (onWrite(), onConnect() in the BLE task), single consumer (processPackets() in the main loop)
+    QueuedPacket packetQueue[PACKET_QUEUE_SIZE];
+    std::atomic<uint32_t> queueHead{0}; // Packets queued, only written by the producer
+    std::atomic<uint32_t> queueTail{0}; // Packets handled, only written by the consumer
+    // Set by the producer when it drops a packet that isn't v2, droppedAt is the queue position it would have had
+    std::atomic<bool> packetDropped{false};
+    uint32_t droppedAt = 0;
+    TaskHandle_t loopTask = NULL;
+    // CC_TEST_THROUGHPUT, the upload is counted and dropped
+    bool throughputTest = false;
+    uint32_t throughputBytes = 0;
+    uint32_t throughputStart = 0;
+    #ifdef DEBUG
+    uint32_t parsedBytes = 0;
+    uint32_t parseMicros = 0;
+    #endif
+
     void bleSendError(){
       uint8_t response[] = {0xD0, 0x00, 0x05, CC_ERROR, 0xD1};
       writeToPixelPoi(response);
@@ -111,16 +271,159 @@ class OpenPixelPoiBLE : public BLEServerCallbacks, public BLECharacteristicCallb
       uint8_t response[] = {0xD0, 0x00, 0x06, CC_GET_FW_VERSION, 0x02, 0xD1};
       writeToPixelPoi(response);
     }
+
+    // Pattern bytes announced by a CC_SET_PATTERN, CC_SET_INDEXED_PATTERN or CC_SET_COMPRESSED_PATTERN header
+    // (streamHeaderSize() bytes: frame height, frame count, data header), 0 if it is invalid
+    uint32_t patternUploadLength(CommCode code, const uint8_t* header){
+      uint32_t frameHeight = header[0];
+      uint32_t frameCount = header[1] << 8 | header[2];
+      if(frameHeight == 0 || frameCount == 0){
+        return 0;
+      }
+      if(code == CC_SET_PATTERN){
+        return frameHeight * frameCount * 3;
+      }
+      if(code == CC_SET_COMPRESSED_PATTERN){
+        if(header[3] != 'O' || header[4] != 'Z'){
+          return 0;
+        }
+        uint32_t length = COMPRESSED_PATTERN_HEADER_SIZE + OpenPixelPoiConfig::getUInt32(header + 5);
+        return OpenPixelPoiConfig::compressedLengthFits(frameCount, length) ? length : 0;
+      }
+      uint8_t bits = header[5];
+      if(header[3] != 'O' || header[4] != 'I' || (bits != 4 && bits != 8)){
+        return 0;
+      }
+      return INDEXED_PATTERN_HEADER_SIZE + (header[6] + 1) * 3 + frameCount * ((frameHeight * bits + 7) / 8);
+    }
+
+    // Timeline bytes announced by a CC_SET_TIMELINE header, 0 if it is invalid
+    uint32_t timelineUploadLength(const uint8_t* header){
+      if(header[0] != 'O' || header[1] != 'T'){
+        return 0;
+      }
+      return TIMELINE_HEADER_SIZE + OpenPixelPoiConfig::getUInt32(header + 8);
+    }
+
+    PatternEncoding patternUploadEncoding(CommCode code){
+      return code == CC_SET_INDEXED_PATTERN ? PE_INDEXED : code == CC_SET_COMPRESSED_PATTERN ? PE_COMPRESSED : PE_RGB;
+    }
+
+    void putUInt32(uint8_t* data, uint32_t value){
+      data[0] = value >> 24;
+      data[1] = value >> 16;
+      data[2] = value >> 8;
+      data[3] = value;
+    }
+
+    void bleSendLibrary(){
+      uint8_t response[5 + 9 + PATTERN_LIBRARY_BANK_LIMIT + PATTERN_LIBRARY_LIMIT * 5];
+      uint8_t* payload = response + 4;
+      response[3] = CC_GET_LIBRARY;
+      putUInt32(payload, config.libraryFreeBytes());
+      putUInt32(payload + 4, config.libraryPatternBytes());
+      payload[8] = config.bankCount();
+      payload += 9;
+      for(int bank = 0; bank < config.bankCount(); bank++){
+        *payload++ = config.bankSlotCount(bank);
+      }
+      for(int bank = 0; bank < config.bankCount(); bank++){
+        for(int slot = 0; slot < config.bankSlotCount(bank); slot++){
+          uint8_t id = config.patternId(bank, slot);
+          payload[0] = id;
+          putUInt32(payload + 1, config.patternSize(id));
+          payload += 5;
+        }
+      }
+      *payload++ = 0xD1;
+      size_t length = payload - response;
+      response[0] = 0xD0;
+      response[1] = length >> 8;
+      response[2] = length & 0xFF;
+      writeToPixelPoi(response);
+    }
+
+    void bleSendPatternHashes(){
+      uint8_t response[6 + PATTERN_LIBRARY_LIMIT * 5];
+      uint8_t* payload = response + 5;
+      response[3] = CC_GET_PATTERN_HASHES;
+      response[4] = 0;
+      for(int id = 0; id < PATTERN_LIBRARY_LIMIT; id++){
+        if(config.patternSize(id) != 0){
+          payload[0] = id;
+          putUInt32(payload + 1, config.patternHash(id));
+          payload += 5;
+          response[4]++;
+        }
+      }
+      *payload++ = 0xD1;
+      size_t length = payload - response;
+      response[0] = 0xD0;
+      response[1] = length >> 8;
+      response[2] = length & 0xFF;
+      writeToPixelPoi(response);
+    }
+
+    void bleSendProtocol(){
+      uint8_t response[] = {0xD0, 0x00, 0x0B, CC_GET_PROTOCOL, 0x02, V2_WINDOW, V2_PAYLOAD_LIMIT >> 8, V2_PAYLOAD_LIMIT & 0xFF,
+        (uint8_t)(v2Expected >> 8), (uint8_t)(v2Expected & 0xFF), 0xD1};
+      writeToPixelPoi(response);
+    }
+
+    // Bytes received, micros from the first to the last one and the MTU the upload came with
+    void bleSendThroughput(){
+      uint8_t response[] = {0xD0, 0x00, 0x0F, CC_TEST_THROUGHPUT, 0, 0, 0, 0, 0, 0, 0, 0, (uint8_t)(peerMtu >> 8), (uint8_t)(peerMtu & 0xFF), 0xD1};
+      putUInt32(response + 4, throughputBytes);
+      putUInt32(response + 8, micros() - throughputStart);
+      writeToPixelPoi(response);
+    }
+
+    void bleSendFrameStats(){
+      uint8_t response[5 + (13 + FRAME_STATS_LOOP_BUCKETS + FRAME_STATS_LATENCY_BUCKETS) * 4];
+      uint8_t* payload = response + 4;
+      response[0] = 0xD0;
+      response[1] = sizeof(response) >> 8;
+      response[2] = sizeof(response) & 0xFF;
+      response[3] = CC_GET_FRAME_STATS;
+      putUInt32(payload, micros() - config.frameStatsSince);
+      putUInt32(payload + 4, config.frameStats.framesShown);
+      putUInt32(payload + 8, config.frameStats.framesSkipped);
+      putUInt32(payload + 12, config.frameStats.maxFrameGapMicros);
+      putUInt32(payload + 16, config.frameStats.busBlockedCount);
+      putUInt32(payload + 20, config.frameStats.busWaitMicros);
+      for(int i = 0; i < FRAME_STATS_LOOP_BUCKETS; i++){
+        putUInt32(payload + 24 + i*4, config.frameStats.loopHistogram[i]);
+      }
+      payload += 24 + FRAME_STATS_LOOP_BUCKETS * 4;
+      putUInt32(payload, config.frameStats.maxFrameLatencyMicros);
+      for(int i = 0; i < FRAME_STATS_LATENCY_BUCKETS; i++){
+        putUInt32(payload + 4 + i*4, config.frameStats.latencyHistogram[i]);
+      }
+      payload += 4 + FRAME_STATS_LATENCY_BUCKETS * 4;
+      putUInt32(payload, config.frameStats.patternTransitions);
+      putUInt32(payload + 4, config.frameStats.transitionsNotPrefetched);
+      putUInt32(payload + 8, config.frameStats.maxTransitionLatencyMicros);
+      putUInt32(payload + 12, config.frameStats.loaderStalls);
+      putUInt32(payload + 16, config.frameStats.loaderStallMicros);
+      putUInt32(payload + 20, config.frameStats.settingsWritesAvoided);
+      response[sizeof(response) - 1] = 0xD1;
+      writeToPixelPoi(response);
+      config.resetFrameStats();
+    }
     
   public:
-    OpenPixelPoiBLE(OpenPixelPoiConfig& _config): config(_config) {}
+    OpenPixelPoiBLE(OpenPixelPoiConfig& _config): config(_config), parser(*this) {}
 
     long bleLastReceived;
-    uint8_t multipartPattern = 0;
     void setup(){
       debugf("Setup begin\n");
+      loopTask = xTaskGetCurrentTaskHandle();
       // Create the BLE Device
       BLEDevice::init(config.deviceName.c_str());
+      BLEDevice::setMTU(LINK_MTU);
+      #ifdef CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+      esp_ble_gap_set_prefered_default_phy(ESP_BLE_GAP_PHY_2M_PREF_MASK, ESP_BLE_GAP_PHY_2M_PREF_MASK);
+      #endif
 
       // Create the BLE Server
       server = BLEDevice::createServer();
@@ -137,18 +440,23 @@ class OpenPixelPoiBLE : public BLEServerCallbacks, public BLECharacteristicCallb
       pixelPoiRxCharacteristic->setCallbacks(this);
       pixelPoiService->start();
 
+      // Phones may bond (Just Works, no pin) so they can keep the GATT table cached and skip discovery when reconnecting.
+      // Nothing requires it.
+      BLESecurity* security = new BLESecurity();
+      security->setAuthenticationMode(ESP_LE_AUTH_BOND);
+      security->setCapability(ESP_IO_CAP_NONE);
+      security->setInitEncryptionKey(ESP_BLE_ENC_KEY_MASK | ESP_BLE_ID_KEY_MASK);
+      security->setRespEncryptionKey(ESP_BLE_ENC_KEY_MASK | ESP_BLE_ID_KEY_MASK);
+
       // Start advertising
-      server->getAdvertising()->start();
+      startAdvertising(true);
       debugf("Waiting a client connection to notify..\n");
       debugf("Setup complete\n");
     }
 
     void loop(){      
-      // disconnecting
+      // disconnecting, advertising is restarted by processPackets()
       if (!deviceConnected && oldDeviceConnected) {
-        delay(500); // give the bluetooth stack the chance to get things ready
-        server->startAdvertising(); // restart advertising
-        debugf("start advertising\n");
         oldDeviceConnected = deviceConnected;
       }
       // connecting
@@ -157,211 +465,531 @@ class OpenPixelPoiBLE : public BLEServerCallbacks, public BLECharacteristicCallb
         // do stuff here on connecting
         oldDeviceConnected = deviceConnected;
       }
+      if (!deviceConnected && advertisingFast && millis() - advertisingSince > ADVERTISING_FAST_FOR) {
+        server->getAdvertising()->stop();
+        startAdvertising(false);
+      }
+      if (linkFast && !parser.streaming() && millis() - bleLastReceived > LINK_RELAX_AFTER) {
+        setLinkFast(false);
+      }
+    }
+
+    void startAdvertising(bool fast){
+      BLEAdvertising* advertising = server->getAdvertising();
+      advertising->setMinInterval(fast ? ADVERTISING_FAST_INTERVAL_MIN : ADVERTISING_SLOW_INTERVAL_MIN);
+      advertising->setMaxInterval(fast ? ADVERTISING_FAST_INTERVAL_MAX : ADVERTISING_SLOW_INTERVAL_MAX);
+      advertising->start();
+      advertisingFast = fast;
+      advertisingSince = millis();
+      debugf("start advertising %s\n", fast ? "fast" : "slow");
+    }
+
+    // Asks the phone for a short connection interval while a bulk transfer runs, and a longer one after
+    void setLinkFast(bool fast){
+      if(deviceConnected && fast != linkFast){
+        debugf("Link %s\n", fast ? "fast" : "relaxed");
+        if(fast){
+          server->updateConnParams(peerAddress, LINK_FAST_INTERVAL_MIN, LINK_FAST_INTERVAL_MAX, 0, LINK_TIMEOUT);
+        }else{
+          server->updateConnParams(peerAddress, LINK_SLOW_INTERVAL_MIN, LINK_SLOW_INTERVAL_MAX, 0, LINK_TIMEOUT);
+        }
+        linkFast = fast;
+      }
     }
 
+    // Responses are read from the tx characteristic, the notification (D0, code) tells the app one is ready
     void writeToPixelPoi(uint8_t* data){
       if (deviceConnected) {
         pixelPoiTxCharacteristic->setValue(data, data[1] << 8 | data[2]);
+        pixelPoiNotifyCharacteristic->setValue(data, 4);
         pixelPoiNotifyCharacteristic->notify();
       }
     }
+
+    // Runs in the BLE task, copies the packet for the main loop. If the main loop is behind (writing flash) the packet
+    // is dropped right away. v2 gets it again through its acks, anything else is flagged for processPackets().
+    bool queuePacket(const uint8_t* data, size_t length){
+      uint32_t head = queueHead.load(std::memory_order_relaxed);
+      uint32_t room = PACKET_QUEUE_SIZE - (head - queueTail.load(std::memory_order_acquire));
+      if(room == 0 || (length > 0 && room <= PACKET_QUEUE_RESERVE)){
+        if((length == 0 || data[0] != 0xD2) && !packetDropped.load(std::memory_order_acquire)){
+          droppedAt = head;
+          packetDropped.store(true, std::memory_order_release);
+        }
+        return false;
+      }
+      QueuedPacket& packet = packetQueue[head % PACKET_QUEUE_SIZE];
+      memcpy(packet.data, data, max(length, (size_t)1));
+      packet.length = length;
+      queueHead.store(head + 1, std::memory_order_release);
+      if(loopTask != NULL){
+        xTaskNotifyGive(loopTask);
+      }
+      return true;
+    }
+
+    // Runs in the BLE task, the main loop sees the connection change in order with the packets
+    void queueConnectionMarker(bool connected){
+      uint8_t marker = connected;
+      queuePacket(&marker, 0);
+    }
+
+    // Main loop, handles the queued packets in order. Advertising is only driven from the main loop.
+    void processPackets(){
+      uint32_t tail = queueTail.load(std::memory_order_relaxed);
+      while(true){
+        if(packetDropped.load(std::memory_order_acquire) && tail == droppedAt){
+          handleDroppedPacket();
+          packetDropped.store(false, std::memory_order_release);
+          if(!deviceConnected){
+            startAdvertising(true); // The disconnect marker may be the one dropped
+          }
+        }
+        if(tail == queueHead.load(std::memory_order_acquire)){
+          break;
+        }
+        QueuedPacket& packet = packetQueue[tail % PACKET_QUEUE_SIZE];
+        if(packet.length == 0){
+          // Whatever was under way belongs to the old connection, a cut off v1 upload included
+          parser.cancel();
+          v2Expected = 0;
+          resetV2();
+          if(packet.data[0] == 0 && !deviceConnected){
+            startAdvertising(true);
+          }
+        }else{
+          processPacket(packet.data, packet.length);
+        }
+        queueTail.store(++tail, std::memory_order_release);
+      }
+    }
+
+    // A v1 message is missing a packet, so it is dropped and the app told. v2 messages carry on, the packet is resent.
+    void handleDroppedPacket(){
+      debugf("Packet queue overflow\n");
+      if(parser.inMessage() && !parser.framed){
+        return;
+      }
+      parser.cancel();
+      bleSendError();
+    }
+
+    // Main loop, sleeps until a packet comes or the timeout passes
+    void waitForPackets(uint32_t timeout){
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(timeout));
+    }
     
     void onWrite(BLECharacteristic *characteristic) {
-      debugf("OnWrite()!\n");
       if(characteristic->getUUID().equals(pixelPoiRxCharacteristicUUID)){
         bleLastReceived = millis();
-        uint8_t* bleStatus = characteristic->getData();
-        size_t bleLength = characteristic->getLength();
-        
-        
-        debugf("Message incoming!\n");
-        debugf("- len = %d\n", bleLength);
-        debugf("- msg = ");
-        for(int i = 0; i < bleLength; i++){
-          debugf_noprefix("0x%x ",bleStatus[i]);
+        size_t length = characteristic->getLength();
+        if(length == 0 || length > V2_PACKET_LIMIT || !queuePacket(characteristic->getData(), length)){
+          debugf("Packet of %d bytes dropped!\n", length);
         }
-        debugf("\n");
-        
-        // Process BLE
-        if(bleStatus[0] == 0xD0 && bleStatus[bleLength - 1] == 0xD1 && multipartPattern == 0){
-          CommCode requestCode = static_cast<CommCode>(bleStatus[1]);
-          if(requestCode == CC_SET_BRIGHTNESS){
-            config.setLedBrightness(bleStatus[2]);
-            bleSendSuccess();
-          }else if(requestCode == CC_SET_SPEED){
-            config.setAnimationSpeed(bleStatus[2] << 8 | bleStatus[3]);
-            bleSendSuccess();
-          }else if(requestCode == CC_SET_PATTERN){
-            for (int i=0; i<sizeof(config.pattern); i++){
-              config.pattern[i]=0;
-            }
-            config.setFrameHeight(bleStatus[2]);
-            config.setFrameCount(bleStatus[3] << 8 | bleStatus[4]);
-            config.patternLength = config.frameHeight*config.frameCount*3; // Need exception handling for buffer overruns!!!
-            for (int i=0; i<config.patternLength; i++){
-              config.pattern[i]=bleStatus[i+5];
-            }
-            config.savePattern();
-            
-            bleSendSuccess();
-          }else if(requestCode == CC_SET_PATTERN_SLOT){
-            config.setPatternSlot(bleStatus[2]%PATTERN_BANK_SIZE, true);
-            config.displayState = DS_PATTERN;
-            config.displayStateLastUpdated = millis();
-            bleSendSuccess();
-          }else if(requestCode == CC_SET_PATTERN_ALL){
-            config.displayState = DS_PATTERN_ALL;
-            config.displayStateLastUpdated = millis();
-            bleSendSuccess();
-          }else if(requestCode == CC_SET_BANK){
-            config.setPatternBank(bleStatus[2]%PATTERN_BANK_COUNT, true);
-            config.displayState = DS_PATTERN;
-            config.displayStateLastUpdated = millis();
-            bleSendSuccess();
-          }else if(requestCode == CC_SET_BANK_ALL){
-            config.displayState = DS_PATTERN_ALL_ALL;
-            config.displayStateLastUpdated = millis();
-            bleSendSuccess();
-          }else if(requestCode == CC_GET_FW_VERSION){
-            bleSendFWVersion();
-          }else if(requestCode == CC_SET_HARDWARE_VERSION){
-            config.setHardwareVersion(bleStatus[2]);
-            bleSendSuccess();
-          }else if(requestCode == CC_SET_LED_TYPE){
-            config.setLedType(bleStatus[2]);
-            bleSendSuccess();
-          }else if(requestCode == CC_SET_LED_COUNT){
-            config.setLedCount(bleStatus[2]);
-            bleSendSuccess();
-          }else if(requestCode == CC_SET_DEVICE_NAME){
-            if(bleLength > 3 && bleLength <= 18){
-              config.setDeviceName(String((char*)bleStatus).substring(2, bleLength -1) + " Pixel Poi");
-              bleSendSuccess();
-            }else{
-              bleSendError();
-            }
-          }else if(requestCode == CC_SET_SEQUENCER){
-            for (int i=0; i<sizeof(config.sequencer); i++){
-              config.sequencer[i]=0;
-            }
-            config.sequencerLength = bleStatus[2] << 8 | bleStatus[3];
-            config.sequencerStep = config.sequencerLength/7; // Dont trigger
-            for (int i=0; i < config.sequencerLength; i++){
-              config.sequencer[i]=bleStatus[i+4];
-            }
-            config.saveSequencer();
-            bleSendSuccess();
-          }else if(requestCode == CC_START_SEQUENCER){
-            config.sequencerStep = -1;
-            bleSendSuccess();
-          }else if(requestCode == CC_SET_BRIGHTNESS_OPTION){
-            if(bleStatus[2] >= 0 && bleStatus[2] <= 5){
-              config.setLedBrightness(config.ledBrightnessOptions[bleStatus[2]]);
-              bleSendSuccess();
-            }else{
-              bleSendError();
-            }
-          }else if(requestCode == CC_SET_BRIGHTNESS_OPTIONS){
-            if(bleLength == 9){
-              config.setLedBrightnessOptions(
-                bleStatus[2], 
-                bleStatus[3], 
-                bleStatus[4],
-                bleStatus[5], 
-                bleStatus[6], 
-                bleStatus[7]
-              );
-              bleSendSuccess();
-            }else{
-              bleSendError();
-            }
-          }else if(requestCode == CC_SET_SPEED_OPTION){
-            if(bleStatus[2] >= 0 && bleStatus[2] <= 5){
-              config.setAnimationSpeed(config.animationSpeedOptions[bleStatus[2]]);
-              bleSendSuccess();
-            }else{
-              bleSendError();
-            }
-          }else if(requestCode == CC_SET_SPEED_OPTIONS){
-            if(bleLength == 15){
-              config.setAnimationSpeedOptions(
-                bleStatus[2] << 8 | bleStatus[3], 
-                bleStatus[4] << 8 | bleStatus[5], 
-                bleStatus[6] << 8 | bleStatus[7],
-                bleStatus[8] << 8 | bleStatus[9], 
-                bleStatus[10] << 8 | bleStatus[11], 
-                bleStatus[12] << 8 | bleStatus[13]
-              );
-              bleSendSuccess();
-            }else{
-              bleSendError();
-            }
-          }else if(requestCode == CC_SET_PATTERN_SHUFFLE_DURATION){
-            if(bleLength == 4){
-              config.setPatternShuffleDuration(bleStatus[2]);
-              bleSendSuccess();
-            }else{
-              bleSendError();
-            }
-          }else{
-            debugf("Recieved message with unknown code!\n");
-            bleSendError();
-          }
+      }
+    }
+
+    void processPacket(uint8_t* bleStatus, size_t bleLength){
+      debugf("Message incoming!\n");
+      debugf("- len = %d\n", bleLength);
+      debugf("- msg = ");
+      for(int i = 0; i < bleLength; i++){
+        debugf_noprefix("0x%x ",bleStatus[i]);
+      }
+      debugf("\n");
+      
+      // Process BLE
+      if(bleLength > 0 && bleStatus[0] == 0xD2 && (!parser.inMessage() || !parser.framed)){
+        receiveV2Packet(bleStatus, bleLength);
+      }else if(parser.inMessage() && !parser.framed){
+        debugf("v1 packet during a v2 message, dropped\n");
+      }else{
+        parse(bleStatus, bleLength);
+        // v1 messages end with their packet, uploads with a packet shorter than 509 bytes
+        if(!parser.streaming() || bleLength < 509){
+          parser.endMessage();
+        }
+      }
+    }
+
+    // An upload is coming in
+    bool receiving(){
+      return parser.streaming();
+    }
+
+    // Drops the message under way, when its packets stop coming
+    void cancelMessage(){
+      parser.cancel();
+    }
+
+    // Payload bytes the messages with the code need at least, shorter ones get an error
+    size_t minimumPayload(CommCode code){
+      switch(code){
+        case CC_SET_SPEED:
+        case CC_SET_SEQUENCER:
+          return 2;
+        case CC_SET_BRIGHTNESS:
+        case CC_SET_PATTERN_SLOT:
+        case CC_SET_BANK:
+        case CC_SET_HARDWARE_VERSION:
+        case CC_SET_LED_TYPE:
+        case CC_SET_LED_COUNT:
+        case CC_SET_BRIGHTNESS_OPTION:
+        case CC_SET_SPEED_OPTION:
+        case CC_SET_LIBRARY_LAYOUT:
+          return 1;
+        default:
+          return 0;
+      }
+    }
+
+    void handleMessage(uint8_t code, const uint8_t* payload, size_t length){
+      CommCode requestCode = static_cast<CommCode>(code);
+      if(length < minimumPayload(requestCode)){
+        debugf("Message %d too short!\n", code);
+        bleSendError();
+      }else if(requestCode == CC_SET_BRIGHTNESS){
+        config.setLedBrightness(payload[0]);
+        bleSendSuccess();
+      }else if(requestCode == CC_SET_SPEED){
+        config.setAnimationSpeed(payload[0] << 8 | payload[1]);
+        bleSendSuccess();
+      }else if(requestCode == CC_SET_PATTERN_SLOT){
+        config.setPatternSlot(payload[0], true);
+        config.setDisplayState(DS_PATTERN);
+        bleSendSuccess();
+      }else if(requestCode == CC_SET_PATTERN_ALL){
+        config.setDisplayState(DS_PATTERN_ALL);
+        bleSendSuccess();
+      }else if(requestCode == CC_SET_BANK){
+        config.setPatternBank(payload[0], true);
+        config.setDisplayState(DS_PATTERN);
+        bleSendSuccess();
+      }else if(requestCode == CC_SET_BANK_ALL){
+        config.setDisplayState(DS_PATTERN_ALL_ALL);
+        bleSendSuccess();
+      }else if(requestCode == CC_GET_FW_VERSION){
+        bleSendFWVersion();
+      }else if(requestCode == CC_SET_HARDWARE_VERSION){
+        config.setHardwareVersion(payload[0]);
+        bleSendSuccess();
+      }else if(requestCode == CC_SET_LED_TYPE){
+        config.setLedType(payload[0]);
+        bleSendSuccess();
+      }else if(requestCode == CC_SET_LED_COUNT){
+        config.setLedCount(payload[0]);
+        bleSendSuccess();
+      }else if(requestCode == CC_SET_DEVICE_NAME){
+        if(length > 0 && length <= 15){
+          char name[16];
+          memcpy(name, payload, length);
+          name[length] = 0;
+          config.setDeviceName(String(name) + " Pixel Poi");
+          bleSendSuccess();
         }else{
-          if(multipartPattern == 0 && bleStatus[0] == 0xD0 && static_cast<CommCode>(bleStatus[1]) == CC_SET_PATTERN){
-            debugf("Start multipart pattern! %d bits\n", bleStatus[2] * (bleStatus[3] << 8 | bleStatus[4]));
-            multipartPattern = 1;
-            multipartPatternOffset = 0;
-            for (int i=0; i<sizeof(config.pattern); i++){
-              config.pattern[i]=0;
-            }
-            config.setFrameHeight(bleStatus[2]);
-            config.setFrameCount(bleStatus[3] << 8 | bleStatus[4]);
-            config.patternLength = config.frameHeight*config.frameCount*3;// Need exception handling for buffer overruns!!!
-            if(config.patternLength > PATTERN_PIXEL_LIMIT * 3){
-              // set error pattern
-              config.setFrameHeight(1);
-              config.setFrameCount(2);
-              config.patternLength = 6;
-              config.fillDefaultPattern();
-              config.savePattern();
-              multipartPattern = 0;
-              return;
-            }
-            
-            for (int i=5; i < bleLength; i++){
-              config.pattern[multipartPatternOffset] = bleStatus[i];
-              multipartPatternOffset++;
-            }
-          }else if(multipartPattern == 1 && bleLength < 509){
-            debugf("End multipart message!\n");
-            multipartPattern = 0;
-
-            for (int i= 0; i < bleLength - 1; i++){
-              config.pattern[multipartPatternOffset] = bleStatus[i];
-              multipartPatternOffset++;
-            }
-            
-            config.savePattern();
-          }else if(multipartPattern == 1){
-            debugf("Middle of multipart message! Offset = %d\n", multipartPatternOffset);
-            for (int i= 0; i < bleLength; i++){
-              config.pattern[multipartPatternOffset] = bleStatus[i];
-              multipartPatternOffset++;
-            }
-          }
+          bleSendError();
+        }
+      }else if(requestCode == CC_SET_SEQUENCER){
+        uint16_t sequencerLength = min((size_t)(payload[0] << 8 | payload[1]), length - 2);
+        if(config.saveSequencer(payload + 2, sequencerLength)){
+          bleSendSuccess();
+        }else{
+          bleSendError();
         }
+      }else if(requestCode == CC_START_SEQUENCER){
+        config.startTimeline();
+        bleSendSuccess();
+      }else if(requestCode == CC_SET_BRIGHTNESS_OPTION){
+        if(payload[0] <= 5){
+          config.setLedBrightness(config.ledBrightnessOptions[payload[0]]);
+          bleSendSuccess();
+        }else{
+          bleSendError();
+        }
+      }else if(requestCode == CC_SET_BRIGHTNESS_OPTIONS){
+        if(length == 6){
+          config.setLedBrightnessOptions(
+            payload[0], 
+            payload[1], 
+            payload[2],
+            payload[3], 
+            payload[4], 
+            payload[5]
+          );
+          bleSendSuccess();
+        }else{
+          bleSendError();
+        }
+      }else if(requestCode == CC_SET_SPEED_OPTION){
+        if(payload[0] <= 5){
+          config.setAnimationSpeed(config.animationSpeedOptions[payload[0]]);
+          bleSendSuccess();
+        }else{
+          bleSendError();
+        }
+      }else if(requestCode == CC_SET_SPEED_OPTIONS){
+        if(length == 12){
+          config.setAnimationSpeedOptions(
+            payload[0] << 8 | payload[1], 
+            payload[2] << 8 | payload[3], 
+            payload[4] << 8 | payload[5],
+            payload[6] << 8 | payload[7], 
+            payload[8] << 8 | payload[9], 
+            payload[10] << 8 | payload[11]
+          );
+          bleSendSuccess();
+        }else{
+          bleSendError();
+        }
+      }else if(requestCode == CC_SET_PATTERN_SHUFFLE_DURATION){
+        if(length == 1){
+          config.setPatternShuffleDuration(payload[0]);
+          bleSendSuccess();
+        }else{
+          bleSendError();
+        }
+      }else if(requestCode == CC_GET_FRAME_STATS){
+        bleSendFrameStats();
+      }else if(requestCode == CC_GET_LIBRARY){
+        bleSendLibrary();
+      }else if(requestCode == CC_SET_LIBRARY_LAYOUT){
+        uint8_t bankCount = payload[0];
+        int slotTotal = 0;
+        for(int bank = 0; bank < bankCount && 1 + bank < length; bank++){
+          slotTotal += payload[1 + bank];
+        }
+        if(bankCount > 0 && length == 1 + bankCount + slotTotal && config.changeLibraryLayout(bankCount, payload + 1, payload + 1 + bankCount)){
+          bleSendSuccess();
+        }else{
+          bleSendError();
+        }
+      }else if(requestCode == CC_GET_PATTERN_HASHES){
+        bleSendPatternHashes();
+      }else if(requestCode == CC_GET_PROTOCOL){
+        // Comes before every v2 transfer
+        setLinkFast(true);
+        resetV2();
+        bleSendProtocol();
+      }else if(requestCode == CC_LINK_PATTERN){
+        if(length == PATTERN_FILE_HEADER_SIZE && config.linkPattern(payload)){
+          bleSendSuccess();
+        }else{
+          bleSendError();
+        }
+      }else{
+        debugf("Recieved message with unknown code!\n");
+        bleSendError();
       }
     }
 
+    size_t streamHeaderSize(uint8_t code){
+      switch(static_cast<CommCode>(code)){
+        case CC_SET_PATTERN:
+          return 3;
+        case CC_SET_INDEXED_PATTERN:
+          return 3 + INDEXED_PATTERN_HEADER_SIZE;
+        case CC_SET_COMPRESSED_PATTERN:
+          return 3 + COMPRESSED_PATTERN_HEADER_SIZE;
+        case CC_SET_TIMELINE:
+          return TIMELINE_HEADER_SIZE;
+        case CC_TEST_THROUGHPUT:
+          return 4;
+        default:
+          return 0;
+      }
+    }
+
+    // Uploads are written to their file as the packets come in
+    bool beginStream(uint8_t code, const uint8_t* header, size_t length, uint32_t& remaining){
+      setLinkFast(true);
+      throughputTest = static_cast<CommCode>(code) == CC_TEST_THROUGHPUT;
+      if(throughputTest){
+        // Test data length (4 bytes)
+        throughputBytes = 0;
+        throughputStart = micros();
+        remaining = OpenPixelPoiConfig::getUInt32(header);
+        return true;
+      }
+      if(static_cast<CommCode>(code) == CC_SET_TIMELINE){
+        uint32_t uploadLength = timelineUploadLength(header);
+        if(!config.beginTimelineUpload(uploadLength)){
+          bleSendError();
+          return false;
+        }
+        config.writeUpload(header, length);
+        remaining = uploadLength - length;
+        return true;
+      }
+      // Frame height and count, then the start of the pattern data
+      uint32_t uploadLength = patternUploadLength(static_cast<CommCode>(code), header);
+      debugf("Start pattern upload! %d bytes\n", uploadLength);
+      if(uploadLength < length - 3 || !config.beginPatternUpload(patternUploadEncoding(static_cast<CommCode>(code)), header[0], header[1] << 8 | header[2], uploadLength)){
+        // set error pattern
+        config.saveDefaultPattern(1, 2);
+        bleSendError();
+        return false;
+      }
+      config.writeUpload(header + 3, length - 3);
+      remaining = uploadLength - (length - 3);
+      return true;
+    }
+
+    void streamData(const uint8_t* data, size_t length){
+      if(throughputTest){
+        throughputBytes += length;
+        return;
+      }
+      config.writeUpload(data, length);
+    }
+
+    void finishStream(){
+      debugf("End of upload!\n");
+      if(throughputTest){
+        bleSendThroughput();
+      }else if(config.finishUpload()){
+        bleSendSuccess();
+      }else{
+        bleSendError();
+      }
+    }
+
+    void cancelStream(){
+      debugf("Upload cut off!\n");
+      if(!throughputTest){
+        config.cancelUpload();
+      }
+    }
+
+    void messageError(){
+      debugf("Malformed message!\n");
+      bleSendError();
+    }
+
+    void receiveV2Packet(uint8_t* packet, size_t length){
+      uint16_t payloadLength = length >= V2_HEADER_SIZE ? packet[4] << 8 | packet[5] : 0;
+      if(length < V2_HEADER_SIZE + V2_CRC_SIZE || length != V2_HEADER_SIZE + payloadLength + V2_CRC_SIZE
+        || esp_rom_crc32_le(0, packet, length - V2_CRC_SIZE) != OpenPixelPoiConfig::getUInt32(packet + length - V2_CRC_SIZE)){
+        debugf("v2 packet damaged, dropped\n");
+        return;
+      }
+      uint16_t sequence = packet[2] << 8 | packet[3];
+      uint16_t ahead = sequence - v2Expected;
+      if(ahead >= V2_WINDOW){
+        // Seen already, its ack was lost
+        debugf("v2 packet %d is a repeat\n", sequence);
+        sendV2Ack();
+        return;
+      }
+      if(ahead > 0){
+        debugf("v2 packet %d held, %d expected\n", sequence, v2Expected);
+        memcpy(v2Window[sequence % V2_WINDOW], packet, length);
+        v2WindowLength[sequence % V2_WINDOW] = length;
+        sendV2Ack();
+        return;
+      }
+      bool last = handleV2Packet(packet);
+      // Along with the packets held for after it
+      while(v2WindowLength[v2Expected % V2_WINDOW] != 0){
+        uint8_t* held = v2Window[v2Expected % V2_WINDOW];
+        v2WindowLength[v2Expected % V2_WINDOW] = 0;
+        last = handleV2Packet(held) || last;
+      }
+      if(++v2Unacked >= V2_ACK_EVERY || last){
+        sendV2Ack();
+      }
+    }
+
+    // Hands the packet's payload to the parser, true if it ends a message
+    bool handleV2Packet(uint8_t* packet){
+      v2Expected++;
+      uint8_t flags = packet[1];
+      if(flags & V2_FIRST){
+        parser.startMessage();
+      }else if(!parser.inMessage() || parser.framed){
+        debugf("v2 packet outside a v2 message, dropped\n");
+        return flags & V2_LAST;
+      }
+      parse(packet + V2_HEADER_SIZE, packet[4] << 8 | packet[5]);
+      if(flags & V2_LAST){
+        parser.endMessage();
+      }
+      return flags & V2_LAST;
+    }
+
+    // Sets the ack without sending it
+    void setV2Ack(){
+      uint8_t ack[4] = {0xD3, (uint8_t)(v2Expected >> 8), (uint8_t)(v2Expected & 0xFF), 0};
+      for(int i = 0; i < V2_WINDOW - 1; i++){
+        if(v2WindowLength[(v2Expected + 1 + i) % V2_WINDOW] != 0){
+          ack[3] |= 1 << i;
+        }
+      }
+      pixelPoiNotifyCharacteristic->setValue(ack, sizeof(ack));
+      v2Unacked = 0;
+    }
+
+    void sendV2Ack(){
+      setV2Ack();
+      if(deviceConnected){
+        pixelPoiNotifyCharacteristic->notify();
+      }
+    }
+
+    void resetV2(){
+      memset(v2WindowLength, 0, sizeof(v2WindowLength));
+      if(parser.inMessage() && !parser.framed){
+        parser.cancel();
+      }
+      setV2Ack();
+    }
+
+    void parse(const uint8_t* data, size_t length){
+      #ifdef DEBUG
+      uint32_t start = micros();
+      #endif
+      parser.feed(data, length);
+      #ifdef DEBUG
+      parseMicros += micros() - start;
+      parsedBytes += length;
+      if(!parser.inMessage() && parsedBytes > 0){
+        debugf("- parsed %d bytes in %d us, %d KB/s\n", parsedBytes, parseMicros, parsedBytes * 1000 / max(parseMicros, (uint32_t)1));
+        parsedBytes = 0;
+        parseMicros = 0;
+      }
+      #endif
+    }
+
     void onConnect(BLEServer* pServer) {
       deviceConnected = true;
+      // The receive state starts over, in order with the packets
+      queueConnectionMarker(true);
       debugf("onConnect\n");
+      #ifdef DEBUG
+      if(disconnectedAt != 0){
+        debugf("Reconnected after %d ms\n", millis() - disconnectedAt);
+      }
+      #endif
+    }
+
+    void onConnect(BLEServer* pServer, esp_ble_gatts_cb_param_t* param) {
+      memcpy(peerAddress, param->connect.remote_bda, sizeof(peerAddress));
+      peerMtu = 23;
+      linkFast = false;
+      esp_ble_gap_set_pkt_data_len(peerAddress, LINK_DATA_LENGTH);
+    }
+
+    void onMtuChanged(BLEServer* pServer, esp_ble_gatts_cb_param_t* param) {
+      peerMtu = param->mtu.mtu;
+      debugf("MTU %d\n", peerMtu);
     }
 
     void onDisconnect(BLEServer* pServer) {
       deviceConnected = false;
+      queueConnectionMarker(false);
       debugf("onDisconnect\n");
+      #ifdef DEBUG
+      disconnectedAt = millis();
+      #endif
     }
 
 };
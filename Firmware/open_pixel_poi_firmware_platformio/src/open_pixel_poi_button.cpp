@@ -71,62 +71,51 @@ public:
         downTime = millis();
         buttonState = BS_CLICK_DOWN;
         // Trigger Waiting Animation
-        config.displayState = DS_WAITING;
-        config.displayStateLastUpdated = millis();
+        config.setDisplayState(DS_WAITING);
       }else if(buttonState == BS_CLICK_UP){ // Double Click
         downTime = millis();
         buttonState = BS_CLICK2_DOWN;
         // Trigger Waiting Animation
-        config.displayState = DS_WAITING2;
-        config.displayStateLastUpdated = millis();
+        config.setDisplayState(DS_WAITING2);
       }else if(buttonState == BS_CLICK2_UP){ // Triple Click
         downTime = millis();
         buttonState = BS_CLICK3_DOWN;
         // Trigger Waiting Animation
-        config.displayState = DS_WAITING3;
-        config.displayStateLastUpdated = millis();
+        config.setDisplayState(DS_WAITING3);
       }else if(buttonState == BS_CLICK3_UP){ // Quad Click
         downTime = millis();
         buttonState = BS_CLICK4_DOWN;
         // Trigger Waiting Animation
-        config.displayState = DS_WAITING4;
-        config.displayStateLastUpdated = millis();
+        config.setDisplayState(DS_WAITING4);
       }else if(buttonState == BS_CLICK4_UP){ // Penta Click
         downTime = millis();
         buttonState = BS_CLICK5_DOWN;
         // Trigger Waiting Animation
-        config.displayState = DS_WAITING5;
-        config.displayStateLastUpdated = millis();
+        config.setDisplayState(DS_WAITING5);
       }else if(buttonState == BS_CLICK_DOWN && millis() - downTime >= 500){ // Click Hold
         buttonState = BS_CLICK_HOLD;
         // Trigger voltage display
-        config.displayState = DS_VOLTAGE;
-        config.displayStateLastUpdated = millis();
+        config.setDisplayState(DS_VOLTAGE);
       }else if(buttonState == BS_CLICK_HOLD && millis() - downTime >= 2000){ // Click Long Hold
         buttonState = BS_CLICK_HOLD_LONG;
-        config.displayState = DS_SHUTDOWN;
-        config.displayStateLastUpdated = millis();
+        config.setDisplayState(DS_SHUTDOWN);
         shutDownAt = millis();
       }else if(buttonState == BS_CLICK2_DOWN && millis() - downTime >= 500){ // Click2 Hold
         buttonState = BS_CLICK2_HOLD;
         // Trigger bank display
-        config.displayState = DS_BANK;
-        config.displayStateLastUpdated = millis();
+        config.setDisplayState(DS_BANK);
       }else if(buttonState == BS_CLICK3_DOWN && millis() - downTime >= 500){ // Click3 Hold
         buttonState = BS_CLICK3_HOLD;
         // Trigger voltage display
-        config.displayState = DS_BRIGHTNESS;
-        config.displayStateLastUpdated = millis();
+        config.setDisplayState(DS_BRIGHTNESS);
       }else if(buttonState == BS_CLICK4_DOWN && millis() - downTime >= 500){ // Click4 Hold
         buttonState = BS_CLICK4_HOLD;
         // Trigger speed display
-        config.displayState = DS_SPEED;
-        config.displayStateLastUpdated = millis();
+        config.setDisplayState(DS_SPEED);
       }else if(buttonState == BS_CLICK5_DOWN && millis() - downTime >= 500){ // Click5 Hold
         buttonState = BS_CLICK5_HOLD;
         // Do Nothing (display pattern)
-        config.displayState = DS_PATTERN;
-        config.displayStateLastUpdated = millis();
+        config.setDisplayState(DS_PATTERN);
       }
     }else{
       if(buttonState == BS_CLICK_DOWN){
@@ -141,38 +130,30 @@ public:
         buttonState = BS_CLICK5_UP;
       }else if(buttonState == BS_CLICK_HOLD){
         buttonState = BS_INITIAL;
-        config.displayState = DS_PATTERN;
-        config.displayStateLastUpdated = millis();
+        config.setDisplayState(DS_PATTERN);
       }else if(buttonState == BS_CLICK2_HOLD){
         // 7 options, 500ms each, 0-3500ms, offset by 500 for initial press animation
         int selection = ((millis() - downTime - 500) % 3500) / 500;
         if(selection == 0){
           config.setPatternBank(0, true);
-          config.displayState = DS_PATTERN;
-          config.displayStateLastUpdated = millis();
+          config.setDisplayState(DS_PATTERN);
         }else if(selection == 1){
           config.setPatternBank(1, true);
-          config.displayState = DS_PATTERN;
-          config.displayStateLastUpdated = millis();
+          config.setDisplayState(DS_PATTERN);
         }else if(selection == 2){
           config.setPatternBank(2, true);
-          config.displayState = DS_PATTERN;
-          config.displayStateLastUpdated = millis();
+          config.setDisplayState(DS_PATTERN);
         }else if(selection == 3){
-          config.displayState = DS_PATTERN_ALL_ALL;
-          config.displayStateLastUpdated = millis();
+          config.setDisplayState(DS_PATTERN_ALL_ALL);
         }else if(selection == 4){
           config.setPatternBank(0, true);
-          config.displayState = DS_PATTERN_ALL;
-          config.displayStateLastUpdated = millis();
+          config.setDisplayState(DS_PATTERN_ALL);
         }else if(selection == 5){
           config.setPatternBank(1, true);
-          config.displayState = DS_PATTERN_ALL;
-          config.displayStateLastUpdated = millis();
+          config.setDisplayState(DS_PATTERN_ALL);
         }else{
           config.setPatternBank(2, true);
-          config.displayState = DS_PATTERN_ALL;
-          config.displayStateLastUpdated = millis();
+          config.setDisplayState(DS_PATTERN_ALL);
         }
         buttonState = BS_INITIAL;
       }else if(buttonState == BS_CLICK3_HOLD){
@@ -190,8 +171,7 @@ public:
           config.setLedBrightness(config.ledBrightnessOptions[5]);
         }
         buttonState = BS_INITIAL;
-        config.displayState = DS_PATTERN;
-        config.displayStateLastUpdated = millis();
+        config.setDisplayState(DS_PATTERN);
       }else if(buttonState == BS_CLICK4_HOLD){
         if(millis() - downTime < 1000){
           config.setAnimationSpeed(config.animationSpeedOptions[0]);
@@ -207,8 +187,7 @@ public:
           config.setAnimationSpeed(config.animationSpeedOptions[5]);
         }
         buttonState = BS_INITIAL;
-        config.displayState = DS_PATTERN;
-        config.displayStateLastUpdated = millis();
+        config.setDisplayState(DS_PATTERN);
       }else if(buttonState == BS_CLICK5_HOLD){
         buttonState = BS_INITIAL;
       }
@@ -216,33 +195,28 @@ public:
 
     // Single press detected after timeout, increment pattern
     if(buttonState == BS_CLICK_UP && millis() - downTime >= 500){
-      config.setPatternSlot((config.patternSlot + 1) % PATTERN_BANK_SIZE, true);
-      config.displayState = DS_PATTERN;
-      config.displayStateLastUpdated = millis();
+      config.setPatternSlot((config.patternSlot + 1) % config.bankSlotCount(config.patternBank), true);
+      config.setDisplayState(DS_PATTERN);
       buttonState = BS_INITIAL;
     }
     // Double press detected after timeout, do nothing
     if(buttonState == BS_CLICK2_UP && millis() - downTime >= 500){
-      config.displayState = DS_PATTERN;
-      config.displayStateLastUpdated = millis();
+      config.setDisplayState(DS_PATTERN);
       buttonState = BS_INITIAL;
     }
     // Tripple press detected after timeout, do nothing
     if(buttonState == BS_CLICK3_UP && millis() - downTime >= 500){
-      config.displayState = DS_PATTERN;
-      config.displayStateLastUpdated = millis();
+      config.setDisplayState(DS_PATTERN);
       buttonState = BS_INITIAL;
     }
     // Quad press detected after timeout, do nothing
     if(buttonState == BS_CLICK4_UP && millis() - downTime >= 500){
-      config.displayState = DS_PATTERN;
-      config.displayStateLastUpdated = millis();
+      config.setDisplayState(DS_PATTERN);
       buttonState = BS_INITIAL;
     }
     // Penta press detected after timeout, display voltage
     if(buttonState == BS_CLICK5_UP && millis() - downTime >= 500){
-      config.displayState = DS_VOLTAGE2;
-      config.displayStateLastUpdated = millis();
+      config.setDisplayState(DS_VOLTAGE2);
       buttonState = BS_INITIAL;
     }
 
@@ -257,13 +231,15 @@ public:
 
     // Super low voltage, emergency shutdown (uses data from previous read, this is ok). 
     if (config.batteryState == BAT_SHUTDOWN && config.displayState != DS_SHUTDOWN){
-      config.displayState = DS_SHUTDOWN;
-      config.displayStateLastUpdated = millis();
+      config.setDisplayState(DS_SHUTDOWN);
       shutDownAt = millis();
     }
 
     // do a shutdown if flaged
     if(shutDownAt != 0 && millis() - shutDownAt > 2000){
+      // Settings changed in the last few seconds are still only in RAM
+      config.flushSettings();
+
       // Regulator Shutdown
       digitalWrite(D7, LOW);
       delay(500);
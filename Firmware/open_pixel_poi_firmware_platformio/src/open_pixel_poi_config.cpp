@@ -4,6 +4,10 @@
 #include <FS.h>
 #include <LittleFS.h>
 #include <Preferences.h>
+#include <esp_partition.h>
+#include <esp_rom_crc.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
 #include "config.h"
 
 //#define DEBUG  // Comment this line out to remove printf statements in released version
@@ -15,6 +19,54 @@
 #define debugf_noprefix(...)
 #endif
 
+// Baked pattern files (.oppb) start with: 'O', 'B', hardwareVersion, ledType, ledCount, frameHeight, frameCount (2 bytes),
+// CRC32 of the .oppp data it was baked from (4 bytes), so a replaced pattern of the same size doesn't match
+#define BAKED_PATTERN_HEADER_SIZE 12
+
+// Pattern files (.oppp) start with: 'O', 'P', format version, encoding (PatternEncoding), frameHeight, frameCount (2 bytes),
+// color order (0 = R,G,B), length of the pattern data that follows (4 bytes), CRC32 of that data (4 bytes).
+// Files from before this header kept their geometry in NVS, they are converted once at boot (see migratePatternFiles()).
+#define PATTERN_FILE_HEADER_SIZE 16
+#define PATTERN_FILE_VERSION 1
+#define PATTERN_COLOR_ORDER_RGB 0
+// Played when a slot has no valid pattern file
+#define DEFAULT_FRAME_HEIGHT 5
+#define DEFAULT_FRAME_COUNT 5
+
+// Indexed pattern data starts with: 'O', 'I', bits per index (4 or 8), palette size - 1, palette cycle speed (2 bytes, colors per second),
+// followed by the palette (R,G,B per color) and frames of frameHeight indices, each frame padded to whole bytes (high nibble first).
+#define INDEXED_PATTERN_HEADER_SIZE 6
+
+// Compressed pattern data starts with: 'O', 'Z', length of the frame data (4 bytes), followed by frames of a 2 byte length
+// and ops. Each op byte holds the op in the top 2 bits and the pixel count - 1 (up to 64 pixels) in the low 6 bits:
+// 0 = keep the previous frame's pixels (black on the first frame), 1 = run of the R,G,B that follows, 2 = that many literal R,G,B.
+// Frames decode one at a time with only the previous frame for reference.
+#define COMPRESSED_PATTERN_HEADER_SIZE 6
+#define COMPRESSED_FRAME_LIMIT (255 * 4)
+
+// Raw "patterns" partition (see opp_partitions_pattern_store.csv, not in the default layout), one fixed region per slot
+// holding a baked header and frames.
+// The header is written last, so a region only matches after a complete bake. The 0xF0000 partition has 15 slots,
+// patterns with higher ids are baked to .oppb files instead.
+#define PATTERN_STORE_SUBTYPE 0x40
+#define PATTERN_STORE_SLOT_SIZE 0x10000
+#define PATTERN_STORE_SECTOR_SIZE 0x1000 // Erase unit
+
+// Heap left for the BLE stack when the spare pattern buffer for prefetching is allocated, it gets whatever is above this
+#define PREFETCH_HEAP_RESERVE 32768
+
+// The loader keeps this many frames loaded ahead of the renderer. It reads whole LittleFS cache blocks,
+// more of them per loop when it falls behind.
+#define LOADER_READ_AHEAD_FRAMES 16
+#define LOADER_CHUNK_SIZE 512
+#define LOADER_CHUNK_LIMIT 4096
+
+enum PatternEncoding {
+  PE_RGB,
+  PE_INDEXED,
+  PE_COMPRESSED
+};
+
 enum DisplayState {
   DS_PATTERN,
   DS_PATTERN_ALL,
@@ -38,11 +90,167 @@ enum BatteryState {
   BAT_CRITICAL,
   BAT_SHUTDOWN,
 };
+
+// Settings that are changed in RAM and written to NVS later by flushSettings(), as bits of dirtySettings
+enum DirtySetting {
+  DIRTY_BRIGHTNESS = 1 << 0,
+  DIRTY_BRIGHTNESS_OPTIONS = 1 << 1,
+  DIRTY_ANIMATION_SPEED = 1 << 2,
+  DIRTY_ANIMATION_SPEED_OPTIONS = 1 << 3,
+  DIRTY_PATTERN_SLOT = 1 << 4,
+  DIRTY_PATTERN_BANK = 1 << 5,
+  DIRTY_PATTERN_SHUFFLE_DURATION = 1 << 6,
+};
+
+// The pattern library maps banks and slots onto pattern ids, /pattern<id>.oppp. It is kept in PATTERN_LIBRARY_PATH:
+// 'O', 'L', version, bank count, slot count of each bank, pattern id of each slot (bank by bank), then the .oppp size
+// of every id (4 bytes each, 0 = none) and the content hash of every id (4 bytes each). Nothing at runtime needs a
+// directory listing. Slots can share an id, a slot written to while shared gets an id of its own (writablePatternId()).
+// Version 1 libraries had no hashes, they are taken from the pattern files once.
+#define PATTERN_LIBRARY_PATH "/library.opli"
+#define PATTERN_LIBRARY_UPLOAD_PATH "/library.tmp"
+#define PATTERN_LIBRARY_VERSION 2
+#define PATTERN_LIBRARY_LIMIT 64 // Pattern ids, and slots over all banks
+#define PATTERN_LIBRARY_BANK_LIMIT 16
+
+struct PatternLibrary {
+  uint8_t bankCount;
+  uint8_t bankStart[PATTERN_LIBRARY_BANK_LIMIT + 1]; // Position of each bank's first slot, bankStart[bankCount] = slots in all banks
+  uint8_t slots[PATTERN_LIBRARY_LIMIT]; // Pattern id of each position
+  uint32_t sizes[PATTERN_LIBRARY_LIMIT]; // .oppp bytes of each pattern id, 0 = none
+  uint32_t hashes[PATTERN_LIBRARY_LIMIT]; // Content hash of each pattern id, see patternContentHash()
+  uint32_t usedBytes; // Sum of sizes
+};
+
+// Compiled show timeline (TIMELINE_PATH, uploaded with CC_SET_TIMELINE): 'O', 'T', version, 0, step count (4 bytes),
+// length of the steps (4 bytes), then per step: record length, start (4 bytes, ms from the start of the show),
+// pattern (library position, bankStart[bank] + slot), flags, brightness if TS_BRIGHTNESS, speed (2 bytes) if TS_SPEED.
+// Steps are read one at a time while the show plays, fields a reader doesn't know are skipped using the record length.
+// Version 1 timelines had the start in us, which wraps after 71 minutes. They are still read.
+#define TIMELINE_PATH "/timeline.oppt"
+#define TIMELINE_UPLOAD_PATH "/timeline.tmp"
+#define TIMELINE_HEADER_SIZE 12
+#define TIMELINE_VERSION 2
+// A step is planned (and its pattern prefetched) once it is this close. Deadlines are 32 bit micros(), which only
+// compare right within 35 minutes of now.
+#define TIMELINE_PLAN_AHEAD 60000000LL
+#define TIMELINE_STEP_MIN_SIZE 7
+#define TIMELINE_STEP_MAX_SIZE 32
+
+enum TimelineFlags {
+  TS_BRIGHTNESS = 1 << 0,
+  TS_SPEED = 1 << 1,
+};
+
+struct TimelineStep {
+  uint32_t start; // ms from the start of the show
+  uint8_t pattern;
+  uint8_t flags;
+  uint8_t brightness;
+  uint16_t speed;
+};
+
+// Quiet time after the last settings change before they are written, so slider drags cost one NVS write
+#define SETTINGS_FLUSH_DELAY 2000
+
+#define FRAME_STATS_LOOP_BUCKETS 8
+#define FRAME_STATS_LATENCY_BUCKETS 8
+
+// Render counters, filled in by OpenPixelPoiLED and the pattern loader, read (then reset) over BLE with CC_GET_FRAME_STATS
+struct FrameStats {
+  uint32_t framesShown; // Pattern frames output
+  uint32_t framesSkipped; // Pattern frames that were due but never shown because the loop was too slow
+  uint32_t maxFrameGapMicros; // Longest time between two pattern frames
+  uint32_t busBlockedCount; // Show() calls that had to wait for the previous transfer
+  uint32_t busWaitMicros; // Time spent inside Show()
+  uint32_t loopHistogram[FRAME_STATS_LOOP_BUCKETS]; // LED loop period, bucket n counts loops shorter than 16 << n us, the last bucket the rest
+  uint32_t maxFrameLatencyMicros; // Longest delay between a frame boundary and the render task starting on that frame
+  uint32_t latencyHistogram[FRAME_STATS_LATENCY_BUCKETS]; // Frame start latency (jitter), bucket n counts frames started less than 4 << n us late, the last bucket the rest
+  uint32_t patternTransitions; // Shuffle and timeline steps taken
+  uint32_t transitionsNotPrefetched; // Steps that were loaded at their deadline, because the spare buffer was too small
+  uint32_t maxTransitionLatencyMicros; // Longest delay between a step's deadline and its first frame
+  uint32_t loaderStalls; // Times the renderer reached a frame that wasn't loaded yet, and held the last loaded one
+  uint32_t loaderStallMicros; // Time spent holding
+  uint32_t settingsWritesAvoided; // NVS writes saved by coalescing settings changes
+};
+
+// A pattern ready to play, or loading. One is playing, the other is the spare the next shuffle or timeline step is prefetched into.
+struct LoadedPattern {
+  uint8_t index; // Pattern id, see PatternLibrary
+  uint8_t frameHeight;
+  uint16_t frameCount;
+  uint32_t crc; // CRC32 of the pattern data, from the file header
+  bool baked; // true = frames hold ledCount pixels per frame in the strip's wire order
+  // How the .oppp is stored. Compressed patterns are decoded to RGB while loading,
+  // indexed patterns keep palette indices in frames and the renderer looks the colors up (rotated by the cycle speed)
+  PatternEncoding encoding;
+  uint8_t* buffer; // RAM for frames that are not played straight from the pattern store
+  uint32_t bufferSize;
+  const uint8_t* frames; // What the renderer plays, either buffer or a slot of the mapped pattern store
+  uint32_t frameBytes; // Size of one frame in frames
+  uint16_t playbackFrameCount; // Frames that fit the buffer, uploads can be larger than it
+  uint8_t indexBits;
+  uint16_t paletteCount;
+  uint16_t paletteCycleSpeed;
+  uint8_t palette[256 * 3];
+  // Loader state, see continueLoadingPattern()
+  File file;
+  uint16_t fileHeaderSize;
+  uint16_t framesLoaded; // Compressed frames decoded into buffer so far
+  uint16_t framesResident; // Frames of frames that are loaded, the renderer holds the last one until the loader is further
+  uint16_t playbackCursor; // Frame the renderer is on, set by the renderer
+  #ifdef DEBUG
+  uint32_t decodeMicros;
+  #endif
+};
+
+// The next shuffle or timeline step. It is dropped when the state it was planned from changes.
+struct PatternTransition {
+  DisplayState displayState;
+  long stateUpdated; // displayStateLastUpdated when planned
+  uint32_t deadline; // micros() the step is due
+  uint8_t slot;
+  uint8_t bank;
+  bool fromTimeline;
+  uint32_t timelineStep; // Number of the step, and the step itself, when fromTimeline
+  TimelineStep step;
+};
   
 class OpenPixelPoiConfig {
   private:
     Preferences preferences;
-    File patternFile;
+    File uploadFile;
+    uint8_t uploadFrameHeight;
+    uint16_t uploadFrameCount;
+    PatternEncoding uploadEncoding;
+    bool uploadTimeline = false; // The upload is a timeline, not a pattern
+    uint32_t uploadCrc;
+    uint8_t uploadId; // Pattern id the upload is written to, it replaces the pattern at uploadPosition
+    uint8_t uploadPosition;
+    char pathBuffer[24];
+    PatternLibrary library;
+    const esp_partition_t* storePartition = NULL;
+    const uint8_t* storeMap = NULL; // The whole store partition, mapped through the flash cache
+    spi_flash_mmap_handle_t storeMapHandle;
+    uint8_t rgbFrameBuffer[255 * 3];
+    uint8_t bakedFrameBuffer[255 * 3];
+    uint8_t compressedFrameBuffer[COMPRESSED_FRAME_LIMIT];
+    LoadedPattern loadedPatterns[2];
+    LoadedPattern* prefetched = &loadedPatterns[1];
+    // Patterns waiting to be baked by loop(), they play from their .oppp until then. baking is only used by bakeQueuedPattern().
+    bool bakeQueued[PATTERN_LIBRARY_LIMIT] = {};
+    LoadedPattern baking;
+    // Planned step, prefetched into *prefetched. Once transitionReady the render task swaps it in at the deadline (commitTransition()).
+    PatternTransition transition;
+    bool transitionPlanned = false;
+    bool transitionReady = false;
+    // Show playing from TIMELINE_PATH, timelineNext is the step after the current one once read
+    File timelineFile;
+    uint32_t timelineStepCount;
+    uint32_t timelineStepsTaken;
+    TimelineStep timelineNext;
+    bool timelineNextRead = false;
+    uint8_t timelineVersion;
     
   public:
     // Runtime State
@@ -50,6 +258,8 @@ class OpenPixelPoiConfig {
     BatteryState batteryState = BAT_OK;
     DisplayState displayState = DS_PATTERN;
     long displayStateLastUpdated = 0;
+    FrameStats frameStats = {};
+    uint32_t frameStatsSince = 0;
     // Hardware Settings (Defaults from config.h but can be overriden using the app) 
     uint8_t hardwareVersion;
     uint8_t ledType;
@@ -64,32 +274,48 @@ class OpenPixelPoiConfig {
     uint8_t patternBank;
     uint8_t patternShuffleDuration;
     // Pattern
-    uint8_t frameHeight; 
-    uint16_t frameCount;
-    uint8_t *pattern = (uint8_t *) malloc(PATTERN_PIXEL_LIMIT * 3 * sizeof(uint8_t));
+    LoadedPattern* playing = &loadedPatterns[0];
     uint32_t patternLength;
-    // Sequencer
-    uint8_t *sequencer = (uint8_t *) malloc(1785*sizeof(uint8_t)); // 255 Instruction max (7 bits per instruction)
-    uint16_t sequencerLength;
-    int sequencerStep;
-    ulong sequencerDelayed;
+    uint32_t paletteVersion = 0; // Bumped whenever the playing palette changes
+    // Held by the render task while it reads the pattern, and by the main loop while it swaps, starts or loads playing or a ready transition.
+    // The main loop also holds it to change what the render task reads or writes itself: the display state, brightness, speed, slot and bank.
+    SemaphoreHandle_t patternLock;
+    // Upload in progress, see beginPatternUpload()
+    uint32_t uploadLength = 0;
+    uint32_t uploadOffset = 0;
+    // Timeline
+    bool timelineRunning = false;
+    int64_t timelineStartMicros; // esp_timer_get_time(), doesn't wrap like micros()
+    // Exact start of the pattern a transition swapped in, while displayStateLastUpdated is still patternStartState
+    long patternStartState = -1;
+    uint32_t patternStartMicros;
 
     // Variables
     long configLastUpdated;
+    uint8_t dirtySettings = 0;
+    uint32_t settingsChangedAt;
+
+    void resetFrameStats() {
+      memset(&frameStats, 0, sizeof(frameStats));
+      frameStatsSince = micros();
+    }
 
     void setHardwareVersion(uint8_t hardwareVersion) {
       debugf("Save Hardware Version = %d\n", hardwareVersion);
       preferences.putChar("hardwareVersion", hardwareVersion);
+      removeBakedPatterns();
     }
 
     void setLedType(uint8_t ledType) {
       debugf("Save LED Type = %d\n", ledBrightness);
       preferences.putChar("ledType", ledType);
+      removeBakedPatterns();
     }
 
     void setLedCount(uint8_t ledCount) {
       debugf("Save LED Count = %d\n", ledCount);
       preferences.putChar("ledCount", ledCount);
+      removeBakedPatterns();
     }
 
     void setDeviceName(String deviceName) {
@@ -97,10 +323,69 @@ class OpenPixelPoiConfig {
       preferences.putString("deviceName", deviceName);
     }
 
+    // Setting changes are applied right away and written to NVS by flushSettings(). keys = the NVS writes the setting takes.
+    void markSettingDirty(DirtySetting setting, uint8_t keys) {
+      if(dirtySettings & setting){
+        frameStats.settingsWritesAvoided += keys;
+      }
+      dirtySettings |= setting;
+      settingsChangedAt = millis();
+    }
+
+    // Writes the changed settings to NVS. Called once they have been quiet for SETTINGS_FLUSH_DELAY, and before powering off.
+    void flushSettings() {
+      if(dirtySettings == 0){
+        return;
+      }
+      debugf("Flush Settings = 0x%02X\n", dirtySettings);
+      if(dirtySettings & DIRTY_BRIGHTNESS){
+        preferences.putChar("brightness", this->ledBrightness);
+      }
+      if(dirtySettings & DIRTY_BRIGHTNESS_OPTIONS){
+        preferences.putChar("brightnessOption0", this->ledBrightnessOptions[0]);
+        preferences.putChar("brightnessOption1", this->ledBrightnessOptions[1]);
+        preferences.putChar("brightnessOption2", this->ledBrightnessOptions[2]);
+        preferences.putChar("brightnessOption3", this->ledBrightnessOptions[3]);
+        preferences.putChar("brightnessOption4", this->ledBrightnessOptions[4]);
+        preferences.putChar("brightnessOption5", this->ledBrightnessOptions[5]);
+      }
+      if(dirtySettings & DIRTY_ANIMATION_SPEED){
+        preferences.putUShort("animationSpeed", this->animationSpeed);
+      }
+      if(dirtySettings & DIRTY_ANIMATION_SPEED_OPTIONS){
+        preferences.putUShort("animationSpeedOption0", this->animationSpeedOptions[0]);
+        preferences.putUShort("animationSpeedOption1", this->animationSpeedOptions[1]);
+        preferences.putUShort("animationSpeedOption2", this->animationSpeedOptions[2]);
+        preferences.putUShort("animationSpeedOption3", this->animationSpeedOptions[3]);
+        preferences.putUShort("animationSpeedOption4", this->animationSpeedOptions[4]);
+        preferences.putUShort("animationSpeedOption5", this->animationSpeedOptions[5]);
+      }
+      if(dirtySettings & DIRTY_PATTERN_SLOT){
+        preferences.putChar("patternSlot", this->patternSlot);
+      }
+      if(dirtySettings & DIRTY_PATTERN_BANK){
+        preferences.putChar("patternBank", this->patternBank);
+      }
+      if(dirtySettings & DIRTY_PATTERN_SHUFFLE_DURATION){
+        preferences.putChar("patternShuffleDuration", this->patternShuffleDuration);
+      }
+      dirtySettings = 0;
+    }
+
+    // The render task reads the display state and when it changed, the two change together
+    void setDisplayState(DisplayState displayState){
+      xSemaphoreTake(patternLock, portMAX_DELAY);
+      this->displayState = displayState;
+      this->displayStateLastUpdated = millis();
+      xSemaphoreGive(patternLock);
+    }
+
     void setLedBrightness(uint8_t ledBrightness) {
       debugf("Save Brightness = %d\n", ledBrightness);
+      xSemaphoreTake(patternLock, portMAX_DELAY);
       this->ledBrightness = ledBrightness;
-      preferences.putChar("brightness", this->ledBrightness);
+      xSemaphoreGive(patternLock);
+      markSettingDirty(DIRTY_BRIGHTNESS, 1);
       this->configLastUpdated = millis();
     }
 
@@ -112,19 +397,16 @@ class OpenPixelPoiConfig {
       this->ledBrightnessOptions[3] = max((uint8_t)1, min((uint8_t)100, b3));
       this->ledBrightnessOptions[4] = max((uint8_t)1, min((uint8_t)100, b4));
       this->ledBrightnessOptions[5] = max((uint8_t)1, min((uint8_t)100, b5));
-      preferences.putChar("brightnessOption0", this->ledBrightnessOptions[0]);
-      preferences.putChar("brightnessOption1", this->ledBrightnessOptions[1]);
-      preferences.putChar("brightnessOption2", this->ledBrightnessOptions[2]);
-      preferences.putChar("brightnessOption3", this->ledBrightnessOptions[3]);
-      preferences.putChar("brightnessOption4", this->ledBrightnessOptions[4]);
-      preferences.putChar("brightnessOption5", this->ledBrightnessOptions[5]);
+      markSettingDirty(DIRTY_BRIGHTNESS_OPTIONS, 6);
       this->configLastUpdated = millis();
     }
     
     void setAnimationSpeed(uint16_t animationSpeed) {
       debugf("Save Speed = %d\n", animationSpeed);
+      xSemaphoreTake(patternLock, portMAX_DELAY);
       this->animationSpeed = animationSpeed;
-      preferences.putUShort("animationSpeed", this->animationSpeed);
+      xSemaphoreGive(patternLock);
+      markSettingDirty(DIRTY_ANIMATION_SPEED, 1);
       this->configLastUpdated = millis();
     }
 
@@ -136,41 +418,38 @@ class OpenPixelPoiConfig {
       this->animationSpeedOptions[3] = max((uint16_t)1, min((uint16_t)2000, s3));
       this->animationSpeedOptions[4] = max((uint16_t)1, min((uint16_t)2000, s4));
       this->animationSpeedOptions[5] = max((uint16_t)1, min((uint16_t)2000, s5));
-      preferences.putUShort("animationSpeedOption0", this->animationSpeedOptions[0]);
-      preferences.putUShort("animationSpeedOption1", this->animationSpeedOptions[1]);
-      preferences.putUShort("animationSpeedOption2", this->animationSpeedOptions[2]);
-      preferences.putUShort("animationSpeedOption3", this->animationSpeedOptions[3]);
-      preferences.putUShort("animationSpeedOption4", this->animationSpeedOptions[4]);
-      preferences.putUShort("animationSpeedOption5", this->animationSpeedOptions[5]);
+      markSettingDirty(DIRTY_ANIMATION_SPEED_OPTIONS, 6);
       this->configLastUpdated = millis();
     }
 
     void setPatternSlot(uint8_t patternSlot, bool save) {
       debugf("Save Pattern Slot = %d\n", patternSlot);
-      this->patternSlot = patternSlot;
+      xSemaphoreTake(patternLock, portMAX_DELAY);
+      this->patternSlot = patternSlot % bankSlotCount(this->patternBank);
+      xSemaphoreGive(patternLock);
       if(save){
-        preferences.putChar("patternSlot", this->patternSlot);
+        markSettingDirty(DIRTY_PATTERN_SLOT, 1);
       }
 
-      loadFrameHeight();
-      loadFrameCount();
-      startLoadingPattern();
+      loadPattern();
 
       debugf("- frame\n");
-      debugf("  - height = %d\n", this->frameHeight);
-      debugf("  - count = %d\n", this->frameCount);
+      debugf("  - height = %d\n", playing->frameHeight);
+      debugf("  - count = %d\n", playing->frameCount);
       
       this->configLastUpdated = millis();
     }
 
     void setPatternBank(uint8_t patternBank, bool save) {
-      this->patternBank = patternBank;
+      xSemaphoreTake(patternLock, portMAX_DELAY);
+      this->patternBank = patternBank % library.bankCount;
+      this->patternSlot %= bankSlotCount(this->patternBank);
+      xSemaphoreGive(patternLock);
       if(save){
-        preferences.putChar("patternBank", this->patternBank);
+        markSettingDirty(DIRTY_PATTERN_BANK, 1);
+        markSettingDirty(DIRTY_PATTERN_SLOT, 1);
       }
-      loadFrameHeight();
-      loadFrameCount();
-      startLoadingPattern();
+      loadPattern();
       
       this->configLastUpdated = millis();
     }
@@ -178,146 +457,1257 @@ class OpenPixelPoiConfig {
     void setPatternShuffleDuration(uint8_t patternShuffleDuration) {
       debugf("Save Pattern Shuffle Duration = %d\n", patternShuffleDuration);
       this->patternShuffleDuration = patternShuffleDuration;
-      preferences.putChar("patternShuffleDuration", this->patternShuffleDuration);
-      this->configLastUpdated = millis();
-    }
-    
-    void setFrameHeight(uint8_t frameHeight) {
-      this->frameHeight = frameHeight;
-      String key = "p";
-      key += this->patternSlot + (this->patternBank * PATTERN_BANK_SIZE);
-      key += "Height";
-      preferences.putChar(key.c_str(), this->frameHeight);
-      this->configLastUpdated = millis();
-    }
-    
-    void setFrameCount(uint16_t frameCount) {
-      this->frameCount = frameCount;
-      String key = "p";
-      key += this->patternSlot + (this->patternBank * PATTERN_BANK_SIZE);
-      key += "FCount";
-      preferences.putUShort(key.c_str(), this->frameCount);
+      markSettingDirty(DIRTY_PATTERN_SHUFFLE_DURATION, 1);
       this->configLastUpdated = millis();
     }
     
+    // Saves the playing pattern's RAM frames (patternLength bytes of RGB) as the current slot's pattern
     void savePattern() {
+      LoadedPattern& p = *playing;
       debugf("Save Pattern\n");
       debugf("- length = %d", this->patternLength);
       for (int i=0; i<this->patternLength; i+=3) {
-        if (i%this->frameHeight*3 == 0) {
+        if (i%p.frameHeight*3 == 0) {
           debugf_noprefix("\n");
           debugf("  ");
         }
-        debugf_noprefix("0x%02X%02X%02X ", this->pattern[i], this->pattern[i+1], this->pattern[i+2]);
+        debugf_noprefix("0x%02X%02X%02X ", p.buffer[i], p.buffer[i+1], p.buffer[i+2]);
       }
       debugf_noprefix("\n");
 
-      File file = LittleFS.open(String("/pattern") + (this->patternSlot + (this->patternBank * PATTERN_BANK_SIZE)) + ".oppp", FILE_WRITE);
+      uint8_t position = library.bankStart[this->patternBank] + this->patternSlot;
+      uint8_t id = writablePatternId(position);
+      if(id == PATTERN_LIBRARY_LIMIT){
+        debugf("− no pattern id free\n");
+        return;
+      }
+      File file = LittleFS.open(patternPath(id, ".oppp"), FILE_WRITE);
       if(!file || file.isDirectory()){
         debugf("− failed to open file for writing\n");
       }else{
         debugf(" - opened file for writing: %d\n");
         
-        int written = file.write(pattern, patternLength);
+        uint8_t header[PATTERN_FILE_HEADER_SIZE];
+        fillPatternHeader(header, PE_RGB, p.frameHeight, p.frameCount, patternLength, esp_rom_crc32_le(0, p.buffer, patternLength));
+        file.write(header, PATTERN_FILE_HEADER_SIZE);
+        int written = file.write(p.buffer, patternLength);
         file.close();
         debugf(" - this much written: %d\n", written);
+        library.slots[position] = id;
+        setPatternFile(id, PATTERN_FILE_HEADER_SIZE + written, patternContentHash(header));
+      }
+
+      // The original RGB file is kept as is, playback uses the baked copy
+      if(LittleFS.exists(patternPath(id, ".oppb"))){
+        LittleFS.remove(patternPath(id, ".oppb"));
       }
+      p.index = id;
+      bakeQueued[id] = true;
       
       this->configLastUpdated = millis();
     }
 
-    void fillDefaultPattern(){
-      for (int i=0; i < this->frameCount; i++) {
-        for (int j=0; j < this->frameHeight; j++) {
+    // Uploads stream into a temporary file next to the slot's pattern and replace it once complete. The playing
+    // pattern is untouched until then, and the upload size is only limited by the filesystem, not RAM.
+    // Returns false if the pattern has no pixels or doesn't fit.
+    bool beginPatternUpload(PatternEncoding encoding, uint8_t frameHeight, uint16_t frameCount, uint32_t length){
+      cancelUpload();
+      if(frameHeight == 0 || frameCount == 0 || (encoding == PE_COMPRESSED && !compressedLengthFits(frameCount, length))){
+        debugf("- upload of %dx%d pixels in %d bytes refused\n", frameHeight, frameCount, length);
+        return false;
+      }
+      uploadPosition = library.bankStart[this->patternBank] + this->patternSlot;
+      uploadId = writablePatternId(uploadPosition);
+      if(uploadId == PATTERN_LIBRARY_LIMIT){
+        debugf("- no pattern id free for the upload\n");
+        return false;
+      }
+      size_t freeBytes = libraryFreeBytes() + library.sizes[uploadId]; // Replaced by the upload
+      if(length == 0 || PATTERN_FILE_HEADER_SIZE + length > freeBytes){
+        debugf("- upload of %d bytes doesn't fit, %d free\n", length, freeBytes);
+        return false;
+      }
+      uploadFile = LittleFS.open(patternPath(uploadId, ".tmp"), FILE_WRITE);
+      if(!uploadFile){
+        return false;
+      }
+      uploadTimeline = false;
+      // Room for the header, it is written once the checksum is known
+      uint8_t header[PATTERN_FILE_HEADER_SIZE] = {};
+      uploadFile.write(header, PATTERN_FILE_HEADER_SIZE);
+      uploadEncoding = encoding;
+      uploadFrameHeight = frameHeight;
+      uploadFrameCount = frameCount;
+      uploadLength = length;
+      uploadOffset = 0;
+      uploadCrc = 0;
+      return true;
+    }
+
+    // Takes a compiled timeline, it replaces TIMELINE_PATH once complete (finishUpload())
+    bool beginTimelineUpload(uint32_t length){
+      cancelUpload();
+      size_t freeBytes = LittleFS.totalBytes() - LittleFS.usedBytes();
+      File previous = LittleFS.open(TIMELINE_PATH);
+      if(previous){
+        freeBytes += previous.size();
+        previous.close();
+      }
+      if(length < TIMELINE_HEADER_SIZE || length > freeBytes){
+        debugf("- timeline of %d bytes doesn't fit, %d free\n", length, freeBytes);
+        return false;
+      }
+      uploadFile = LittleFS.open(TIMELINE_UPLOAD_PATH, FILE_WRITE);
+      if(!uploadFile){
+        return false;
+      }
+      uploadTimeline = true;
+      uploadLength = length;
+      uploadOffset = 0;
+      uploadCrc = 0;
+      return true;
+    }
+
+    void writeUpload(const uint8_t* data, size_t length){
+      if(!uploadFile){
+        return;
+      }
+      length = min(length, (size_t)(uploadLength - uploadOffset));
+      if(uploadFile.write(data, length) != length){
+        debugf("- upload write failed\n");
+        cancelUpload();
+        return;
+      }
+      uploadCrc = esp_rom_crc32_le(uploadCrc, data, length);
+      uploadOffset += length;
+    }
+
+    void cancelUpload(){
+      if(uploadFile){
+        uploadFile.close();
+        LittleFS.remove(uploadTimeline ? TIMELINE_UPLOAD_PATH : patternPath(uploadId, ".tmp"));
+      }
+    }
+
+    bool finishUpload(){
+      return uploadTimeline ? finishTimelineUpload() : finishPatternUpload();
+    }
+
+    bool finishTimelineUpload(){
+      if(!uploadFile){
+        return false;
+      }
+      bool complete = uploadOffset == uploadLength;
+      uploadFile.close();
+      File file = LittleFS.open(TIMELINE_UPLOAD_PATH);
+      uint32_t stepCount;
+      uint8_t version;
+      bool valid = complete && readTimelineHeader(file, stepCount, version);
+      if(file){
+        file.close();
+      }
+      stopTimeline();
+      if(!valid || !LittleFS.rename(TIMELINE_UPLOAD_PATH, TIMELINE_PATH)){
+        debugf("- invalid timeline\n");
+        LittleFS.remove(TIMELINE_UPLOAD_PATH);
+        return false;
+      }
+      debugf("- timeline of %d steps\n", stepCount);
+      return true;
+    }
+
+    // Replaces the slot's pattern with the upload and starts playing it. Returns false if it wasn't stored, or can't be
+    // played and the placeholder plays instead.
+    bool finishPatternUpload(){
+      if(!uploadFile){
+        return false;
+      }
+      // Short uploads are padded with black, like the zeroed buffer they used to be written into
+      memset(rgbFrameBuffer, 0, sizeof(rgbFrameBuffer));
+      while(uploadOffset < uploadLength){
+        size_t padding = min(sizeof(rgbFrameBuffer), (size_t)(uploadLength - uploadOffset));
+        uploadFile.write(rgbFrameBuffer, padding);
+        uploadCrc = esp_rom_crc32_le(uploadCrc, rgbFrameBuffer, padding);
+        uploadOffset += padding;
+      }
+      uint8_t header[PATTERN_FILE_HEADER_SIZE];
+      fillPatternHeader(header, uploadEncoding, uploadFrameHeight, uploadFrameCount, uploadLength, uploadCrc);
+      bool written = uploadFile.seek(0) && uploadFile.write(header, PATTERN_FILE_HEADER_SIZE) == PATTERN_FILE_HEADER_SIZE;
+      uploadFile.close();
+      // LittleFS renames replace the destination atomically, a power cut leaves either the old or the new pattern
+      if(!written || !replacePatternFile(uploadId)){
+        debugf("- failed to replace pattern\n");
+        LittleFS.remove(patternPath(uploadId, ".tmp"));
+        return false;
+      }
+      if(LittleFS.exists(patternPath(uploadId, ".oppb"))){
+        LittleFS.remove(patternPath(uploadId, ".oppb"));
+      }
+      if(uploadPosition < library.bankStart[library.bankCount]){
+        library.slots[uploadPosition] = uploadId;
+      }
+      setPatternFile(uploadId, PATTERN_FILE_HEADER_SIZE + uploadLength, patternContentHash(header));
+
+      xSemaphoreTake(patternLock, portMAX_DELAY);
+      dropTransition();
+      bool playable = startPlayingPattern(patternId());
+      xSemaphoreGive(patternLock);
+      this->configLastUpdated = millis();
+      return playable;
+    }
+
+    // Switches playback to the current slot's pattern
+    void loadPattern(){
+      #ifdef DEBUG
+      uint32_t start = micros();
+      #endif
+      xSemaphoreTake(patternLock, portMAX_DELAY);
+      dropTransition();
+      startPlayingPattern(patternId());
+      xSemaphoreGive(patternLock);
+      debugf("- pattern switch took %d us\n", micros() - start);
+    }
+
+    // Replaces the current slot's pattern with the blinking placeholder
+    void saveDefaultPattern(uint8_t frameHeight, uint16_t frameCount){
+      xSemaphoreTake(patternLock, portMAX_DELAY);
+      dropTransition();
+      if(playing->file){
+        playing->file.close();
+      }
+      playing->frameHeight = frameHeight;
+      playing->frameCount = frameCount;
+      fillDefaultPattern(*playing);
+      xSemaphoreGive(patternLock);
+      patternLength = frameHeight * frameCount * 3;
+      savePattern();
+    }
+
+    uint8_t patternId(uint8_t bank, uint8_t slot){
+      return library.slots[library.bankStart[bank] + slot];
+    }
+
+    // Of the current slot
+    uint8_t patternId(){
+      return patternId(this->patternBank, this->patternSlot);
+    }
+
+    uint8_t bankCount(){
+      return library.bankCount;
+    }
+
+    uint8_t bankSlotCount(uint8_t bank){
+      return library.bankStart[bank + 1] - library.bankStart[bank];
+    }
+
+    // Bank and slot of a library position (bankStart[bank] + slot), false if there is no such position
+    bool librarySlot(uint8_t position, uint8_t& bank, uint8_t& slot){
+      for(bank = 0; bank < library.bankCount; bank++){
+        if(position < library.bankStart[bank + 1]){
+          slot = position - library.bankStart[bank];
+          return true;
+        }
+      }
+      return false;
+    }
+
+    uint32_t libraryFreeBytes(){
+      return LittleFS.totalBytes() - LittleFS.usedBytes();
+    }
+
+    // .oppp bytes of all patterns, whether in a slot or not
+    uint32_t libraryPatternBytes(){
+      return library.usedBytes;
+    }
+
+    // Reads PATTERN_LIBRARY_PATH, or lays out a new library over the patterns from before it
+    void loadLibrary(){
+      File file = LittleFS.open(PATTERN_LIBRARY_PATH);
+      uint8_t version = 0;
+      bool loaded = readLibrary(file, version);
+      if(file){
+        file.close();
+      }
+      if(!loaded){
+        debugf("- new pattern library\n");
+        uint8_t slotCounts[PATTERN_BANK_COUNT];
+        uint8_t ids[PATTERN_BANK_COUNT * PATTERN_BANK_SIZE];
+        for(int i = 0; i < PATTERN_BANK_COUNT * PATTERN_BANK_SIZE; i++){
+          slotCounts[i / PATTERN_BANK_SIZE] = PATTERN_BANK_SIZE;
+          ids[i] = i;
+        }
+        setLibraryLayout(PATTERN_BANK_COUNT, slotCounts, ids);
+      }
+      if(!loaded || version < PATTERN_LIBRARY_VERSION){
+        scanPatternFiles();
+        saveLibrary();
+      }
+      debugf("- pattern library: %d banks, %d slots, %d bytes of patterns\n", library.bankCount, library.bankStart[library.bankCount], library.usedBytes);
+    }
+
+    // Sizes and hashes every pattern id from its file. Done once, after this they are kept up to date as patterns are written.
+    void scanPatternFiles(){
+      library.usedBytes = 0;
+      for(int id = 0; id < PATTERN_LIBRARY_LIMIT; id++){
+        File pattern = LittleFS.open(patternPath(id, ".oppp"));
+        uint8_t header[PATTERN_FILE_HEADER_SIZE];
+        bool valid = pattern && !pattern.isDirectory() && pattern.read(header, PATTERN_FILE_HEADER_SIZE) == PATTERN_FILE_HEADER_SIZE;
+        library.sizes[id] = valid ? pattern.size() : 0;
+        library.hashes[id] = valid ? patternContentHash(header) : 0;
+        library.usedBytes += library.sizes[id];
+        if(pattern){
+          pattern.close();
+        }
+      }
+    }
+
+    // Sets version to the file's, hashes are only read from PATTERN_LIBRARY_VERSION files
+    bool readLibrary(File& file, uint8_t& version){
+      uint8_t header[4];
+      if(!file || file.isDirectory() || file.read(header, sizeof(header)) != sizeof(header)){
+        return false;
+      }
+      version = header[2];
+      if(header[0] != 'O' || header[1] != 'L' || version == 0 || version > PATTERN_LIBRARY_VERSION || header[3] == 0 || header[3] > PATTERN_LIBRARY_BANK_LIMIT){
+        return false;
+      }
+      uint8_t slotCounts[PATTERN_LIBRARY_BANK_LIMIT];
+      uint8_t ids[PATTERN_LIBRARY_LIMIT];
+      uint8_t sizes[PATTERN_LIBRARY_LIMIT * 4];
+      if(file.read(slotCounts, header[3]) != header[3]){
+        return false;
+      }
+      int slotTotal = 0;
+      for(int bank = 0; bank < header[3]; bank++){
+        slotTotal += slotCounts[bank];
+      }
+      if(slotTotal > PATTERN_LIBRARY_LIMIT || file.read(ids, slotTotal) != slotTotal || file.read(sizes, sizeof(sizes)) != sizeof(sizes)){
+        return false;
+      }
+      if(!setLibraryLayout(header[3], slotCounts, ids)){
+        return false;
+      }
+      library.usedBytes = 0;
+      for(int id = 0; id < PATTERN_LIBRARY_LIMIT; id++){
+        library.sizes[id] = getUInt32(sizes + id * 4);
+        library.usedBytes += library.sizes[id];
+      }
+      if(version == PATTERN_LIBRARY_VERSION){
+        // Read into sizes, it is done with
+        if(file.read(sizes, sizeof(sizes)) != sizeof(sizes)){
+          return false;
+        }
+        for(int id = 0; id < PATTERN_LIBRARY_LIMIT; id++){
+          library.hashes[id] = getUInt32(sizes + id * 4);
+        }
+      }
+      return true;
+    }
+
+    void saveLibrary(){
+      File file = LittleFS.open(PATTERN_LIBRARY_UPLOAD_PATH, FILE_WRITE);
+      if(!file){
+        debugf("− failed to save the pattern library\n");
+        return;
+      }
+      uint8_t header[4] = {'O', 'L', PATTERN_LIBRARY_VERSION, library.bankCount};
+      uint8_t slotCounts[PATTERN_LIBRARY_BANK_LIMIT];
+      uint8_t sizes[PATTERN_LIBRARY_LIMIT * 4];
+      uint8_t hashes[PATTERN_LIBRARY_LIMIT * 4];
+      for(int bank = 0; bank < library.bankCount; bank++){
+        slotCounts[bank] = bankSlotCount(bank);
+      }
+      for(int id = 0; id < PATTERN_LIBRARY_LIMIT; id++){
+        putUInt32(sizes + id * 4, library.sizes[id]);
+        putUInt32(hashes + id * 4, library.hashes[id]);
+      }
+      bool written = file.write(header, sizeof(header)) == sizeof(header)
+        && file.write(slotCounts, library.bankCount) == library.bankCount
+        && file.write(library.slots, library.bankStart[library.bankCount]) == library.bankStart[library.bankCount]
+        && file.write(sizes, sizeof(sizes)) == sizeof(sizes)
+        && file.write(hashes, sizeof(hashes)) == sizeof(hashes);
+      file.close();
+      if(!written || !LittleFS.rename(PATTERN_LIBRARY_UPLOAD_PATH, PATTERN_LIBRARY_PATH)){
+        debugf("− failed to save the pattern library\n");
+        LittleFS.remove(PATTERN_LIBRARY_UPLOAD_PATH);
+      }
+    }
+
+    // Lays the banks out, bank n gets slotCounts[n] slots showing the next ids. Call saveLibrary() to keep it.
+    bool setLibraryLayout(uint8_t bankCount, const uint8_t* slotCounts, const uint8_t* ids){
+      if(bankCount == 0 || bankCount > PATTERN_LIBRARY_BANK_LIMIT){
+        return false;
+      }
+      int slotTotal = 0;
+      for(int bank = 0; bank < bankCount; bank++){
+        if(slotCounts[bank] == 0){
+          return false;
+        }
+        slotTotal += slotCounts[bank];
+      }
+      if(slotTotal > PATTERN_LIBRARY_LIMIT){
+        return false;
+      }
+      for(int i = 0; i < slotTotal; i++){
+        if(ids[i] >= PATTERN_LIBRARY_LIMIT){
+          return false;
+        }
+      }
+      library.bankCount = bankCount;
+      library.bankStart[0] = 0;
+      for(int bank = 0; bank < bankCount; bank++){
+        library.bankStart[bank + 1] = library.bankStart[bank] + slotCounts[bank];
+      }
+      memcpy(library.slots, ids, slotTotal);
+      this->patternBank %= library.bankCount;
+      this->patternSlot %= bankSlotCount(this->patternBank);
+      return true;
+    }
+
+    // CC_SET_LIBRARY_LAYOUT, plays whatever the current slot now shows
+    bool changeLibraryLayout(uint8_t bankCount, const uint8_t* slotCounts, const uint8_t* ids){
+      stopTimeline();
+      xSemaphoreTake(patternLock, portMAX_DELAY);
+      bool valid = setLibraryLayout(bankCount, slotCounts, ids);
+      xSemaphoreGive(patternLock);
+      if(!valid){
+        return false;
+      }
+      saveLibrary();
+      markSettingDirty(DIRTY_PATTERN_BANK, 1);
+      markSettingDirty(DIRTY_PATTERN_SLOT, 1);
+      loadPattern();
+      return true;
+    }
+
+    void setPatternFile(uint8_t id, uint32_t size, uint32_t hash){
+      library.usedBytes += size - library.sizes[id];
+      library.sizes[id] = size;
+      library.hashes[id] = hash;
+      saveLibrary();
+    }
+
+    uint32_t patternSize(uint8_t id){
+      return library.sizes[id];
+    }
+
+    uint32_t patternHash(uint8_t id){
+      return library.hashes[id];
+    }
+
+    // CRC32 of a pattern's .oppp header, which holds its geometry, encoding, length and the CRC32 of its data.
+    // Equal hashes mean equal patterns, the app works them out before uploading to skip patterns the poi has.
+    static uint32_t patternContentHash(const uint8_t* header){
+      return esp_rom_crc32_le(0, header, PATTERN_FILE_HEADER_SIZE);
+    }
+
+    // Slots showing the pattern id
+    int patternUseCount(uint8_t id){
+      int count = 0;
+      for(int position = 0; position < library.bankStart[library.bankCount]; position++){
+        count += library.slots[position] == id;
+      }
+      return count;
+    }
+
+    // An id the pattern at position can be rewritten in without changing other slots: its own unless other slots
+    // show it too, else an unused id, else one no slot shows (its pattern can't be linked any more). PATTERN_LIBRARY_LIMIT if none.
+    uint8_t writablePatternId(uint8_t position){
+      uint8_t id = library.slots[position];
+      if(patternUseCount(id) == 1){
+        return id;
+      }
+      uint8_t unshown = PATTERN_LIBRARY_LIMIT;
+      for(int i = 0; i < PATTERN_LIBRARY_LIMIT; i++){
+        if(patternUseCount(i) == 0){
+          if(library.sizes[i] == 0){
+            return i;
+          }
+          if(unshown == PATTERN_LIBRARY_LIMIT){
+            unshown = i;
+          }
+        }
+      }
+      return unshown;
+    }
+
+    // CC_LINK_PATTERN, the current slot shows the stored pattern with the hash. False if there is none.
+    // Links the stored pattern with the given .oppp header (PATTERN_FILE_HEADER_SIZE bytes) to the current slot. The hash only
+    // finds it, the size and the stored header must match too, so a hash collision can't link the wrong pattern.
+    bool linkPattern(const uint8_t* header){
+      uint32_t hash = patternContentHash(header);
+      uint32_t size = PATTERN_FILE_HEADER_SIZE + getUInt32(header + 8);
+      for(int id = 0; id < PATTERN_LIBRARY_LIMIT; id++){
+        if(library.sizes[id] == size && library.hashes[id] == hash && storedHeaderMatches(id, header)){
+          debugf("- linked pattern %d\n", id);
+          library.slots[library.bankStart[this->patternBank] + this->patternSlot] = id;
+          saveLibrary();
+          loadPattern();
+          this->configLastUpdated = millis();
+          return true;
+        }
+      }
+      return false;
+    }
+
+    bool storedHeaderMatches(uint8_t id, const uint8_t* header){
+      uint8_t stored[PATTERN_FILE_HEADER_SIZE];
+      File file = LittleFS.open(patternPath(id, ".oppp"));
+      bool matches = file && !file.isDirectory() && file.size() == library.sizes[id]
+        && file.read(stored, PATTERN_FILE_HEADER_SIZE) == PATTERN_FILE_HEADER_SIZE
+        && memcmp(stored, header, PATTERN_FILE_HEADER_SIZE) == 0;
+      if(file){
+        file.close();
+      }
+      return matches;
+    }
+
+    // Points at a shared buffer, only valid until the next call
+    const char* patternPath(uint8_t index, const char* extension){
+      snprintf(pathBuffer, sizeof(pathBuffer), "/pattern%d%s", index, extension);
+      return pathBuffer;
+    }
+
+    const char* patternPath(const char* extension){
+      return patternPath(patternId(), extension);
+    }
+
+    bool replacePatternFile(uint8_t index){
+      char tmpPath[sizeof(pathBuffer)];
+      strcpy(tmpPath, patternPath(index, ".tmp"));
+      return LittleFS.rename(tmpPath, patternPath(index, ".oppp"));
+    }
+
+    void fillPatternHeader(uint8_t* header, PatternEncoding encoding, uint8_t frameHeight, uint16_t frameCount, uint32_t length, uint32_t crc){
+      header[0] = 'O';
+      header[1] = 'P';
+      header[2] = PATTERN_FILE_VERSION;
+      header[3] = encoding;
+      header[4] = frameHeight;
+      header[5] = frameCount >> 8;
+      header[6] = frameCount & 0xFF;
+      header[7] = PATTERN_COLOR_ORDER_RGB;
+      header[8] = length >> 24;
+      header[9] = length >> 16;
+      header[10] = length >> 8;
+      header[11] = length & 0xFF;
+      header[12] = crc >> 24;
+      header[13] = crc >> 16;
+      header[14] = crc >> 8;
+      header[15] = crc & 0xFF;
+    }
+
+    static uint32_t getUInt32(const uint8_t* data){
+      return (uint32_t)data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+    }
+
+    static void putUInt32(uint8_t* data, uint32_t value){
+      data[0] = value >> 24;
+      data[1] = value >> 16;
+      data[2] = value >> 8;
+      data[3] = value;
+    }
+
+    // Whether length bytes of compressed pattern data, its header included, can hold frameCount frames: each has a 2 byte
+    // length and at least one op, and no more than COMPRESSED_FRAME_LIMIT bytes of them
+    static bool compressedLengthFits(uint16_t frameCount, uint32_t length){
+      return frameCount > 0 && length >= COMPRESSED_PATTERN_HEADER_SIZE + (uint32_t)frameCount * 3
+        && length <= COMPRESSED_PATTERN_HEADER_SIZE + (uint32_t)frameCount * (2 + COMPRESSED_FRAME_LIMIT);
+    }
+
+    void mapPatternStore(){
+      storePartition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)PATTERN_STORE_SUBTYPE, "patterns");
+      if(!storePartition || esp_partition_mmap(storePartition, 0, storePartition->size, ESP_PARTITION_MMAP_DATA, (const void**)&storeMap, &storeMapHandle) != ESP_OK){
+        debugf("- no pattern store partition, baked patterns stay on LittleFS\n");
+        storePartition = NULL;
+        storeMap = NULL;
+        return;
+      }
+      debugf("- pattern store of %d slots for %d pattern ids\n", storeSlotCount(), PATTERN_LIBRARY_LIMIT);
+    }
+
+    uint8_t storeSlotCount(){
+      return storeMap == NULL ? 0 : min(storePartition->size / PATTERN_STORE_SLOT_SIZE, (uint32_t)PATTERN_LIBRARY_LIMIT);
+    }
+
+    uint32_t storeSlotOffset(uint8_t index){
+      return index * PATTERN_STORE_SLOT_SIZE;
+    }
+
+    bool storeFitsPattern(LoadedPattern& p){
+      return p.index < storeSlotCount()
+        && BAKED_PATTERN_HEADER_SIZE + (uint32_t)p.frameCount * this->ledCount * 3 <= PATTERN_STORE_SLOT_SIZE;
+    }
+
+    bool storedPatternIsCurrent(LoadedPattern& p){
+      uint8_t expected[BAKED_PATTERN_HEADER_SIZE];
+      fillBakedHeader(p, expected);
+      return storeFitsPattern(p) && memcmp(storeMap + storeSlotOffset(p.index), expected, BAKED_PATTERN_HEADER_SIZE) == 0;
+    }
+
+    // Converts one RGB frame into ledCount pixels in the strip's byte order (GRB for NeoGrbFeature, BGR for DotStarBgrFeature).
+    // Source pixel 0 lands on the last LED and the frame repeats when it is shorter than the strip, same as BlitFrame().
+    void bakeFrame(LoadedPattern& p, const uint8_t* rgb, uint8_t* out){
+      int j = 0;
+      for(int i = this->ledCount - 1; i >= 0; i--){
+        const uint8_t* pixel = rgb + j*3;
+        uint8_t* wire = out + i*3;
+        if(this->ledType == 1){
+          wire[0] = pixel[1];
+          wire[1] = pixel[0];
+          wire[2] = pixel[2];
+        }else{
+          wire[0] = pixel[2];
+          wire[1] = pixel[1];
+          wire[2] = pixel[0];
+        }
+        j++;
+        if(j == p.frameHeight){
+          j = 0;
+        }
+      }
+    }
+
+    void fillBakedHeader(LoadedPattern& p, uint8_t* header){
+      header[0] = 'O';
+      header[1] = 'B';
+      header[2] = this->hardwareVersion;
+      header[3] = this->ledType;
+      header[4] = this->ledCount;
+      header[5] = p.frameHeight;
+      header[6] = p.frameCount >> 8;
+      header[7] = p.frameCount & 0xFF;
+      putUInt32(header + 8, p.crc);
+    }
+
+    // Erases the sectors of a store slot that length bytes need. The flash cache is off while a sector erases, stalling
+    // the render task, so it gets a tick between sectors to catch up instead of one stall for the whole slot.
+    bool eraseStoreSlot(uint32_t offset, uint32_t length){
+      for(uint32_t sector = 0; sector < length; sector += PATTERN_STORE_SECTOR_SIZE){
+        if(sector > 0){
+          delay(1);
+        }
+        if(esp_partition_erase_range(storePartition, offset + sector, PATTERN_STORE_SECTOR_SIZE) != ESP_OK){
+          return false;
+        }
+      }
+      return true;
+    }
+
+    // Bakes the pattern's .oppp into its pattern store region, or into a .oppb when the store can't take it.
+    // Returns false if the strip can't use a baked pattern.
+    bool bakePattern(LoadedPattern& p){
+      if((this->ledType != 1 && this->ledType != 2) || this->ledCount == 0 || p.frameHeight == 0){
+        return false;
+      }
+      if((uint32_t)p.frameCount * this->ledCount > PATTERN_PIXEL_LIMIT){
+        debugf("- pattern too large to bake\n");
+        return false;
+      }
+      File rgbFile = LittleFS.open(patternPath(p.index, ".oppp"));
+      uint8_t dataHeader[INDEXED_PATTERN_HEADER_SIZE];
+      PatternEncoding encoding;
+      if(!readPatternHeader(p, rgbFile, encoding, dataHeader)){
+        debugf("- no pattern to bake\n");
+        return false;
+      }
+      if(encoding == PE_INDEXED){
+        // Already compact, and p.palette cycling needs the indices at render time
+        rgbFile.close();
+        discardBakedPattern(p);
+        return false;
+      }
+      if(bakedCopyIsCurrent(p)){
+        // Baked since it was queued, and maybe playing
+        rgbFile.close();
+        return true;
+      }
+      if(!patternDataIsIntact(p, rgbFile)){
+        debugf("- pattern checksum mismatch, not baking\n");
+        rgbFile.close();
+        return false;
+      }
+      uint8_t header[BAKED_PATTERN_HEADER_SIZE];
+      fillBakedHeader(p, header);
+      uint32_t frameBytes = this->ledCount * 3;
+      bool toStore = storeFitsPattern(p);
+      uint32_t storeOffset = storeSlotOffset(p.index);
+      if(storeMap != NULL && p.index >= storeSlotCount()){
+        debugf("- pattern %d is past the pattern store's %d slots, baked to .oppb\n", p.index, storeSlotCount());
+      }
+      File bakedFile;
+      bool success;
+      if(toStore){
+        if(LittleFS.exists(patternPath(p.index, ".oppb"))){
+          LittleFS.remove(patternPath(p.index, ".oppb"));
+        }
+        success = eraseStoreSlot(storeOffset, BAKED_PATTERN_HEADER_SIZE + (uint32_t)p.frameCount * frameBytes);
+      }else{
+        bakedFile = LittleFS.open(patternPath(p.index, ".oppb"), FILE_WRITE);
+        success = bakedFile && bakedFile.write(header, BAKED_PATTERN_HEADER_SIZE) == BAKED_PATTERN_HEADER_SIZE;
+      }
+      for(int i = 0; i < p.frameCount && success; i++){
+        if(encoding == PE_COMPRESSED){
+          // Decoded in place, the buffer still holds the previous frame
+          success = readCompressedFrame(p, rgbFile, rgbFrameBuffer, i == 0 ? NULL : rgbFrameBuffer);
+        }else{
+          success = rgbFile.read(rgbFrameBuffer, p.frameHeight * 3) == p.frameHeight * 3;
+        }
+        bakeFrame(p, rgbFrameBuffer, bakedFrameBuffer);
+        if(toStore){
+          success = success && esp_partition_write(storePartition, storeOffset + BAKED_PATTERN_HEADER_SIZE + i * frameBytes, bakedFrameBuffer, frameBytes) == ESP_OK;
+        }else{
+          success = success && bakedFile.write(bakedFrameBuffer, frameBytes) == frameBytes;
+        }
+      }
+      rgbFile.close();
+      if(toStore){
+        success = success && esp_partition_write(storePartition, storeOffset, header, BAKED_PATTERN_HEADER_SIZE) == ESP_OK;
+      }else if(bakedFile){
+        bakedFile.close();
+      }
+
+      if(!success){
+        debugf("- bake failed\n");
+        if(!toStore){
+          LittleFS.remove(patternPath(p.index, ".oppb"));
+        }
+      }
+      return success;
+    }
+
+    // Drops the pattern's baked copy, so an earlier pattern with the same geometry can't match
+    void discardBakedPattern(LoadedPattern& p){
+      if(LittleFS.exists(patternPath(p.index, ".oppb"))){
+        LittleFS.remove(patternPath(p.index, ".oppb"));
+      }
+      if(storedPatternIsCurrent(p)){
+        esp_partition_erase_range(storePartition, storeSlotOffset(p.index), PATTERN_STORE_SECTOR_SIZE);
+      }
+    }
+
+    // Reads and checks the .oppp header, setting the pattern's frameHeight, frameCount and crc from it. Indexed and compressed
+    // data start with a header of their own, it goes into header (INDEXED_PATTERN_HEADER_SIZE bytes) and the file is left at
+    // the palette or first frame. Returns false if the file is missing, has no pixels or doesn't match its header.
+    bool readPatternHeader(LoadedPattern& p, File& file, PatternEncoding& encoding, uint8_t* header){
+      uint8_t fileHeader[PATTERN_FILE_HEADER_SIZE];
+      if(!file || file.isDirectory() || file.read(fileHeader, PATTERN_FILE_HEADER_SIZE) != PATTERN_FILE_HEADER_SIZE
+        || fileHeader[0] != 'O' || fileHeader[1] != 'P' || fileHeader[2] != PATTERN_FILE_VERSION
+        || fileHeader[3] > PE_COMPRESSED || fileHeader[7] != PATTERN_COLOR_ORDER_RGB){
+        return false;
+      }
+      uint32_t length = getUInt32(fileHeader + 8);
+      if(file.size() != PATTERN_FILE_HEADER_SIZE + length){
+        return false;
+      }
+      p.frameHeight = fileHeader[4];
+      p.frameCount = fileHeader[5] << 8 | fileHeader[6];
+      p.crc = getUInt32(fileHeader + 12);
+      if(p.frameHeight == 0 || p.frameCount == 0){
+        return false; // Nothing to play, the renderer would divide by the frame count
+      }
+      encoding = static_cast<PatternEncoding>(fileHeader[3]);
+      if(encoding == PE_RGB){
+        return length >= (uint32_t)p.frameCount * p.frameHeight * 3;
+      }
+      if(file.read(header, INDEXED_PATTERN_HEADER_SIZE) != INDEXED_PATTERN_HEADER_SIZE){
+        return false;
+      }
+      if(encoding == PE_INDEXED){
+        return header[0] == 'O' && header[1] == 'I' && (header[2] == 4 || header[2] == 8)
+          && length == INDEXED_PATTERN_HEADER_SIZE + (header[3] + 1) * 3 + (uint32_t)p.frameCount * ((p.frameHeight * header[2] + 7) / 8);
+      }
+      return header[0] == 'O' && header[1] == 'Z' && length == COMPRESSED_PATTERN_HEADER_SIZE + getUInt32(header + 2)
+        && compressedLengthFits(p.frameCount, length);
+    }
+
+    // Checks the pattern data against the crc from its header. Reads the whole file, the position is restored.
+    bool patternDataIsIntact(LoadedPattern& p, File& file){
+      size_t position = file.position();
+      uint32_t crc = 0;
+      file.seek(PATTERN_FILE_HEADER_SIZE);
+      while(file.available() > 0){
+        size_t chunkSize = file.read(compressedFrameBuffer, sizeof(compressedFrameBuffer));
+        if(chunkSize == 0){
+          break;
+        }
+        crc = esp_rom_crc32_le(crc, compressedFrameBuffer, chunkSize);
+      }
+      file.seek(position);
+      return crc == p.crc;
+    }
+
+    void loadPalette(LoadedPattern& p, uint8_t* header){
+      p.indexBits = header[2];
+      p.paletteCount = header[3] + 1;
+      p.paletteCycleSpeed = header[4] << 8 | header[5];
+      p.file.read(p.palette, p.paletteCount * 3);
+      p.fileHeaderSize = PATTERN_FILE_HEADER_SIZE + INDEXED_PATTERN_HEADER_SIZE + p.paletteCount * 3;
+      paletteVersion++;
+    }
+
+    // Decodes one compressed frame into out (frameHeight RGB pixels). previous is the frame before it,
+    // NULL for the first frame, or out itself when decoding in place. Returns false on corrupt data.
+    bool decodeFrame(LoadedPattern& p, const uint8_t* data, size_t length, uint8_t* out, const uint8_t* previous){
+      size_t position = 0;
+      uint16_t pixel = 0;
+      while(position < length){
+        uint8_t op = data[position++];
+        uint16_t count = (op & 0x3F) + 1;
+        if(pixel + count > p.frameHeight){
+          return false;
+        }
+        uint8_t* target = out + pixel * 3;
+        switch(op >> 6){
+          case 0:
+            if(previous == NULL){
+              memset(target, 0, count * 3);
+            }else if(previous != out){
+              memcpy(target, previous + pixel * 3, count * 3);
+            }
+            break;
+          case 1:
+            if(position + 3 > length){
+              return false;
+            }
+            for(int i = 0; i < count; i++){
+              target[i * 3 + 0] = data[position + 0];
+              target[i * 3 + 1] = data[position + 1];
+              target[i * 3 + 2] = data[position + 2];
+            }
+            position += 3;
+            break;
+          case 2:
+            if(position + count * 3 > length){
+              return false;
+            }
+            memcpy(target, data + position, count * 3);
+            position += count * 3;
+            break;
+          default:
+            return false;
+        }
+        pixel += count;
+      }
+      return pixel == p.frameHeight;
+    }
+
+    bool readCompressedFrame(LoadedPattern& p, File& file, uint8_t* out, const uint8_t* previous){
+      uint8_t lengthBytes[2];
+      if(file.read(lengthBytes, 2) != 2){
+        return false;
+      }
+      size_t length = lengthBytes[0] << 8 | lengthBytes[1];
+      if(length > COMPRESSED_FRAME_LIMIT || file.read(compressedFrameBuffer, length) != length){
+        return false;
+      }
+      #ifdef DEBUG
+      uint32_t start = micros();
+      bool decoded = decodeFrame(p, compressedFrameBuffer, length, out, previous);
+      p.decodeMicros += micros() - start;
+      return decoded;
+      #else
+      return decodeFrame(p, compressedFrameBuffer, length, out, previous);
+      #endif
+    }
+
+    // Baked files are tied to the strip settings, they get rebuilt on the next load after the settings apply
+    void removeBakedPatterns(){
+      for(int i = 0; i < PATTERN_LIBRARY_LIMIT; i++){
+        if(library.sizes[i] != 0 && LittleFS.exists(patternPath(i, ".oppb"))){
+          LittleFS.remove(patternPath(i, ".oppb"));
+        }
+      }
+    }
+
+    bool bakedPatternIsCurrent(LoadedPattern& p, File& file){
+      uint8_t header[BAKED_PATTERN_HEADER_SIZE];
+      uint8_t expected[BAKED_PATTERN_HEADER_SIZE];
+      fillBakedHeader(p, expected);
+      return file.read(header, BAKED_PATTERN_HEADER_SIZE) == BAKED_PATTERN_HEADER_SIZE 
+        && memcmp(header, expected, BAKED_PATTERN_HEADER_SIZE) == 0
+        && file.size() == BAKED_PATTERN_HEADER_SIZE + (size_t)p.frameCount * this->ledCount * 3;
+    }
+
+    bool bakedCopyIsCurrent(LoadedPattern& p){
+      if(storedPatternIsCurrent(p)){
+        return true;
+      }
+      File bakedFile = LittleFS.open(patternPath(p.index, ".oppb"));
+      bool current = bakedFile && !bakedFile.isDirectory() && bakedPatternIsCurrent(p, bakedFile);
+      if(bakedFile){
+        bakedFile.close();
+      }
+      return current;
+    }
+
+    uint16_t framesThatFit(LoadedPattern& p, uint32_t frameBytes){
+      return min((uint32_t)p.frameCount, p.bufferSize / max(frameBytes, (uint32_t)1));
+    }
+
+    void fillDefaultPattern(LoadedPattern& p){
+      p.baked = false;
+      p.encoding = PE_RGB;
+      p.frameBytes = p.frameHeight * 3;
+      p.playbackFrameCount = framesThatFit(p, p.frameBytes);
+      p.framesResident = p.playbackFrameCount;
+      p.frames = p.buffer;
+      for (int i=0; i < p.playbackFrameCount; i++) {
+        for (int j=0; j < p.frameHeight; j++) {
           if(i % 2 == 1){
-            pattern[(i * this->frameHeight * 3) + (j*3) + 0] = 0xFF;
-            pattern[(i * this->frameHeight * 3) + (j*3) + 1] = 0xFF;
-            pattern[(i * this->frameHeight * 3) + (j*3) + 2] = 0x00;
+            p.buffer[(i * p.frameHeight * 3) + (j*3) + 0] = 0xFF;
+            p.buffer[(i * p.frameHeight * 3) + (j*3) + 1] = 0xFF;
+            p.buffer[(i * p.frameHeight * 3) + (j*3) + 2] = 0x00;
           }else{
-            pattern[(i * this->frameHeight * 3) + (j*3) + 0] = 0x00;
-            pattern[(i * this->frameHeight * 3) + (j*3) + 1] = 0x00;
-            pattern[(i * this->frameHeight * 3) + (j*3) + 2] = 0x00;
+            p.buffer[(i * p.frameHeight * 3) + (j*3) + 0] = 0x00;
+            p.buffer[(i * p.frameHeight * 3) + (j*3) + 1] = 0x00;
+            p.buffer[(i * p.frameHeight * 3) + (j*3) + 2] = 0x00;
           }
         }
       }
     }
 
-    void startLoadingPattern(){
-      if(patternFile){
-        patternFile.close();
+    // Starts loading pattern id index into p. Call with patternLock held if p is playing.
+    // Returns false if p's buffer can't hold a single frame, p is left with no frames and mustn't be played.
+    bool startLoadingPattern(LoadedPattern& p, uint8_t index){
+      if(p.file){
+        p.file.close();
       }
-      patternFile = LittleFS.open(String("/pattern") + (this->patternSlot  + (this->patternBank * PATTERN_BANK_SIZE)) + ".oppp");
-      if(!patternFile || patternFile.isDirectory()){
+      p.index = index;
+      p.baked = false;
+      p.encoding = PE_RGB;
+      p.fileHeaderSize = 0;
+      p.frames = p.buffer;
+
+      // The header has everything needed to pick the baked copy or play the file itself
+      PatternEncoding encoding;
+      uint8_t dataHeader[INDEXED_PATTERN_HEADER_SIZE];
+      p.file = LittleFS.open(patternPath(p.index, ".oppp"));
+      if(!readPatternHeader(p, p.file, encoding, dataHeader)){
         debugf("− failed to open file for reading\n");
-        fillDefaultPattern();
-      }else{
-        debugf(" - this much available: %d\n", file.available());
-        // Filling the whole pattern with data is way too slow
-        // just fill one pixel so we don't have a completely black pattern if something goes weird
-        pattern[0] = 0xFF;
+        if(p.file){
+          p.file.close();
+        }
+        p.frameHeight = DEFAULT_FRAME_HEIGHT;
+        p.frameCount = DEFAULT_FRAME_COUNT;
+        fillDefaultPattern(p);
+        return p.playbackFrameCount > 0;
+      }
+
+      // Prefer the baked copy. If it is missing or was made for other strip settings the .oppp plays until loop() has baked it.
+      if(encoding != PE_INDEXED){
+        bool stored = storedPatternIsCurrent(p);
+        File bakedFile;
+        if(!stored){
+          bakedFile = LittleFS.open(patternPath(p.index, ".oppb"));
+          if(!bakedFile || bakedFile.isDirectory() || !bakedPatternIsCurrent(p, bakedFile)){
+            if(bakedFile){
+              bakedFile.close();
+            }
+            bakeQueued[p.index] = true;
+          }
+        }
+        if(stored){
+          // Played straight from flash, nothing to load
+          p.file.close();
+          p.baked = true;
+          p.frames = storeMap + storeSlotOffset(p.index) + BAKED_PATTERN_HEADER_SIZE;
+          p.frameBytes = this->ledCount * 3;
+          p.playbackFrameCount = p.frameCount;
+          p.framesResident = p.playbackFrameCount;
+          return true;
+        }
+        if(bakedFile && !bakedFile.isDirectory()){
+          p.file.close();
+          p.file = bakedFile;
+          p.baked = true;
+          p.fileHeaderSize = BAKED_PATTERN_HEADER_SIZE;
+        }
       }
-      // Load first frame immediately (For large/fast patterns this is futile, as we already lagged past it)
-      continueLoadingPattern();
-    }
 
-    void continueLoadingPattern(){
-      if(patternFile && patternFile.available() > 0){
-        if(patternFile.available() <= frameHeight * 3){
-          patternFile.read(pattern + patternFile.position(), patternFile.available());
+      if(p.baked){
+        p.frameBytes = this->ledCount * 3;
+      }else{
+        p.encoding = encoding;
+        if(p.encoding == PE_INDEXED){
+          loadPalette(p, dataHeader);
+          p.frameBytes = (p.frameHeight * p.indexBits + 7) / 8;
         }else{
-          patternFile.read(pattern + patternFile.position(), frameHeight * 3);
+          // Compressed frames are decoded to RGB
+          p.frameBytes = p.frameHeight * 3;
+          p.fileHeaderSize = PATTERN_FILE_HEADER_SIZE;
+          p.framesLoaded = 0;
+          #ifdef DEBUG
+          p.decodeMicros = 0;
+          #endif
         }
       }
+      p.playbackFrameCount = framesThatFit(p, p.frameBytes);
+      p.framesResident = 0;
+      p.playbackCursor = 0;
+      if(p.playbackFrameCount == 0){
+        debugf("- no room for a frame of pattern %d\n", p.index);
+        p.file.close();
+        return false;
+      }
+      debugf(" - this much available: %d\n", p.file.available());
+      // Load the first chunk immediately, the renderer holds on the frames loaded so far
+      continueLoadingPattern(p);
+      return true;
     }
 
-    void loadFrameHeight(){
-      String key = "p";
-      key += (this->patternSlot  + (this->patternBank * PATTERN_BANK_SIZE));
-      key += "Height";
-      this->frameHeight = preferences.getChar(key.c_str(), 5);
+    // Starts playing pattern id index, or the placeholder if it can't be played. Call with patternLock held.
+    // Returns false on the placeholder. If not even that fits, nothing plays and the renderer blanks the strip.
+    bool startPlayingPattern(uint8_t index){
+      if(startLoadingPattern(*playing, index)){
+        return true;
+      }
+      debugf("- pattern %d can't be played, the placeholder plays instead\n", index);
+      playing->frameHeight = DEFAULT_FRAME_HEIGHT;
+      playing->frameCount = DEFAULT_FRAME_COUNT;
+      fillDefaultPattern(*playing);
+      return false;
     }
 
-    void loadFrameCount(){
-      String key = "p";
-      key += (this->patternSlot  + (this->patternBank * PATTERN_BANK_SIZE));
-      key += "FCount";
-      debugf("key = %s\n", key);
-      this->frameCount = preferences.getUShort(key.c_str(), 5);
+    // Loads the next chunk of frames. The renderer only plays frames below framesResident, so the loader reads ahead
+    // of playbackCursor, up to LOADER_CHUNK_LIMIT bytes per call to bound the cost of a loop. Call with patternLock held
+    // if p is playing or a ready transition's, the render task mustn't swap it or close its file meanwhile.
+    void continueLoadingPattern(LoadedPattern& p){
+      if(!p.file){
+        return;
+      }
+      uint16_t wantedFrames = min((uint32_t)p.playbackCursor + LOADER_READ_AHEAD_FRAMES, (uint32_t)p.playbackFrameCount);
+      if(p.encoding == PE_COMPRESSED){
+        // Whole frames, at least one per call
+        uint32_t decoded = 0;
+        do{
+          uint8_t* frame = p.buffer + p.framesLoaded * p.frameBytes;
+          if(p.framesLoaded >= p.playbackFrameCount || !readCompressedFrame(p, p.file, frame, p.framesLoaded == 0 ? NULL : frame - p.frameBytes)){
+            debugf("- decoded %d frames, %d ns/pixel\n", p.framesLoaded, p.framesLoaded == 0 ? 0 : p.decodeMicros * 1000 / (p.framesLoaded * p.frameHeight));
+            // A corrupt frame ends the pattern early
+            p.playbackFrameCount = max(p.framesLoaded, (uint16_t)1);
+            p.framesResident = p.playbackFrameCount;
+            p.file.close();
+            return;
+          }
+          p.framesLoaded++;
+          p.framesResident = p.framesLoaded;
+          decoded += p.frameBytes;
+        }while(p.framesLoaded < wantedFrames && decoded < LOADER_CHUNK_LIMIT);
+        return;
+      }
+
+      // Only the frames that fit the buffer are played
+      uint32_t playbackBytes = p.playbackFrameCount * p.frameBytes;
+      uint32_t loaded = p.file.position() - p.fileHeaderSize;
+      uint32_t wantedBytes = wantedFrames * p.frameBytes;
+      uint32_t chunkSize = wantedBytes > loaded ? min(wantedBytes - loaded, (uint32_t)LOADER_CHUNK_LIMIT) : 1;
+      // End on a cache block of the file, so no block is read twice
+      uint32_t end = p.file.position() + chunkSize;
+      chunkSize += (LOADER_CHUNK_SIZE - end % LOADER_CHUNK_SIZE) % LOADER_CHUNK_SIZE;
+      chunkSize = min(chunkSize, min(playbackBytes - loaded, (uint32_t)p.file.available()));
+      if(chunkSize > 0){
+        loaded += p.file.read(p.buffer + loaded, chunkSize);
+      }
+      p.framesResident = loaded / max(p.frameBytes, (uint32_t)1);
+      if(chunkSize == 0 || loaded >= playbackBytes){
+        // A short file ends the pattern early
+        p.playbackFrameCount = max(p.framesResident, (uint16_t)1);
+        p.file.close();
+      }
     }
 
-    void saveSequencer() {
-      debugf("Save Sequencer\n");
-      debugf("- length = %d\n", this->sequencerLength);
+    // Pattern files from before PATTERN_FILE_HEADER_SIZE kept their geometry in NVS (p<N>Height, p<N>FCount).
+    // Gives them the header, once, and drops the keys.
+    void migratePatternFiles(){
+      for(int i = 0; i < PATTERN_BANK_SIZE * PATTERN_BANK_COUNT; i++){
+        File file = LittleFS.open(patternPath(i, ".oppp"));
+        PatternEncoding encoding;
+        uint8_t header[PATTERN_FILE_HEADER_SIZE];
+        // Nothing plays yet, so the playing pattern is free to read headers into
+        if(!file || file.isDirectory() || readPatternHeader(*playing, file, encoding, header)){
+          continue;
+        }
+        char heightKey[12];
+        char countKey[12];
+        snprintf(heightKey, sizeof(heightKey), "p%dHeight", i);
+        snprintf(countKey, sizeof(countKey), "p%dFCount", i);
+        uint8_t frameHeight = preferences.getChar(heightKey, DEFAULT_FRAME_HEIGHT);
+        uint16_t frameCount = preferences.getUShort(countKey, DEFAULT_FRAME_COUNT);
+        encoding = legacyPatternEncoding(file, frameHeight, frameCount);
 
-      preferences.putUShort("sequencerLength", this->sequencerLength);
+        File migrated = LittleFS.open(patternPath(i, ".tmp"), FILE_WRITE);
+        bool success = migrated && migrated.write(header, PATTERN_FILE_HEADER_SIZE) == PATTERN_FILE_HEADER_SIZE;
+        uint32_t length = 0;
+        uint32_t crc = 0;
+        while(success && file.available() > 0){
+          size_t chunkSize = file.read(rgbFrameBuffer, sizeof(rgbFrameBuffer));
+          success = chunkSize > 0 && migrated.write(rgbFrameBuffer, chunkSize) == chunkSize;
+          crc = esp_rom_crc32_le(crc, rgbFrameBuffer, chunkSize);
+          length += chunkSize;
+        }
+        // Short RGB files are padded with black, as they played before
+        memset(rgbFrameBuffer, 0, sizeof(rgbFrameBuffer));
+        while(success && encoding == PE_RGB && length < (uint32_t)frameCount * frameHeight * 3){
+          size_t padding = min(sizeof(rgbFrameBuffer), (size_t)((uint32_t)frameCount * frameHeight * 3 - length));
+          success = migrated.write(rgbFrameBuffer, padding) == padding;
+          crc = esp_rom_crc32_le(crc, rgbFrameBuffer, padding);
+          length += padding;
+        }
+        file.close();
+        fillPatternHeader(header, encoding, frameHeight, frameCount, length, crc);
+        success = success && migrated.seek(0) && migrated.write(header, PATTERN_FILE_HEADER_SIZE) == PATTERN_FILE_HEADER_SIZE;
+        if(migrated){
+          migrated.close();
+        }
+        if(success && replacePatternFile(i)){
+          preferences.remove(heightKey);
+          preferences.remove(countKey);
+          debugf("- migrated pattern %d (%dx%d)\n", i, frameHeight, frameCount);
+        }else{
+          debugf("- failed to migrate pattern %d\n", i);
+          LittleFS.remove(patternPath(i, ".tmp"));
+        }
+      }
+    }
 
-      File file = LittleFS.open("/sequencer.opps", FILE_WRITE);
+    // How a file from before PATTERN_FILE_HEADER_SIZE is encoded, told apart by its data header and size.
+    // A file the size of the RGB pattern is always RGB. Leaves the file at the start.
+    PatternEncoding legacyPatternEncoding(File& file, uint8_t frameHeight, uint16_t frameCount){
+      uint8_t header[INDEXED_PATTERN_HEADER_SIZE];
+      PatternEncoding encoding = PE_RGB;
+      if(file.read(header, INDEXED_PATTERN_HEADER_SIZE) == INDEXED_PATTERN_HEADER_SIZE && header[0] == 'O'
+        && file.size() != (size_t)frameCount * frameHeight * 3){
+        if(header[1] == 'I' && (header[2] == 4 || header[2] == 8)
+          && file.size() == INDEXED_PATTERN_HEADER_SIZE + (header[3] + 1) * 3 + (size_t)frameCount * ((frameHeight * header[2] + 7) / 8)){
+          encoding = PE_INDEXED;
+        }else if(header[1] == 'Z' && file.size() == COMPRESSED_PATTERN_HEADER_SIZE + getUInt32(header + 2)){
+          encoding = PE_COMPRESSED;
+        }
+      }
+      file.seek(0);
+      return encoding;
+    }
+
+    // Compiles a sequencer (CC_SET_SEQUENCER, 7 bytes per step: pattern slot, pattern bank, brightness, speed x2, duration in ms x2)
+    // into the timeline, each step starts when the one before has run for its duration
+    bool saveSequencer(const uint8_t* sequencer, uint16_t length) {
+      debugf("Save Sequencer\n");
+      debugf("- length = %d\n", length);
+      uint32_t stepCount = length / 7;
+      File file = LittleFS.open(TIMELINE_UPLOAD_PATH, FILE_WRITE);
       if(!file || file.isDirectory()){
         debugf("− failed to open file for writing\n");
-      }else{
-        debugf(" - opened file for writing: %d\n");
-        
-        int written = file.write(this->sequencer, this->sequencerLength);
-        file.close();
-        debugf(" - this much written: %d\n", written);
+        return false;
+      }
+      uint8_t header[TIMELINE_HEADER_SIZE] = {'O', 'T', TIMELINE_VERSION, 0};
+      putUInt32(header + 4, stepCount);
+      putUInt32(header + 8, stepCount * 10);
+      bool success = file.write(header, TIMELINE_HEADER_SIZE) == TIMELINE_HEADER_SIZE;
+      uint32_t start = 0;
+      for(uint32_t i = 0; success && i < stepCount; i++){
+        const uint8_t* step = sequencer + i * 7;
+        uint8_t record[10] = {10};
+        putUInt32(record + 1, start);
+        uint8_t bank = step[1] % library.bankCount;
+        record[5] = library.bankStart[bank] + step[0] % bankSlotCount(bank);
+        record[6] = TS_BRIGHTNESS | TS_SPEED;
+        record[7] = step[2];
+        record[8] = step[3];
+        record[9] = step[4];
+        success = file.write(record, sizeof(record)) == sizeof(record);
+        start += step[5] << 8 | step[6];
       }
+      file.close();
+      stopTimeline();
+      if(!success || !LittleFS.rename(TIMELINE_UPLOAD_PATH, TIMELINE_PATH)){
+        debugf("− failed to save timeline\n");
+        LittleFS.remove(TIMELINE_UPLOAD_PATH);
+        return false;
+      }
+      return true;
     }
 
-    void loadSequencer(){
-      this->sequencerLength = preferences.getUShort("sequencerLength", 0x00);
+    // The sequencer used to be kept as is, in /sequencer.opps with its length in NVS. Compiles it, once.
+    void migrateSequencer(){
       File file = LittleFS.open("/sequencer.opps");
       if(!file || file.isDirectory()){
-        debugf("− failed to open file for reading\n");
-      }else{
-        file.read(this->sequencer, file.available());
-        file.close();
+        return;
+      }
+      uint16_t length = min(preferences.getUShort("sequencerLength", 0x00), (uint16_t)file.size());
+      uint8_t* sequencer = (uint8_t*) malloc(max(length, (uint16_t)1));
+      bool read = sequencer && file.read(sequencer, length) == length;
+      file.close();
+      if(read && saveSequencer(sequencer, length)){
+        LittleFS.remove("/sequencer.opps");
+        preferences.remove("sequencerLength");
+      }
+      free(sequencer);
+    }
+
+    bool readTimelineHeader(File& file, uint32_t& stepCount, uint8_t& version){
+      uint8_t header[TIMELINE_HEADER_SIZE];
+      if(!file || file.isDirectory() || file.read(header, TIMELINE_HEADER_SIZE) != TIMELINE_HEADER_SIZE){
+        return false;
+      }
+      if(header[0] != 'O' || header[1] != 'T' || header[2] < 1 || header[2] > TIMELINE_VERSION){
+        return false;
+      }
+      version = header[2];
+      stepCount = getUInt32(header + 4);
+      return file.size() == TIMELINE_HEADER_SIZE + getUInt32(header + 8);
+    }
+
+    bool readTimelineStep(File& file, TimelineStep& step){
+      uint8_t record[TIMELINE_STEP_MAX_SIZE];
+      int length = file.read();
+      if(length < TIMELINE_STEP_MIN_SIZE || length > TIMELINE_STEP_MAX_SIZE || file.read(record + 1, length - 1) != length - 1){
+        return false;
+      }
+      step.start = timelineVersion == 1 ? getUInt32(record + 1) / 1000 : getUInt32(record + 1);
+      step.pattern = record[5];
+      step.flags = record[6];
+      int offset = 7;
+      if(step.flags & TS_BRIGHTNESS){
+        step.brightness = record[offset];
+        offset += 1;
+      }
+      if(step.flags & TS_SPEED){
+        step.speed = record[offset] << 8 | record[offset + 1];
+        offset += 2;
+      }
+      return offset <= length && step.pattern < library.bankStart[library.bankCount];
+    }
+
+    // Plays the timeline from its first step, now
+    void startTimeline(){
+      stopTimeline();
+      timelineFile = LittleFS.open(TIMELINE_PATH);
+      if(!readTimelineHeader(timelineFile, timelineStepCount, timelineVersion)){
+        debugf("− no timeline to start\n");
+        stopTimeline();
+        return;
+      }
+      timelineStepsTaken = 0;
+      timelineNextRead = false;
+      timelineStartMicros = esp_timer_get_time();
+      timelineRunning = true;
+    }
+
+    void stopTimeline(){
+      timelineRunning = false;
+      if(timelineFile){
+        timelineFile.close();
       }
-      this->sequencerStep = -1;
     }
       
     
     void setup() {
       debugf("Setup begin\n");
+      patternLock = xSemaphoreCreateMutex();
+      playing->buffer = (uint8_t *) malloc(PATTERN_PIXEL_LIMIT * 3 * sizeof(uint8_t));
+      playing->bufferSize = playing->buffer ? PATTERN_PIXEL_LIMIT * 3 : 0;
+      mapPatternStore();
       debugf("Load Config (setup)\n");
 
       // Initialize storage access
@@ -364,74 +1754,252 @@ class OpenPixelPoiConfig {
       this->patternShuffleDuration = preferences.getChar("patternShuffleDuration", PATTERN_SHUFFLE_DURATION);
       debugf("- pattern shuffle duration = %d\n", this->patternShuffleDuration);
 
-      loadFrameHeight();
-      loadFrameCount();
+      migratePatternFiles();
+      loadLibrary();
+      startPlayingPattern(patternId());
       debugf("- frame\n");
-      debugf("  - height = %d\n", this->frameHeight);
-      debugf("  - count = %d\n", this->frameCount);
+      debugf("  - height = %d\n", playing->frameHeight);
+      debugf("  - count = %d\n", playing->frameCount);
 
-      startLoadingPattern();
-      loadSequencer();
+      migrateSequencer();
+      resetFrameStats();
 
       debugf("- pattern\n");
-      for (int i = 0; i < this->frameHeight * this->frameCount; i+=3 ) {
-        if (i%this->frameHeight*3 == 0) {
+      for (int i = 0; i < playing->frameHeight * playing->playbackFrameCount; i+=3 ) {
+        if (i%playing->frameHeight*3 == 0) {
           debugf_noprefix("\n");
           debugf("    ");
         }
-        debugf_noprefix("0x%02X%02X%02X ", this->pattern[i], this->pattern[i+1], this->pattern[i+2]);
+        debugf_noprefix("0x%02X%02X%02X ", playing->buffer[i], playing->buffer[i+1], playing->buffer[i+2]);
       }
       debugf_noprefix("\n");
       
       debugf("Setup complete\n");
     }
 
-    void loop(){
-      // Pattern Shuffle
-      if((this->displayState == DS_PATTERN_ALL || this->displayState == DS_PATTERN_ALL_ALL) && millis() - this->displayStateLastUpdated > this->patternShuffleDuration * 1000){
-        this->setPatternSlot((this->patternSlot + 1) % PATTERN_BANK_SIZE, false);
-        if(this->patternSlot == 0 && this->displayState == DS_PATTERN_ALL_ALL){
-          this->setPatternBank((this->patternBank + 1) % PATTERN_BANK_COUNT, false);
-        }
-        this->displayStateLastUpdated = millis();
-      }
-
-      // Sequencer (pattern slot, battern bank, brightness, speedx2, durationx2)
-      if(this->displayState == DS_PATTERN && this->sequencerStep < (this ->sequencerLength / 7) - 1){
-        uint16_t offset; 
-        uint16_t previousTargetDuration;
-        if(sequencerStep == -1){
-          this->displayStateLastUpdated = millis();
-          previousTargetDuration = 0;
-          this->sequencerDelayed = 0;
+    // Call once the BLE stack is up. The spare buffer takes what heap is left, patterns that don't fit it are loaded at their deadline.
+    void setupPrefetch(){
+      size_t available = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+      size_t size = available > PREFETCH_HEAP_RESERVE ? min(available - PREFETCH_HEAP_RESERVE, (size_t)(PATTERN_PIXEL_LIMIT * 3)) : 0;
+      prefetched->buffer = size > 0 ? (uint8_t *) malloc(size) : NULL;
+      prefetched->bufferSize = prefetched->buffer ? size : 0;
+      debugf("- prefetch buffer = %d bytes\n", prefetched->bufferSize);
+    }
+
+    // The shuffle or timeline step that comes next, false if neither is running
+    // or the timeline step is further off than TIMELINE_PLAN_AHEAD
+    bool nextTransition(PatternTransition& next){
+      next.displayState = this->displayState;
+      next.stateUpdated = this->displayStateLastUpdated;
+      next.fromTimeline = false;
+      if(this->displayState == DS_PATTERN_ALL || this->displayState == DS_PATTERN_ALL_ALL){
+        next.slot = (this->patternSlot + 1) % bankSlotCount(this->patternBank);
+        next.bank = next.slot == 0 && this->displayState == DS_PATTERN_ALL_ALL ? (this->patternBank + 1) % library.bankCount : this->patternBank;
+        next.deadline = (uint32_t)this->displayStateLastUpdated * 1000 + this->patternShuffleDuration * 1000000;
+        return true;
+      }
+      if(this->displayState == DS_PATTERN && timelineRunning){
+        // Read ahead one step, so its pattern is loaded before it starts. After the last step its pattern plays on.
+        if(!timelineNextRead){
+          if(timelineStepsTaken >= timelineStepCount || !readTimelineStep(timelineFile, timelineNext)){
+            debugf("- timeline done after %d steps\n", timelineStepsTaken);
+            stopTimeline();
+            return false;
+          }
+          timelineNextRead = true;
+        }
+        int64_t due = timelineStartMicros + (int64_t)timelineNext.start * 1000;
+        if(due - esp_timer_get_time() > TIMELINE_PLAN_AHEAD){
+          return false;
+        }
+        next.fromTimeline = true;
+        next.timelineStep = timelineStepsTaken;
+        next.step = timelineNext;
+        if(!librarySlot(timelineNext.pattern, next.bank, next.slot)){
+          stopTimeline(); // The library was laid out again
+          return false;
+        }
+        next.deadline = (uint32_t)due; // micros() is the low 32 bits of esp_timer_get_time()
+        return true;
+      }
+      return false;
+    }
+
+    bool isPlannedTransition(PatternTransition& next){
+      return transitionPlanned && next.displayState == transition.displayState && next.stateUpdated == transition.stateUpdated
+        && next.deadline == transition.deadline && next.slot == transition.slot && next.bank == transition.bank
+        && next.fromTimeline == transition.fromTimeline && (!next.fromTimeline || next.timelineStep == transition.timelineStep);
+    }
+
+    // Call with patternLock held
+    void dropTransition(){
+      transitionPlanned = false;
+      transitionReady = false;
+      if(prefetched->file){
+        prefetched->file.close();
+      }
+    }
+
+    // Plans the next step and prefetches its pattern into the spare LoadedPattern, so the render task can swap it in
+    // right at the deadline. Patterns that don't fit the spare buffer are switched here instead, once due.
+    void updateTransition(){
+      PatternTransition next;
+      bool planned = nextTransition(next);
+      if(transitionPlanned && !(planned && isPlannedTransition(next))){
+        xSemaphoreTake(patternLock, portMAX_DELAY);
+        dropTransition();
+        xSemaphoreGive(patternLock);
+      }
+      if(planned && !transitionPlanned){
+        // The render task ignores prefetched until transitionReady is set
+        transition = next;
+        transitionPlanned = true;
+        transitionReady = startLoadingPattern(*prefetched, patternId(next.bank, next.slot)) && prefetchIsComplete();
+      }
+      if(transitionReady){
+        xSemaphoreTake(patternLock, portMAX_DELAY);
+        // The render task may have swapped it in since
+        if(transitionReady){
+          continueLoadingPattern(*prefetched);
+        }
+        xSemaphoreGive(patternLock);
+      }else if(transitionPlanned && (int32_t)(micros() - transition.deadline) >= 0){
+        xSemaphoreTake(patternLock, portMAX_DELAY);
+        uint8_t index = patternId(transition.bank, transition.slot);
+        if(prefetched->bufferSize > playing->bufferSize && startLoadingPattern(*prefetched, index)){
+          swapPatterns();
         }else{
-          offset = this->sequencerStep * 7; 
-          previousTargetDuration = this->sequencer[offset+ 5] << 8 | this->sequencer[offset + 6];
-        }
-        ulong lastStepStartTime = (this->displayStateLastUpdated - this->sequencerDelayed);
-        if(millis() - lastStepStartTime >= previousTargetDuration){
-          this->sequencerStep++;
-          offset = this->sequencerStep * 7; 
-          this->patternSlot = this->sequencer[offset + 0];
-          this->patternBank = this->sequencer[offset + 1];
-          this->ledBrightness = this->sequencer[offset + 2];
-          this->animationSpeed = this->sequencer[offset+ 3] << 8 | this->sequencer[offset + 4];
-          loadFrameHeight();
-          loadFrameCount();
-          startLoadingPattern();
-          // Roll over time from previous update to keep real time regardless of pattern load times
-          // But offset displayStateLastUpdated by the load time, so we start rendering from the start of the pattern
-          // This is important because the file is not fully loaded yet.
-          this->sequencerDelayed = millis() - (lastStepStartTime + previousTargetDuration);
-          this->displayStateLastUpdated = lastStepStartTime + previousTargetDuration + this->sequencerDelayed;
+          prefetched->file.close();
+          uint8_t current = playing->index;
+          if(!startLoadingPattern(*playing, index)){
+            // The step is taken, with the current pattern playing on
+            debugf("- pattern %d doesn't fit, step skipped\n", index);
+            startPlayingPattern(current);
+          }
         }
-      }else{
-        // Abort sequencer on button press
-        this->sequencerStep = this->sequencerLength / 7;
+        applyTransition(false);
+        xSemaphoreGive(patternLock);
+      }
+    }
+
+    // The prefetched pattern plays as well from the spare buffer as it would from the playing one
+    bool prefetchIsComplete(){
+      return prefetched->playbackFrameCount == prefetched->frameCount || prefetched->bufferSize >= playing->bufferSize;
+    }
+
+    // Bakes one queued pattern, without patternLock so the render task plays on meanwhile. A pattern playing or prefetched
+    // from its .oppp switches to the baked copy if it went to the pattern store, .oppb copies are used from the next load on.
+    // Waits while an upload is written.
+    void bakeQueuedPattern(){
+      if(uploadFile){
+        return;
       }
+      uint8_t index = 0;
+      while(index < PATTERN_LIBRARY_LIMIT && !bakeQueued[index]){
+        index++;
+      }
+      if(index == PATTERN_LIBRARY_LIMIT){
+        return;
+      }
+      bakeQueued[index] = false;
+      baking.index = index;
+      #ifdef DEBUG
+      uint32_t start = micros();
+      #endif
+      if(!bakePattern(baking) || !storedPatternIsCurrent(baking)){
+        return;
+      }
+      debugf("- baked pattern %d in %d us\n", index, micros() - start);
+      xSemaphoreTake(patternLock, portMAX_DELAY);
+      if(playing->index == index && !playing->baked && playing->crc == baking.crc){
+        startPlayingPattern(index);
+      }
+      if(transitionReady && prefetched->index == index && !prefetched->baked && prefetched->crc == baking.crc){
+        transitionReady = startLoadingPattern(*prefetched, index) && prefetchIsComplete();
+      }
+      xSemaphoreGive(patternLock);
+    }
 
-      // Chunked pattern loading to avoid lag spike on pattern chanage
-      continueLoadingPattern();
+    // Called by the render task with patternLock held, swaps the prefetched pattern in once it is due
+    void commitTransition(){
+      if(!transitionReady || (int32_t)(micros() - transition.deadline) < 0){
+        return;
+      }
+      if(this->displayState != transition.displayState || this->displayStateLastUpdated != transition.stateUpdated){
+        return; // Stale, dropped by the next updateTransition()
+      }
+      swapPatterns();
+      applyTransition(true);
+    }
+
+    // micros() the prefetched step is due, false if none is ready
+    bool transitionReadyAt(uint32_t& at){
+      if(!transitionReady){
+        return false;
+      }
+      at = transition.deadline;
+      return true;
+    }
+
+    void swapPatterns(){
+      LoadedPattern* previous = playing;
+      playing = prefetched;
+      prefetched = previous;
+      if(prefetched->file){
+        prefetched->file.close();
+      }
+      paletteVersion++;
+    }
+
+    // Call with patternLock held, once the step's pattern is playing
+    void applyTransition(bool wasPrefetched){
+      this->patternSlot = transition.slot;
+      this->patternBank = transition.bank;
+      if(transition.fromTimeline){
+        if(transition.step.flags & TS_BRIGHTNESS){
+          this->ledBrightness = transition.step.brightness;
+        }
+        if(transition.step.flags & TS_SPEED){
+          this->animationSpeed = transition.step.speed;
+        }
+        timelineStepsTaken++;
+        timelineNextRead = false;
+      }
+      // Frames count from the deadline, a late step catches up instead of drifting from the show
+      this->displayStateLastUpdated = millis();
+      this->patternStartState = this->displayStateLastUpdated;
+      this->patternStartMicros = transition.deadline;
+      transitionPlanned = false;
+      transitionReady = false;
+
+      uint32_t latency = micros() - transition.deadline;
+      frameStats.patternTransitions++;
+      if(!wasPrefetched){
+        frameStats.transitionsNotPrefetched++;
+      }
+      frameStats.maxTransitionLatencyMicros = max(frameStats.maxTransitionLatencyMicros, latency);
+      debugf("- step to pattern %d, %d us after its deadline%s\n", playing->index, latency, wasPrefetched ? "" : " (not prefetched)");
+    }
+
+    void loop(){
+      // Abort timeline on button press
+      if(timelineRunning && this->displayState != DS_PATTERN){
+        stopTimeline();
+      }
+
+      // Pattern Shuffle and timeline steps
+      updateTransition();
+
+      // Chunked pattern loading to avoid lag spike on pattern chanage, reads ahead of playback
+      xSemaphoreTake(patternLock, portMAX_DELAY);
+      continueLoadingPattern(*playing);
+      xSemaphoreGive(patternLock);
+
+      bakeQueuedPattern();
+
+      if(dirtySettings != 0 && millis() - settingsChangedAt >= SETTINGS_FLUSH_DELAY){
+        flushSettings();
+      }
 
       // Battery latching state
       if(batteryVoltage <= BATTERY_VOLTAGE_SHUTDOWN || batteryState == BAT_SHUTDOWN){
@@ -3,7 +3,18 @@
 
 #include "open_pixel_poi_config.cpp"
 
+// config.h current values are in amps, this folds them to integer milliamps at compile time (the C3 has no FPU)
+#define MILLIAMPS(amps) ((uint32_t)((amps) * 1000 + 0.5))
+
 #include <NeoPixelBusLg.h>
+#include <esp_timer.h>
+
+// Frames are output from their own task, above the Arduino loop task (priority 1) that runs BLE, flash and the button
+#define RENDER_TASK_PRIORITY 5
+#define RENDER_TASK_STACK 4096
+// Longest the render task sleeps, keeps non-pattern states, brightness changes and slow patterns responsive
+#define RENDER_MAX_PERIOD_MICROS 10000
+
 //#define DEBUG  // Comment this line out to remove printf statements in released version
 #ifdef DEBUG
 #define debugf(...) Serial.print("  <<led>> ");Serial.printf(__VA_ARGS__);
@@ -13,81 +24,179 @@
 #define debugf_noprefix(...)
 #endif
 
-class ILedStrip {
-public:
-    virtual void Begin() = 0;
-    virtual void Show() = 0;
-    virtual void SetPixelColor(uint16_t i, RgbColor color) = 0;
-    virtual void ClearTo(RgbColor color) = 0;
-    virtual void SetBrightness(uint8_t luminance) = 0;
-    virtual uint8_t GetLuminance() = 0;
-    virtual ~ILedStrip() = default;
-    uint8_t CalculateLuminance(uint8_t brightnessSetting, uint8_t ledCount, double consumption, double outputLimit){
-      if(brightnessSetting <= 1){
-        return brightnessSetting;
+// ceil(brightness% * 2.55 * min(1, pcbLimit / (draw * ledCount * channels))), capped to outputLimit
+inline uint8_t calculateLuminance(uint8_t brightnessSetting, uint8_t ledCount, uint32_t consumptionMilliamps, uint32_t outputLimit){
+  if(brightnessSetting <= 1){
+    return brightnessSetting;
+  }
+  uint32_t numerator = brightnessSetting * 255;
+  uint32_t denominator = 100;
+  uint32_t totalConsumption = consumptionMilliamps * ledCount * OUTPUT_CHANNELS;
+  if(totalConsumption > MILLIAMPS(OUTPUT_PCB_CURRENT_LIMIT)){
+    numerator *= MILLIAMPS(OUTPUT_PCB_CURRENT_LIMIT);
+    denominator *= totalConsumption;
+  }
+  return min(outputLimit, (numerator + denominator - 1) / denominator);
+}
+
+// Writes a whole frame of RGB pixels straight into the NeoPixelBus pixel buffer in one pass.
+// Source pixel 0 lands on the last LED (inverted display), and the source repeats when it is shorter than the strip.
+// Luminance is applied the same way NeoPixelBusLg's shader does it, so output matches SetPixelColor().
+template<typename T_COLOR_FEATURE, typename T_STRIP>
+void blitRgbFrame(T_STRIP& strip, const uint8_t* src, size_t pixels){
+  if(pixels == 0){
+    return;
+  }
+  uint8_t* out = strip.Pixels();
+  uint8_t luminance = strip.GetLuminance();
+  const uint8_t* pixel = src;
+  const uint8_t* end = src + pixels * 3;
+  for(int i = strip.PixelCount() - 1; i >= 0; i--){
+    T_COLOR_FEATURE::applyPixelColor(out, i, RgbColor(pixel[0], pixel[1], pixel[2]).Dim(luminance));
+    pixel += 3;
+    if(pixel == end){
+      pixel = src;
+    }
+  }
+  strip.Dirty();
+}
+
+// Copies a baked frame (one pixel per LED, already in the feature's byte order) into the pixel buffer.
+// Only luminance is applied, DotStar pixels get their header byte at full global brightness.
+template<typename T_COLOR_FEATURE, typename T_STRIP>
+void copyWireFrame(T_STRIP& strip, const uint8_t* wire){
+  uint8_t* out = strip.Pixels();
+  uint16_t count = strip.PixelCount();
+  uint16_t ratio = strip.GetLuminance() + 1;
+  if(T_COLOR_FEATURE::PixelSize == 3 && ratio == 256){
+    memcpy(out, wire, count * 3);
+  }else{
+    for(uint16_t i = 0; i < count; i++){
+      if(T_COLOR_FEATURE::PixelSize == 4){
+        *out++ = 0xFF;
       }
-      double consumptionScale = min(1.0, OUTPUT_PCB_CURRENT_LIMIT/(consumption * ledCount * OUTPUT_CHANNELS));
-      return min(outputLimit, ceil(brightnessSetting * 2.55 * consumptionScale));
+      *out++ = (*wire++ * ratio) >> 8;
+      *out++ = (*wire++ * ratio) >> 8;
+      *out++ = (*wire++ * ratio) >> 8;
     }
-};
+  }
+  strip.Dirty();
+}
+
+// Converts a palette into the feature's byte order with luminance applied, starting from color `rotation`,
+// so rendering an indexed frame is one small copy per pixel and cycling the palette costs nothing per pixel.
+template<typename T_COLOR_FEATURE, typename T_STRIP>
+void buildWirePalette(T_STRIP& strip, const uint8_t* rgb, uint16_t count, uint16_t rotation, uint8_t* wire){
+  uint8_t luminance = strip.GetLuminance();
+  const uint8_t* color = rgb + rotation * 3;
+  const uint8_t* end = rgb + count * 3;
+  for(uint16_t i = 0; i < count; i++){
+    T_COLOR_FEATURE::applyPixelColor(wire, i, RgbColor(color[0], color[1], color[2]).Dim(luminance));
+    color += 3;
+    if(color == end){
+      color = rgb;
+    }
+  }
+}
+
+// Same layout as blitRgbFrame(), with every pixel looked up in a palette from buildWirePalette()
+template<typename T_COLOR_FEATURE, typename T_STRIP>
+void blitIndexedFrame(T_STRIP& strip, const uint8_t* indices, size_t pixels, uint8_t bits, const uint8_t* wire){
+  if(pixels == 0){
+    return;
+  }
+  uint8_t* out = strip.Pixels();
+  size_t j = 0;
+  for(int i = strip.PixelCount() - 1; i >= 0; i--){
+    uint8_t index = bits == 8 ? indices[j] : (j & 1 ? indices[j >> 1] & 0x0F : indices[j >> 1] >> 4);
+    memcpy(out + i * T_COLOR_FEATURE::PixelSize, wire + index * T_COLOR_FEATURE::PixelSize, T_COLOR_FEATURE::PixelSize);
+    j++;
+    if(j == pixels){
+      j = 0;
+    }
+  }
+  strip.Dirty();
+}
+
+// The strips share one interface by convention instead of a virtual base class. OpenPixelPoiLED picks the
+// strip for the kit once per loop and its render code is instantiated per strip, so no call in the pixel
+// loops goes through a vtable and everything inlines.
+//
+// Show() starts clocking out the pixel buffer and returns, only blocking while the previous transfer is still running.
+// The buffer is not kept consistent after a Show(), every render path has to rewrite all pixels.
 
-class NoStrip : public ILedStrip {
+class NoStrip {
 public:
-    NoStrip(){}
-
-    void Begin() override {}
-    void Show() override {}
-    void SetPixelColor(uint16_t i, RgbColor color) override {}
-    void ClearTo(RgbColor color) override {}
-    void SetBrightness(uint8_t i) override {}
-    uint8_t GetLuminance() override { return 0;}
+    void Begin() {}
+    void Show() {}
+    bool CanShow() { return true; }
+    void SetPixelColor(uint16_t i, RgbColor color) {}
+    void BlitFrame(const uint8_t* src, size_t pixels) {}
+    void CopyFrame(const uint8_t* wire) {}
+    void BuildPalette(const uint8_t* rgb, uint16_t count, uint16_t rotation, uint8_t* wire) {}
+    void BlitIndexedFrame(const uint8_t* indices, size_t pixels, uint8_t bits, const uint8_t* wire) {}
+    void ClearTo(RgbColor color) {}
+    void SetBrightness(uint8_t i) {}
+    uint8_t GetLuminance() { return 0;}
 };
 
-class NeoPixelStrip : public ILedStrip {
+template<uint8_t DATA_PIN>
+class NeoPixelStrip {
 public:
-    NeoPixelStrip(uint16_t count, uint8_t dataPin) : strip(count, dataPin) {}
+    NeoPixelStrip(uint16_t count) : strip(count, DATA_PIN) {}
 
-    void Begin() override { strip.Begin(); }
-    void Show() override { strip.Show(); }
-    void SetPixelColor(uint16_t i, RgbColor color) override { strip.SetPixelColor(i, color); }
-    void ClearTo(RgbColor color) override { strip.ClearTo(color); }
-    void SetBrightness(uint8_t i) override { 
+    void Begin() { strip.Begin(); }
+    void Show() { strip.Show(false); } // RMT sends from its own buffer, the next frame is composed while this one goes out
+    bool CanShow() { return strip.CanShow(); }
+    void SetPixelColor(uint16_t i, RgbColor color) { strip.SetPixelColor(i, color); }
+    void BlitFrame(const uint8_t* src, size_t pixels) { blitRgbFrame<NeoGrbFeature>(strip, src, pixels); }
+    void CopyFrame(const uint8_t* wire) { copyWireFrame<NeoGrbFeature>(strip, wire); }
+    void BuildPalette(const uint8_t* rgb, uint16_t count, uint16_t rotation, uint8_t* wire) { buildWirePalette<NeoGrbFeature>(strip, rgb, count, rotation, wire); }
+    void BlitIndexedFrame(const uint8_t* indices, size_t pixels, uint8_t bits, const uint8_t* wire) { blitIndexedFrame<NeoGrbFeature>(strip, indices, pixels, bits, wire); }
+    void ClearTo(RgbColor color) { strip.ClearTo(color); }
+    void SetBrightness(uint8_t i) { 
       strip.SetLuminance(
-        CalculateLuminance(i, strip.PixelCount(), OUTPUT_WS2812B_5050_DRAW, OUTPUT_WS2812B_5050_LIMIT)
+        calculateLuminance(i, strip.PixelCount(), MILLIAMPS(OUTPUT_WS2812B_5050_DRAW), OUTPUT_WS2812B_5050_LIMIT)
       ); 
     }
-    uint8_t GetLuminance() override { return strip.GetLuminance(); }
+    uint8_t GetLuminance() { return strip.GetLuminance(); }
 
 private:
     NeoPixelBusLg<NeoGrbFeature, NeoWs2812xMethod, NeoGammaNullMethod> strip;
 };
 
-class DotStarStrip  : public ILedStrip {
+template<int8_t DATA_PIN, int8_t CLOCK_PIN>
+class DotStarStrip {
 public:
-    DotStarStrip(uint16_t count, int8_t dataPin, int8_t clockPin) : 
-    strip(count, clockPin, dataPin),
-    dataPin_(dataPin),
-    clockPin_(clockPin) {}
+    DotStarStrip(uint16_t count) : strip(count, CLOCK_PIN, DATA_PIN) {}
 
-    void Begin() override { 
-      strip.Begin(clockPin_, -1, dataPin_, -1); 
+    void Begin() { 
+      strip.Begin(CLOCK_PIN, -1, DATA_PIN, -1); 
     }
-    void Show() override { strip.Show(); }
-    void SetPixelColor(uint16_t i, RgbColor color) override { strip.SetPixelColor(i, color); }
-    void ClearTo(RgbColor color) override { strip.ClearTo(color); }
-    void SetBrightness(uint8_t i) override { 
+    void Show() { strip.Show(false); } // SPI write is synchronous, so the whole transfer counts as bus wait
+    bool CanShow() { return strip.CanShow(); }
+    void SetPixelColor(uint16_t i, RgbColor color) { strip.SetPixelColor(i, color); }
+    void BlitFrame(const uint8_t* src, size_t pixels) { blitRgbFrame<DotStarBgrFeature>(strip, src, pixels); }
+    void CopyFrame(const uint8_t* wire) { copyWireFrame<DotStarBgrFeature>(strip, wire); }
+    void BuildPalette(const uint8_t* rgb, uint16_t count, uint16_t rotation, uint8_t* wire) { buildWirePalette<DotStarBgrFeature>(strip, rgb, count, rotation, wire); }
+    void BlitIndexedFrame(const uint8_t* indices, size_t pixels, uint8_t bits, const uint8_t* wire) { blitIndexedFrame<DotStarBgrFeature>(strip, indices, pixels, bits, wire); }
+    void ClearTo(RgbColor color) { strip.ClearTo(color); }
+    void SetBrightness(uint8_t i) { 
       strip.SetLuminance(
-        CalculateLuminance(i, strip.PixelCount(), OUTPUT_SK9822_2020_DRAW, OUTPUT_SK9822_2020_LIMIT)
+        calculateLuminance(i, strip.PixelCount(), MILLIAMPS(OUTPUT_SK9822_2020_DRAW), OUTPUT_SK9822_2020_LIMIT)
       );
     }
-    uint8_t GetLuminance() override { return strip.GetLuminance(); }
+    uint8_t GetLuminance() { return strip.GetLuminance(); }
 
 private:
-    uint8_t dataPin_;
-    uint8_t clockPin_;
     NeoPixelBusLg<DotStarBgrFeature, DotStarSpi20MhzMethod, NeoGammaNullMethod> strip;
 };
 
+// Strips of the supported hardware kits, see config.h
+typedef NeoPixelStrip<8> NeoPixelStripV2_2_1;
+typedef NeoPixelStrip<6> NeoPixelStripV3_0_0;
+typedef DotStarStrip<6, 7> DotStarStripV3_0_0;
+
 
 class OpenPixelPoiLED {
   private:
@@ -96,70 +205,411 @@ class OpenPixelPoiLED {
     uint8_t green;
     uint8_t blue;
     long lastFrameIndex = 0;
+    long preparedFrameIndex = -1;
+    long preparedFrameStateUpdated = 0;
+
+    // Playback position in 32.32 fixed point frames. It is advanced by the elapsed micros each loop,
+    // so the only divide happens when the speed changes and the position stays exact over long shows.
+    uint64_t framePhase = 0;
+    uint32_t phasePerMicro = 0; // frames per microsecond in 0.32 fixed point
+    uint32_t phaseRate = 0; // frames per second in 16.16 fixed point the step above was computed for
+    uint32_t phaseLastMicros = 0;
+    long phaseStateUpdated = -1;
+
+    uint32_t lastLoopMicros = 0;
+
+    // Brightness setting last handed to the strip, and the luminance it mapped to before any shutdown fade
+    int appliedBrightness = -1;
+    uint8_t unfadedLuminance = 0;
+    uint32_t lastPatternFrameMicros = 0;
+
+    // Palette of the indexed pattern in the strip's byte order, and the rotation, luminance and palette it was built from
+    uint8_t wirePalette[256 * 4];
+    int paletteRotation = -1;
+    uint8_t paletteLuminance = 0;
+    uint32_t paletteVersion = 0;
+
+    // Render task, woken by frameTimer at the next frame boundary
+    TaskHandle_t renderTask = NULL;
+    esp_timer_handle_t frameTimer = NULL;
+    uint32_t nextFrameMicros = 0;
+    bool nextFrameIsBoundary = false;
+
+    // Holding on the last loaded frame, since loaderStallStart
+    bool loaderStalled = false;
+    uint32_t loaderStallStart = 0;
 
-    // Declare our LED strip object:
-    ILedStrip* ledStrip = new NoStrip();
+    #ifdef DEBUG
+    uint64_t loopCycles = 0;
+    uint32_t loopCount = 0;
+    #endif
+
+    // LED strip objects, only the one matching the kit gets created. Without one nothing is output.
+    NoStrip noStrip;
+    NeoPixelStripV2_2_1* neoPixelStripV2_2_1 = nullptr;
+    NeoPixelStripV3_0_0* neoPixelStripV3_0_0 = nullptr;
+    DotStarStripV3_0_0* dotStarStripV3_0_0 = nullptr;
 
   public:
     OpenPixelPoiLED(OpenPixelPoiConfig& _config): config(_config){}    
     int frameIndex;
     void setup(){
       debugf("Setup begin\n");
+      frameIndex = 0;
       // Create Led Strip objects based on config, all unhandled cases fall through with NoStrip
-      if(config.hardwareVersion == 1){
-        if(config.ledType == 1){
-          ledStrip = new NeoPixelStrip(config.ledCount, 8);
+      if(config.hardwareVersion == 1 && config.ledType == 1){
+        neoPixelStripV2_2_1 = new NeoPixelStripV2_2_1(config.ledCount);
+        setupStrip(*neoPixelStripV2_2_1);
+      }else if(config.hardwareVersion == 2 && config.ledType == 1){
+        neoPixelStripV3_0_0 = new NeoPixelStripV3_0_0(config.ledCount);
+        setupStrip(*neoPixelStripV3_0_0);
+      }else if(config.hardwareVersion == 2 && config.ledType == 2){
+        dotStarStripV3_0_0 = new DotStarStripV3_0_0(config.ledCount);
+        setupStrip(*dotStarStripV3_0_0);
+      }else{
+        setupStrip(noStrip);
+      }
+
+      debugf("LED setup complete\n");
+    }
+
+    // From here on loop() only runs in the render task
+    void startRenderTask(){
+      esp_timer_create_args_t timerArgs = {};
+      timerArgs.callback = onFrameTimer;
+      timerArgs.arg = this;
+      timerArgs.name = "frame";
+      esp_timer_create(&timerArgs, &frameTimer);
+      xTaskCreate(renderTaskMain, "render", RENDER_TASK_STACK, this, RENDER_TASK_PRIORITY, &renderTask);
+      debugf("Render task started\n");
+    }
+
+    static void onFrameTimer(void* arg){
+      xTaskNotifyGive(((OpenPixelPoiLED*)arg)->renderTask);
+    }
+
+    static void renderTaskMain(void* arg){
+      OpenPixelPoiLED* led = (OpenPixelPoiLED*)arg;
+      led->scheduleNextFrame();
+      while(true){
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        led->recordFrameLatency();
+        xSemaphoreTake(led->config.patternLock, portMAX_DELAY);
+        led->config.commitTransition();
+        #ifdef DEBUG
+        led->measureLoop();
+        #else
+        led->loop();
+        #endif
+        xSemaphoreGive(led->config.patternLock);
+        led->scheduleNextFrame();
+      }
+    }
+
+    // Arms frameTimer for the next pattern frame boundary. It is worked out from the phase accumulator,
+    // so the timer can't drift against the pattern, and rounded up so it lands just after the boundary.
+    void scheduleNextFrame(){
+      uint32_t now = micros();
+      uint32_t wait = RENDER_MAX_PERIOD_MICROS;
+      nextFrameIsBoundary = false;
+      if(isPatternState() && phasePerMicro != 0 && phaseStateUpdated == config.displayStateLastUpdated){
+        uint32_t boundary = phaseLastMicros + ~(uint32_t)framePhase / phasePerMicro + 1;
+        int32_t untilBoundary = boundary - now;
+        if(untilBoundary <= RENDER_MAX_PERIOD_MICROS){
+          wait = max(untilBoundary, (int32_t)1);
+          nextFrameMicros = boundary;
+          nextFrameIsBoundary = true;
         }
-      }else if(config.hardwareVersion == 2){
-        if(config.ledType == 1){
-          ledStrip = new NeoPixelStrip(config.ledCount, 6);
-        }else if(config.ledType == 2){  
-          ledStrip = new DotStarStrip(config.ledCount, 6, 7);
+      }
+      // A prefetched shuffle or timeline step is swapped in right at its deadline, and starts on its first frame
+      uint32_t transitionMicros;
+      if(config.transitionReadyAt(transitionMicros)){
+        int32_t untilTransition = transitionMicros - now;
+        if(untilTransition < (int32_t)wait){
+          wait = max(untilTransition, (int32_t)1);
+          nextFrameIsBoundary = false;
         }
       }
+      esp_timer_start_once(frameTimer, wait);
+    }
 
-      // LED Setup:
-      ledStrip->Begin();
-      frameIndex = 0;
+    void recordFrameLatency(){
+      if(!nextFrameIsBoundary){
+        return;
+      }
+      int32_t latency = max((int32_t)(micros() - nextFrameMicros), (int32_t)0);
+      config.frameStats.maxFrameLatencyMicros = max(config.frameStats.maxFrameLatencyMicros, (uint32_t)latency);
+      uint32_t scaled = latency >> 2;
+      int bucket = scaled == 0 ? 0 : 32 - __builtin_clz(scaled);
+      config.frameStats.latencyHistogram[min(bucket, FRAME_STATS_LATENCY_BUCKETS - 1)]++;
+    }
 
-      debugf("LED setup complete\n");
+    #ifdef DEBUG
+    // Average CPU cycles spent in loop(), printed every 10000 loops
+    void measureLoop(){
+      uint32_t start = ESP.getCycleCount();
+      loop();
+      loopCycles += ESP.getCycleCount() - start;
+      loopCount++;
+      if(loopCount == 10000){
+        debugf("loop() = %d cycles avg\n", (uint32_t)(loopCycles / loopCount));
+        loopCycles = 0;
+        loopCount = 0;
+      }
+    }
+    #endif
+
+    template<typename T_STRIP>
+    void setupStrip(T_STRIP& strip){
+      strip.Begin();
+
+      #ifdef DEBUG
+      benchmarkRender(strip);
+      #endif
+    }
+
+    #ifdef DEBUG
+    // Times the old per-pixel SetPixelColor() render against BlitFrame() and CopyFrame() on the loaded pattern.
+    // The RAM frames are read both as frameHeight and as ledCount pixels, so only the frames that fit either way are used.
+    // test/host/test_render.cpp runs the same comparison on the computer.
+    template<typename T_STRIP>
+    void benchmarkRender(T_STRIP& strip){
+      LoadedPattern& p = *config.playing;
+      uint32_t frameBytes = max(p.frameHeight, config.ledCount) * 3;
+      uint32_t frames = p.buffer == NULL || frameBytes == 0 ? 0 : min((uint32_t)p.playbackFrameCount, p.bufferSize / frameBytes);
+      if(frames == 0 || p.frameHeight == 0 || config.ledCount == 0){
+        debugf("Render benchmark skipped, no frames in RAM\n");
+        return;
+      }
+      const int iterations = 1000;
+      uint32_t start = micros();
+      for(int i = 0; i < iterations; i++){
+        int frame = i % frames;
+        for (int j=0; j<config.ledCount; j++){
+          red = p.buffer[frame*p.frameHeight*3 + j%p.frameHeight*3 + 0];
+          green = p.buffer[frame*p.frameHeight*3 + j%p.frameHeight*3 + 1];
+          blue = p.buffer[frame*p.frameHeight*3 + j%p.frameHeight*3 + 2];
+          strip.SetPixelColor(config.ledCount-1-j, RgbColor(red, green, blue));
+        }
+      }
+      uint32_t perPixelTime = micros() - start;
+      start = micros();
+      for(int i = 0; i < iterations; i++){
+        strip.BlitFrame(p.buffer + (i % frames)*p.frameHeight*3, p.frameHeight);
+      }
+      uint32_t blitTime = micros() - start;
+      start = micros();
+      for(int i = 0; i < iterations; i++){
+        strip.CopyFrame(p.buffer + (i % frames)*config.ledCount*3);
+      }
+      uint32_t copyTime = micros() - start;
+      // Baked frames read through the flash cache from the pattern store, against the RAM copy above
+      uint32_t mappedTime = 0;
+      if(p.baked && p.frames != p.buffer && p.frameBytes == (uint32_t)config.ledCount*3 && p.playbackFrameCount > 0){
+        start = micros();
+        for(int i = 0; i < iterations; i++){
+          strip.CopyFrame(p.frames + (i % p.playbackFrameCount)*p.frameBytes);
+        }
+        mappedTime = micros() - start;
+      }
+      debugf("Render benchmark, %d leds\n", config.ledCount);
+      debugf("- SetPixelColor = %d ns/frame\n", perPixelTime * 1000 / iterations);
+      debugf("- BlitFrame = %d ns/frame\n", blitTime * 1000 / iterations);
+      debugf("- CopyFrame (baked) = %d ns/frame\n", copyTime * 1000 / iterations);
+      debugf("- CopyFrame (baked, flash mapped) = %d ns/frame\n", mappedTime * 1000 / iterations);
+    }
+    #endif
+
+    // Frame rate in 16.16 fixed point, so fractional speeds are possible
+    void setFrameRate(uint32_t framesPerSecond){
+      if(framesPerSecond != phaseRate){
+        phaseRate = framesPerSecond;
+        phasePerMicro = (((uint64_t)framesPerSecond << 16) + 500000) / 1000000;
+      }
+    }
+
+    void advanceFramePhase(){
+      uint32_t now = micros();
+      if(phaseStateUpdated != config.displayStateLastUpdated){
+        // Pattern (re)started, count from displayStateLastUpdated. Transitions give the exact start, which keeps timelines in time.
+        phaseStateUpdated = config.displayStateLastUpdated;
+        if(config.patternStartState == config.displayStateLastUpdated){
+          phaseLastMicros = config.patternStartMicros;
+        }else{
+          phaseLastMicros = now - (uint32_t)(millis() - config.displayStateLastUpdated) * 1000;
+        }
+        framePhase = 0;
+      }
+      setFrameRate((uint32_t)config.animationSpeed << 16);
+      framePhase += (uint64_t)(now - phaseLastMicros) * phasePerMicro;
+      phaseLastMicros = now;
+
+      uint32_t frame = framePhase >> 32;
+      if(frame >= config.playing->playbackFrameCount){
+        frame %= config.playing->playbackFrameCount;
+        framePhase = ((uint64_t)frame << 32) | (uint32_t)framePhase;
+      }
+      // Never show a frame the loader hasn't reached, hold the last loaded one and carry on from there
+      uint16_t resident = config.playing->framesResident;
+      bool stalled = frame >= resident && resident > 0;
+      if(stalled){
+        frame = resident - 1;
+        framePhase = (uint64_t)frame << 32;
+      }
+      recordLoaderStall(stalled);
+      config.playing->playbackCursor = frame;
+      frameIndex = frame;
+    }
+
+    void recordLoaderStall(bool stalled){
+      uint32_t now = micros();
+      if(stalled && !loaderStalled){
+        config.frameStats.loaderStalls++;
+        loaderStallStart = now;
+      }else if(!stalled && loaderStalled){
+        config.frameStats.loaderStallMicros += now - loaderStallStart;
+      }
+      loaderStalled = stalled;
+    }
+
+    template<typename T_STRIP>
+    void renderPatternFrame(T_STRIP& strip, int index){
+      // Inverted by BlitFrame/baking, this makes a veritical image right side up at the top of a poi's arc, when it is upside down.
+      const uint8_t* frame = config.playing->frames + index*config.playing->frameBytes;
+      if(config.playing->baked){
+        strip.CopyFrame(frame);
+      }else if(config.playing->encoding == PE_INDEXED){
+        strip.BlitIndexedFrame(frame, config.playing->frameHeight, config.playing->indexBits, wirePalette);
+      }else{
+        strip.BlitFrame(frame, config.playing->frameHeight);
+      }
+    }
+
+    // Rebuilds wirePalette when the rotation, luminance or palette changed. Returns true if it did.
+    template<typename T_STRIP>
+    bool updatePalette(T_STRIP& strip){
+      uint16_t rotation = 0;
+      if(config.playing->paletteCycleSpeed != 0){
+        uint32_t elapsed = millis() - config.displayStateLastUpdated;
+        rotation = ((elapsed / 1000) * config.playing->paletteCycleSpeed + (elapsed % 1000) * config.playing->paletteCycleSpeed / 1000) % config.playing->paletteCount;
+      }
+      if(rotation == paletteRotation && strip.GetLuminance() == paletteLuminance && config.paletteVersion == paletteVersion){
+        return false;
+      }
+      paletteRotation = rotation;
+      paletteLuminance = strip.GetLuminance();
+      paletteVersion = config.paletteVersion;
+      strip.BuildPalette(config.playing->palette, config.playing->paletteCount, rotation, wirePalette);
+      return true;
+    }
+
+    // Show() time is how long the CPU was held up by the bus (previous transfer or a blocking SPI write)
+    template<typename T_STRIP>
+    void showFrame(T_STRIP& strip){
+      if(!strip.CanShow()){
+        config.frameStats.busBlockedCount++;
+      }
+      uint32_t showStart = micros();
+      strip.Show();
+      config.frameStats.busWaitMicros += micros() - showStart;
+    }
+
+    void recordLoopTime(){
+      uint32_t now = micros();
+      uint32_t period = (now - lastLoopMicros) >> 4;
+      lastLoopMicros = now;
+      int bucket = period == 0 ? 0 : 32 - __builtin_clz(period);
+      config.frameStats.loopHistogram[min(bucket, FRAME_STATS_LOOP_BUCKETS - 1)]++;
+    }
+
+    // Called for each new pattern frame, before it is rendered
+    void recordPatternFrame(long previousFrameIndex, bool patternRestarted){
+      uint32_t now = micros();
+      if(!patternRestarted){
+        long skipped = frameIndex - previousFrameIndex - 1;
+        if(skipped < 0){
+          skipped += config.playing->playbackFrameCount;
+        }
+        config.frameStats.framesSkipped += skipped;
+        config.frameStats.maxFrameGapMicros = max(config.frameStats.maxFrameGapMicros, now - lastPatternFrameMicros);
+      }
+      config.frameStats.framesShown++;
+      lastPatternFrameMicros = now;
+    }
+
+    // The strip only recalculates luminance when the setting actually changes
+    template<typename T_STRIP>
+    void applyBrightness(T_STRIP& strip, uint8_t brightness){
+      if(brightness != appliedBrightness){
+        appliedBrightness = brightness;
+        strip.SetBrightness(brightness);
+      }
+    }
+
+    // A pattern that can't be played, not even as the placeholder, blanks the strip
+    bool isPatternState(){
+      return (config.displayState == DS_PATTERN || config.displayState == DS_PATTERN_ALL  || config.displayState == DS_PATTERN_ALL_ALL)
+        && config.playing->playbackFrameCount > 0;
     }
 
     void loop(){
+      // Dispatched once per loop, render() is inlined for the strip of each kit
+      if(dotStarStripV3_0_0){
+        render(*dotStarStripV3_0_0);
+      }else if(neoPixelStripV3_0_0){
+        render(*neoPixelStripV3_0_0);
+      }else if(neoPixelStripV2_2_1){
+        render(*neoPixelStripV2_2_1);
+      }else{
+        render(noStrip);
+      }
+    }
+
+    template<typename T_STRIP>
+    void render(T_STRIP& strip){
+      recordLoopTime();
+
       // Set Brightness. 
+      uint8_t brightness = config.ledBrightness; // Normal operation
       // Low voltage = force low brightness
       if(config.batteryState == BAT_LOW && config.ledBrightness > 10){
-        ledStrip->SetBrightness(10);
+        brightness = 10;
       }else if(config.batteryState == BAT_CRITICAL || config.batteryState == BAT_SHUTDOWN){
-        ledStrip->SetBrightness(1);
-      }else{ // Normal operation
-        ledStrip->SetBrightness(config.ledBrightness);
+        brightness = 1;
       }
-      // Shutdown fadeout
       if(config.displayState == DS_SHUTDOWN){
-        uint8_t fadedBrightness = ledStrip->GetLuminance() * ((2000-(millis() - config.displayStateLastUpdated))/2000.0);
+        // Shutdown fadeout
+        uint32_t fadeTime = min((uint32_t)(millis() - config.displayStateLastUpdated), (uint32_t)2000);
+        uint8_t fadedBrightness = unfadedLuminance * (2000 - fadeTime) / 2000;
         if (fadedBrightness == 0){
           fadedBrightness = 1;
         }
-        ledStrip->SetBrightness(fadedBrightness);
+        applyBrightness(strip, fadedBrightness);
+      }else{
+        applyBrightness(strip, brightness);
+        unfadedLuminance = strip.GetLuminance();
       }
 
-      // Clear previous data
-      ledStrip->ClearTo(RgbColor(0,0,0));
+      // Clear previous data (patterns overwrite every pixel, and may already be rendered ahead)
+      if(!isPatternState()){
+        strip.ClearTo(RgbColor(0,0,0));
+        preparedFrameIndex = -1;
+      }
 
       // Render output
-      if(config.displayState == DS_PATTERN || config.displayState == DS_PATTERN_ALL  || config.displayState == DS_PATTERN_ALL_ALL){
-        frameIndex = ((micros() - (config.displayStateLastUpdated * 1000)) / (1000000/(config.animationSpeed))) % config.frameCount;
-        if(lastFrameIndex == frameIndex){
+      if(isPatternState()){
+        bool patternRestarted = phaseStateUpdated != config.displayStateLastUpdated;
+        advanceFramePhase();
+        bool paletteChanged = config.playing->encoding == PE_INDEXED && updatePalette(strip);
+        if(lastFrameIndex == frameIndex && !patternRestarted && !paletteChanged){
           return;
-        }else{
+        }
+        if(lastFrameIndex != frameIndex || patternRestarted){
+          recordPatternFrame(lastFrameIndex, patternRestarted);
           lastFrameIndex = frameIndex;
         }
-        for (int j=0; j<config.ledCount; j++){
-          red = config.pattern[frameIndex*config.frameHeight*3 + j%config.frameHeight*3 + 0];
-          green = config.pattern[frameIndex*config.frameHeight*3 + j%config.frameHeight*3 + 1];
-          blue = config.pattern[frameIndex*config.frameHeight*3 + j%config.frameHeight*3 + 2];
-          ledStrip->SetPixelColor(config.ledCount-1-j, RgbColor(red, green, blue)); // Invert display, this makes a veritical image right side up at the top of a poi's arc, when it is upside down.
+        if(paletteChanged || frameIndex != preparedFrameIndex || preparedFrameStateUpdated != config.displayStateLastUpdated){
+          renderPatternFrame(strip, frameIndex);
         }
       }else if(config.displayState == DS_WAITING || config.displayState == DS_WAITING2 || config.displayState == DS_WAITING3 || config.displayState == DS_WAITING4 || config.displayState == DS_WAITING5){
         // 500ms or till interupted
@@ -185,15 +635,17 @@ class OpenPixelPoiLED {
           blue = 0x00;
         }else if(config.displayState == DS_WAITING5){
           // Green -> RED fade for battery!
-          red = 0xFF * ((millis() - config.displayStateLastUpdated)/500.0);
+          red = 0xFF * min((uint32_t)(millis() - config.displayStateLastUpdated), (uint32_t)500) / 500;
           green = 0xFF - red;
           blue = 0x00;
         }
+        // Two dots run from the ends to the middle in 500ms
+        uint32_t dot = (millis() - config.displayStateLastUpdated) / (1000 / max((int)config.ledCount, 1));
         for(int j=0; j<config.ledCount; j++){
-          if(j == (millis() - config.displayStateLastUpdated)/(int)(500/(config.ledCount/2.0)) || config.ledCount - j - 1 == (millis() - config.displayStateLastUpdated)/(int)(500/(config.ledCount/2.0))){
-            ledStrip->SetPixelColor(j, RgbColor(red, green, blue));
+          if(j == dot || config.ledCount - j - 1 == dot){
+            strip.SetPixelColor(j, RgbColor(red, green, blue));
           }else{
-            ledStrip->SetPixelColor(j, RgbColor(0x00, 0x00, 0x00));
+            strip.SetPixelColor(j, RgbColor(0x00, 0x00, 0x00));
           }
         }
       }else if(config.displayState == DS_VOLTAGE){
@@ -207,7 +659,7 @@ class OpenPixelPoiLED {
         red = 0xff - green;
         blue = 0x00;
         for (int j=0; j<config.ledCount; j++){
-          ledStrip->SetPixelColor(j, RgbColor(red, green, blue));
+          strip.SetPixelColor(j, RgbColor(red, green, blue));
         }
       }else if(config.displayState == DS_VOLTAGE2){
         if(config.batteryVoltage > 3.90){
@@ -225,15 +677,15 @@ class OpenPixelPoiLED {
         }
         
         for (int j=0; j<(int)config.batteryVoltage; j++){
-          ledStrip->SetPixelColor(j, RgbColor(0, 0, 255));
+          strip.SetPixelColor(j, RgbColor(0, 0, 255));
         }
         for (int j=0; j<(int)((config.batteryVoltage - (int)config.batteryVoltage) * 10); j++){
           if(j > 5){
-            ledStrip->SetPixelColor(j+11, RgbColor(red, green, blue)); 
+            strip.SetPixelColor(j+11, RgbColor(red, green, blue)); 
           }else if(j > 2){
-            ledStrip->SetPixelColor(j+10, RgbColor(red, green, blue)); 
+            strip.SetPixelColor(j+10, RgbColor(red, green, blue)); 
           }else{
-            ledStrip->SetPixelColor(j+9, RgbColor(red, green, blue)); 
+            strip.SetPixelColor(j+9, RgbColor(red, green, blue)); 
           }
         }
       }else if(config.displayState == DS_SHUTDOWN){
@@ -249,9 +701,9 @@ class OpenPixelPoiLED {
         // 2000ms Blink & Pixel Crush
         if (millis() - config.displayStateLastUpdated > 200) {
           for(int j = 0; j < config.ledCount; j++){
-            int threshold = (int)(((millis() - config.displayStateLastUpdated) / 2000.0) * ((config.ledCount/2) + config.ledCount % 2)) -1;
+            int threshold = (int)((millis() - config.displayStateLastUpdated) * ((config.ledCount/2) + config.ledCount % 2) / 2000) -1;
             if(j > threshold && j < config.ledCount - threshold - 1){
-              ledStrip->SetPixelColor(j, RgbColor(red, green, blue));
+              strip.SetPixelColor(j, RgbColor(red, green, blue));
             }
           }
         }
@@ -261,28 +713,28 @@ class OpenPixelPoiLED {
         if (pressTime < 1500){
           for (int j=1; j-1 <= pressTime/500; j+=1){
             for(int k=(j-1) * chunkSize; k < j*chunkSize -1; k++){
-              ledStrip->SetPixelColor(k, RgbColor(0xFF, 0x00, 0xFF));
+              strip.SetPixelColor(k, RgbColor(0xFF, 0x00, 0xFF));
             }
           }
         }else{
           for (int j=0; j < 3; j+=1){
             for(int k=j * chunkSize; k < ((j + 1) * chunkSize) -1; k++){
-                ledStrip->SetPixelColor(k, RgbColor(0xFF, 0x00, 0xFF));
+                strip.SetPixelColor(k, RgbColor(0xFF, 0x00, 0xFF));
                 if (pressTime < 2000){
                   if(chunkSize <= 4 || (k - (j* chunkSize) > 0 && k - (j* chunkSize) < chunkSize - 2)){
-                    ledStrip->SetPixelColor(k, RgbColor(0x00, 0x00, 0xFF));
+                    strip.SetPixelColor(k, RgbColor(0x00, 0x00, 0xFF));
                   }
                 }else if (pressTime < 2500){
                   if(j == 0 && (chunkSize <= 4 || (k - (j* chunkSize) > 0 && k - (j* chunkSize) < chunkSize - 2))){
-                    ledStrip->SetPixelColor(k, RgbColor(0x00, 0x00, 0xFF));
+                    strip.SetPixelColor(k, RgbColor(0x00, 0x00, 0xFF));
                   }
                 }else if (pressTime < 3000){
                   if(j == 1 && (chunkSize <= 4 || (k - (j* chunkSize) > 0 && k - (j* chunkSize) < chunkSize - 2))){
-                    ledStrip->SetPixelColor(k, RgbColor(0x00, 0x00, 0xFF));
+                    strip.SetPixelColor(k, RgbColor(0x00, 0x00, 0xFF));
                   }
                 }else if (pressTime < 3500){
                   if(j == 2 && (chunkSize <= 4 || (k - (j* chunkSize) > 0 && k - (j* chunkSize) < chunkSize - 2))){
-                    ledStrip->SetPixelColor(k, RgbColor(0x00, 0x00, 0xFF));
+                    strip.SetPixelColor(k, RgbColor(0x00, 0x00, 0xFF));
                   }
                 }
             }
@@ -303,37 +755,48 @@ class OpenPixelPoiLED {
         }else{
           config.ledBrightness = config.ledBrightnessOptions[5];
         }
-        ledStrip->SetBrightness(config.ledBrightness);
+        applyBrightness(strip, config.ledBrightness);
         red = 0xFF;
         green = 0xFF;
         blue = 0xFF;
         for (int j=0; j< config.ledCount; j++){
           if (j % 4 == 1 || j % 4 == 2 || config.ledCount < 8){
-            ledStrip->SetPixelColor(j, RgbColor(red, green, blue));
+            strip.SetPixelColor(j, RgbColor(red, green, blue));
           }
         }
       }else if(config.displayState == DS_SPEED){
         red = 0xFF;
         if(config.ledCount < 6 && (millis() - config.displayStateLastUpdated) % 500 < 25 && (millis() - config.displayStateLastUpdated) < 3000){
           for (int j=0; j< config.ledCount; j++){
-            ledStrip->SetPixelColor(j, RgbColor(red, 0, 0));
+            strip.SetPixelColor(j, RgbColor(red, 0, 0));
           }
         }else{
           for (int j=0; j < min(int((millis() - config.displayStateLastUpdated + 500)/500), 6) * int(config.ledCount/6); j++){
-            ledStrip->SetPixelColor(j, RgbColor(red, 0, 0));
+            strip.SetPixelColor(j, RgbColor(red, 0, 0));
           }
         }
       }
 
       // Super low voltage, only display red
       if(config.batteryState == BAT_CRITICAL && (config.displayState == DS_PATTERN || config.displayState == DS_PATTERN_ALL)){
-        ledStrip->ClearTo(RgbColor(0,0,0));
-        ledStrip->SetPixelColor(0, RgbColor(255, 0x00, 0x00));
-        ledStrip->SetPixelColor(config.ledCount - 1, RgbColor(255, 0x00, 0x00));
+        strip.ClearTo(RgbColor(0,0,0));
+        strip.SetPixelColor(0, RgbColor(255, 0x00, 0x00));
+        strip.SetPixelColor(config.ledCount - 1, RgbColor(255, 0x00, 0x00));
       }
 
       // Output
-      ledStrip->Show();
+      showFrame(strip);
+
+      // Render ahead, compose the next frame while this one is clocked out
+      if(isPatternState()){
+        preparedFrameIndex = (frameIndex + 1) % config.playing->playbackFrameCount;
+        preparedFrameStateUpdated = config.displayStateLastUpdated;
+        if(preparedFrameIndex < config.playing->framesResident){
+          renderPatternFrame(strip, preparedFrameIndex);
+        }else{
+          preparedFrameIndex = -1;
+        }
+      }
     }
 };
 
@@ -0,0 +1,206 @@
+#ifndef _OPEN_PIXEL_POI_PARSER
+#define _OPEN_PIXEL_POI_PARSER
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Longest message that is collected whole, longer ones have to be streamed (see OpenPixelPoiParserListener::streamHeaderSize())
+#define PARSER_MESSAGE_LIMIT 512
+
+// Gets what OpenPixelPoiParser finds. The parser knows framing, the listener knows the messages.
+class OpenPixelPoiParserListener {
+  public:
+    // Header bytes a message with the code starts with if it is streamed, 0 = the message is collected whole
+    virtual size_t streamHeaderSize(uint8_t code) = 0;
+    // A streamed message's header is in, sets how many bytes follow it. False skips the message.
+    virtual bool beginStream(uint8_t code, const uint8_t* header, size_t length, uint32_t& remaining) = 0;
+    // Straight from the packet, the bytes are only valid during the call
+    virtual void streamData(const uint8_t* data, size_t length) = 0;
+    // The message ended, short streams are the listener's to pad
+    virtual void finishStream() = 0;
+    virtual void cancelStream() = 0;
+    // A whole message, the payload after the code
+    virtual void handleMessage(uint8_t code, const uint8_t* payload, size_t length) = 0;
+    virtual void messageError() = 0;
+};
+
+enum ParserState {
+  PS_IDLE,    // Waiting for D0
+  PS_CODE,
+  PS_HEADER,  // Collecting a streamed message's header
+  PS_STREAM,  // Passing a streamed message on as it comes
+  PS_MESSAGE, // Collecting a whole message
+  PS_END,     // Expecting D1
+  PS_SKIP,    // Dropping the rest of a rejected message
+};
+
+// Incremental message parser, fed fragments that can break anywhere. v1 messages are framed by D0 and D1, messages
+// from v2 packets are not (startMessage() and endMessage() frame them). Streamed messages are handed on without
+// copying, whole messages are collected into a fixed buffer. Nothing is allocated.
+class OpenPixelPoiParser {
+  private:
+    OpenPixelPoiParserListener& listener;
+    uint8_t code;
+    uint8_t buffer[PARSER_MESSAGE_LIMIT]; // A streamed message's header, or a whole message
+    size_t buffered;
+    size_t headerSize;
+    uint32_t streamRemaining;
+    bool stream = false; // The message is streamed
+    bool heldD1 = false; // A D1 that ended a fragment of a framed stream, data if more follows, else the end
+
+  public:
+    ParserState state = PS_IDLE;
+    bool framed = true; // The message started with D0, so it ends with D1
+
+    OpenPixelPoiParser(OpenPixelPoiParserListener& _listener): listener(_listener) {}
+
+    // A message is under way
+    bool inMessage(){
+      return state != PS_IDLE;
+    }
+
+    // A streamed message is under way
+    bool streaming(){
+      return stream && state != PS_IDLE;
+    }
+
+    // The next bytes are the code and payload of an unframed message
+    void startMessage(){
+      cancel();
+      framed = false;
+      state = PS_CODE;
+    }
+
+    void feed(const uint8_t* data, size_t length){
+      size_t i = 0;
+      if(heldD1 && length > 0){
+        static const uint8_t d1 = 0xD1;
+        heldD1 = false;
+        listener.streamData(&d1, 1);
+        streamRemaining--;
+        state = streamRemaining > 0 ? PS_STREAM : PS_END;
+      }
+      while(i < length){
+        switch(state){
+          case PS_IDLE:
+            if(data[i++] == 0xD0){
+              framed = true;
+              state = PS_CODE;
+            }
+            break;
+          case PS_CODE:
+            startCode(data[i++]);
+            break;
+          case PS_HEADER: {
+            size_t n = headerSize - buffered < length - i ? headerSize - buffered : length - i;
+            memcpy(buffer + buffered, data + i, n);
+            buffered += n;
+            i += n;
+            if(buffered == headerSize){
+              if(!listener.beginStream(code, buffer, headerSize, streamRemaining)){
+                state = PS_SKIP;
+              }else{
+                state = streamRemaining > 0 ? PS_STREAM : PS_END;
+              }
+            }
+            break;
+          }
+          case PS_STREAM: {
+            size_t n = streamRemaining < length - i ? streamRemaining : length - i;
+            // A D1 at the end of the fragment might end a short stream, that is only known once the next fragment comes
+            if(framed && n == length - i && data[length - 1] == 0xD1){
+              n--;
+              heldD1 = true;
+            }
+            if(n > 0){
+              listener.streamData(data + i, n);
+            }
+            i += n;
+            streamRemaining -= n;
+            if(heldD1){
+              i = length;
+            }else if(streamRemaining == 0){
+              state = PS_END;
+            }
+            break;
+          }
+          case PS_MESSAGE: {
+            size_t n = length - i;
+            if(buffered + n > sizeof(buffer)){
+              listener.messageError();
+              state = PS_SKIP;
+              break;
+            }
+            memcpy(buffer + buffered, data + i, n);
+            buffered += n;
+            i = length;
+            break;
+          }
+          case PS_END:
+            if(data[i++] == 0xD1 && framed){
+              finish();
+            }else{
+              listener.messageError();
+              cancel();
+            }
+            break;
+          case PS_SKIP:
+            i = length;
+            break;
+        }
+      }
+    }
+
+    // Nothing more of the message comes
+    void endMessage(){
+      if(state == PS_MESSAGE){
+        finish();
+      }else if(state == PS_STREAM || state == PS_END){
+        // Short streams and unframed ones end here, a held D1 was the end
+        heldD1 = false;
+        finish();
+      }else if(state == PS_CODE || state == PS_HEADER){
+        listener.messageError();
+        cancel();
+      }
+      stream = false;
+      state = PS_IDLE;
+    }
+
+    // Drops the message under way
+    void cancel(){
+      // Only streams the listener began, not ones still collecting their header or rejected
+      if(stream && (state == PS_STREAM || state == PS_END)){
+        listener.cancelStream();
+      }
+      heldD1 = false;
+      stream = false;
+      state = PS_IDLE;
+    }
+
+  private:
+    void startCode(uint8_t code){
+      this->code = code;
+      buffered = 0;
+      headerSize = listener.streamHeaderSize(code);
+      stream = headerSize > 0;
+      state = stream ? PS_HEADER : PS_MESSAGE;
+    }
+
+    void finish(){
+      if(stream){
+        listener.finishStream();
+      }else if(!framed){
+        listener.handleMessage(code, buffer, buffered);
+      }else if(buffered > 0 && buffer[buffered - 1] == 0xD1){
+        listener.handleMessage(code, buffer, buffered - 1);
+      }else{
+        listener.messageError();
+      }
+      stream = false;
+      state = PS_IDLE;
+    }
+};
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef _FAKE_ARDUINO_H
+#define _FAKE_ARDUINO_H
+
+// Just enough of the Arduino core for the config module on the host. Time only moves when a test advances it.
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <string>
+
+using std::min;
+using std::max;
+
+extern uint64_t fakeMicros;
+
+inline unsigned long millis(){
+  return fakeMicros / 1000;
+}
+
+inline unsigned long micros(){
+  return (uint32_t)fakeMicros;
+}
+
+inline void delay(uint32_t ms){
+  fakeMicros += (uint64_t)ms * 1000;
+}
+
+class String {
+  public:
+    String(const char* text = ""): text(text){}
+    const char* c_str() const {
+      return text.c_str();
+    }
+    size_t length() const {
+      return text.size();
+    }
+    bool operator==(const String& other) const {
+      return text == other.text;
+    }
+  private:
+    std::string text;
+};
+
+class FakeSerial {
+  public:
+    void begin(unsigned long baud){}
+    void print(const char* text){
+      fputs(text, stdout);
+    }
+    int printf(const char* format, ...){
+      va_list args;
+      va_start(args, format);
+      int length = vprintf(format, args);
+      va_end(args);
+      return length;
+    }
+};
+
+extern FakeSerial Serial;
+
+// FreeRTOS, the tests run single threaded
+typedef void* SemaphoreHandle_t;
+#define portMAX_DELAY 0xFFFFFFFF
+#define pdTRUE 1
+inline SemaphoreHandle_t xSemaphoreCreateMutex(){
+  return (SemaphoreHandle_t)1;
+}
+inline int xSemaphoreTake(SemaphoreHandle_t semaphore, uint32_t ticks){
+  return pdTRUE;
+}
+inline int xSemaphoreGive(SemaphoreHandle_t semaphore){
+  return pdTRUE;
+}
+
+// Tasks are never started, tests call the task's work directly
+typedef void* TaskHandle_t;
+#define pdMS_TO_TICKS(ms) (ms)
+inline int xTaskCreate(void (*task)(void*), const char* name, uint32_t stack, void* arg, int priority, TaskHandle_t* handle){
+  return pdTRUE;
+}
+inline void xTaskNotifyGive(TaskHandle_t task){}
+inline uint32_t ulTaskNotifyTake(int clear, uint32_t ticks){
+  return 0;
+}
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef _FAKE_FS_H
+#define _FAKE_FS_H
+
+// In-memory file system with the LittleFS behavior the config module relies on: a file opened for writing starts empty,
+// writes land in it right away, renames replace the destination in one step and open files keep their data when
+// they are renamed or removed.
+#include <Arduino.h>
+#include <map>
+#include <memory>
+#include <vector>
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+
+enum SeekMode { SeekSet, SeekCur, SeekEnd };
+
+typedef std::shared_ptr<std::vector<uint8_t>> FakeFileData;
+
+class File {
+  public:
+    File(){}
+    File(FakeFileData data, bool writable): handle(new Handle{data, 0, writable, true}){}
+    operator bool() const {
+      return handle && handle->open;
+    }
+    bool isDirectory(){
+      return false;
+    }
+    size_t size(){
+      return *this ? handle->data->size() : 0;
+    }
+    size_t position(){
+      return *this ? handle->position : 0;
+    }
+    int available(){
+      return *this ? size() - handle->position : 0;
+    }
+    bool seek(uint32_t position, SeekMode mode = SeekSet){
+      if(!*this || mode != SeekSet || position > size()){
+        return false;
+      }
+      handle->position = position;
+      return true;
+    }
+    size_t read(uint8_t* buffer, size_t length){
+      if(!*this){
+        return 0;
+      }
+      length = min(length, (size_t)available());
+      memcpy(buffer, handle->data->data() + handle->position, length);
+      handle->position += length;
+      return length;
+    }
+    int read(){
+      uint8_t byte;
+      return read(&byte, 1) == 1 ? byte : -1;
+    }
+    size_t write(const uint8_t* buffer, size_t length){
+      if(!*this || !handle->writable){
+        return 0;
+      }
+      std::vector<uint8_t>& data = *handle->data;
+      if(data.size() < handle->position + length){
+        data.resize(handle->position + length);
+      }
+      memcpy(data.data() + handle->position, buffer, length);
+      handle->position += length;
+      return length;
+    }
+    void close(){
+      if(handle){
+        handle->open = false;
+      }
+    }
+
+  private:
+    struct Handle {
+      FakeFileData data;
+      size_t position;
+      bool writable;
+      bool open;
+    };
+    // Shared by copies, like the core's File
+    std::shared_ptr<Handle> handle;
+};
+
+namespace fs {
+
+class FS {
+  public:
+    std::map<std::string, FakeFileData> files;
+    size_t capacity = 0x182000;
+
+    File open(const char* path, const char* mode = FILE_READ){
+      if(strcmp(mode, FILE_WRITE) == 0){
+        FakeFileData data(new std::vector<uint8_t>());
+        files[path] = data;
+        return File(data, true);
+      }
+      auto found = files.find(path);
+      return found == files.end() ? File() : File(found->second, false);
+    }
+    bool exists(const char* path){
+      return files.count(path) != 0;
+    }
+    bool remove(const char* path){
+      return files.erase(path) != 0;
+    }
+    bool rename(const char* from, const char* to){
+      auto found = files.find(from);
+      if(found == files.end()){
+        return false;
+      }
+      FakeFileData data = found->second;
+      files.erase(found);
+      files[to] = data;
+      return true;
+    }
+    size_t totalBytes(){
+      return capacity;
+    }
+    // Whole 4 KB blocks per file, as LittleFS counts them
+    size_t usedBytes(){
+      size_t used = 0;
+      for(auto& file : files){
+        used += (file.second->size() + 4095) / 4096 * 4096;
+      }
+      return used;
+    }
+};
+
+}
+
+#endif
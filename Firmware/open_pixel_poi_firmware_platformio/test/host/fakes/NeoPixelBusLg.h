@@ -0,0 +1,95 @@
+#ifndef _FAKE_NEOPIXELBUSLG_H
+#define _FAKE_NEOPIXELBUSLG_H
+
+// NeoPixelBusLg with the pixel buffer, features and luminance shader of the real library, and nothing on the wire
+#include <Arduino.h>
+#include <vector>
+
+struct RgbColor {
+  uint8_t R;
+  uint8_t G;
+  uint8_t B;
+  RgbColor(uint8_t r, uint8_t g, uint8_t b): R(r), G(g), B(b){}
+  RgbColor(uint8_t brightness = 0): R(brightness), G(brightness), B(brightness){}
+  RgbColor Dim(uint8_t ratio) const {
+    return RgbColor(elementDim(R, ratio), elementDim(G, ratio), elementDim(B, ratio));
+  }
+  static uint8_t elementDim(uint8_t value, uint8_t ratio){
+    return (uint16_t)value * (ratio + 1) >> 8;
+  }
+};
+
+struct NeoGrbFeature {
+  static const size_t PixelSize = 3;
+  static void applyPixelColor(uint8_t* pixels, uint16_t index, RgbColor color){
+    uint8_t* p = pixels + index * PixelSize;
+    *p++ = color.G;
+    *p++ = color.R;
+    *p = color.B;
+  }
+};
+
+// The header byte holds the global brightness, always at full
+struct DotStarBgrFeature {
+  static const size_t PixelSize = 4;
+  static void applyPixelColor(uint8_t* pixels, uint16_t index, RgbColor color){
+    uint8_t* p = pixels + index * PixelSize;
+    *p++ = 0xFF;
+    *p++ = color.B;
+    *p++ = color.G;
+    *p = color.R;
+  }
+};
+
+struct NeoWs2812xMethod {};
+struct DotStarSpi20MhzMethod {};
+struct NeoGammaNullMethod {};
+
+template<typename T_COLOR_FEATURE, typename T_METHOD, typename T_GAMMA = NeoGammaNullMethod>
+class NeoPixelBusLg {
+  public:
+    NeoPixelBusLg(uint16_t count, uint8_t pin): pixels(count * T_COLOR_FEATURE::PixelSize){}
+    NeoPixelBusLg(uint16_t count, uint8_t clockPin, uint8_t dataPin): pixels(count * T_COLOR_FEATURE::PixelSize){}
+    void Begin(){}
+    void Begin(int8_t sck, int8_t miso, int8_t mosi, int8_t ss){}
+    void Show(bool maintainBufferConsistency = true){
+      dirty = false;
+    }
+    bool CanShow() const {
+      return true;
+    }
+    void SetPixelColor(uint16_t index, RgbColor color){
+      if(index < PixelCount()){
+        T_COLOR_FEATURE::applyPixelColor(Pixels(), index, color.Dim(luminance));
+        dirty = true;
+      }
+    }
+    void ClearTo(RgbColor color){
+      for(uint16_t i = 0; i < PixelCount(); i++){
+        T_COLOR_FEATURE::applyPixelColor(Pixels(), i, color.Dim(luminance));
+      }
+      dirty = true;
+    }
+    void SetLuminance(uint8_t value){
+      luminance = value;
+    }
+    uint8_t GetLuminance() const {
+      return luminance;
+    }
+    uint16_t PixelCount() const {
+      return pixels.size() / T_COLOR_FEATURE::PixelSize;
+    }
+    uint8_t* Pixels(){
+      return pixels.data();
+    }
+    void Dirty(){
+      dirty = true;
+    }
+
+  private:
+    std::vector<uint8_t> pixels;
+    uint8_t luminance = 255;
+    bool dirty = false;
+};
+
+#endif
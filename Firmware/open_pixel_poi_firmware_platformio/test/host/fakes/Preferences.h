@@ -0,0 +1,64 @@
+#ifndef _FAKE_PREFERENCES_H
+#define _FAKE_PREFERENCES_H
+
+// NVS in memory. The keys outlive the Preferences object, like NVS outlives a reboot.
+#include <Arduino.h>
+#include <map>
+#include <vector>
+
+extern std::map<std::string, std::vector<uint8_t>> fakeNvs;
+
+class Preferences {
+  public:
+    bool begin(const char* name, bool readOnly = false){
+      return true;
+    }
+    bool isKey(const char* key){
+      return fakeNvs.count(key) != 0;
+    }
+    bool remove(const char* key){
+      return fakeNvs.erase(key) != 0;
+    }
+    size_t putBytes(const char* key, const void* value, size_t length){
+      const uint8_t* bytes = (const uint8_t*)value;
+      fakeNvs[key] = std::vector<uint8_t>(bytes, bytes + length);
+      return length;
+    }
+    size_t getBytes(const char* key, void* buffer, size_t length){
+      auto found = fakeNvs.find(key);
+      if(found == fakeNvs.end()){
+        return 0;
+      }
+      length = min(length, found->second.size());
+      memcpy(buffer, found->second.data(), length);
+      return length;
+    }
+    size_t putChar(const char* key, int8_t value){ return put(key, value); }
+    size_t putUChar(const char* key, uint8_t value){ return put(key, value); }
+    size_t putUShort(const char* key, uint16_t value){ return put(key, value); }
+    size_t putUInt(const char* key, uint32_t value){ return put(key, value); }
+    int8_t getChar(const char* key, int8_t value = 0){ return get(key, value); }
+    uint8_t getUChar(const char* key, uint8_t value = 0){ return get(key, value); }
+    uint16_t getUShort(const char* key, uint16_t value = 0){ return get(key, value); }
+    uint32_t getUInt(const char* key, uint32_t value = 0){ return get(key, value); }
+    size_t putString(const char* key, const String& value){
+      return putBytes(key, value.c_str(), value.length());
+    }
+    String getString(const char* key, const String& value = String()){
+      auto found = fakeNvs.find(key);
+      return found == fakeNvs.end() ? value : String(std::string(found->second.begin(), found->second.end()).c_str());
+    }
+
+  private:
+    template<typename T>
+    size_t put(const char* key, T value){
+      return putBytes(key, &value, sizeof(value));
+    }
+    template<typename T>
+    T get(const char* key, T value){
+      getBytes(key, &value, sizeof(value));
+      return value;
+    }
+};
+
+#endif
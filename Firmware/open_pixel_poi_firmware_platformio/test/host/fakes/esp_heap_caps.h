@@ -0,0 +1,15 @@
+#ifndef _FAKE_ESP_HEAP_CAPS_H
+#define _FAKE_ESP_HEAP_CAPS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MALLOC_CAP_8BIT (1 << 2)
+
+extern size_t fakeLargestFreeBlock;
+
+inline size_t heap_caps_get_largest_free_block(uint32_t caps){
+  return fakeLargestFreeBlock;
+}
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef _FAKE_ESP_PARTITION_H
+#define _FAKE_ESP_PARTITION_H
+
+// The raw "patterns" partition, in memory and only there when a test sets fakePatternStore up. Erased flash reads 0xFF.
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <vector>
+
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+
+typedef int esp_partition_type_t;
+typedef int esp_partition_subtype_t;
+#define ESP_PARTITION_TYPE_DATA 1
+
+typedef int esp_partition_mmap_memory_t;
+#define ESP_PARTITION_MMAP_DATA 0
+typedef uint32_t spi_flash_mmap_handle_t;
+
+struct esp_partition_t {
+  uint32_t address;
+  uint32_t size;
+};
+
+extern std::vector<uint8_t> fakePatternStore;
+extern esp_partition_t fakePatternStorePartition;
+
+inline const esp_partition_t* esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char* label){
+  if(fakePatternStore.empty()){
+    return NULL;
+  }
+  fakePatternStorePartition.size = fakePatternStore.size();
+  return &fakePatternStorePartition;
+}
+
+inline esp_err_t esp_partition_mmap(const esp_partition_t* partition, size_t offset, size_t size, esp_partition_mmap_memory_t memory,
+  const void** out, spi_flash_mmap_handle_t* handle){
+  *out = fakePatternStore.data() + offset;
+  return ESP_OK;
+}
+
+inline esp_err_t esp_partition_erase_range(const esp_partition_t* partition, size_t offset, size_t size){
+  if(offset % 0x1000 != 0 || size % 0x1000 != 0 || offset + size > fakePatternStore.size()){
+    return ESP_FAIL;
+  }
+  memset(fakePatternStore.data() + offset, 0xFF, size);
+  return ESP_OK;
+}
+
+// Flash writes can only clear bits
+inline esp_err_t esp_partition_write(const esp_partition_t* partition, size_t offset, const void* data, size_t size){
+  if(offset + size > fakePatternStore.size()){
+    return ESP_FAIL;
+  }
+  for(size_t i = 0; i < size; i++){
+    fakePatternStore[offset + i] &= ((const uint8_t*)data)[i];
+  }
+  return ESP_OK;
+}
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef _FAKE_ESP_ROM_CRC_H
+#define _FAKE_ESP_ROM_CRC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Same CRC32 as the ROM function, crc is the result of the previous call to continue it
+inline uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t* data, uint32_t length){
+  crc = ~crc;
+  for(uint32_t i = 0; i < length; i++){
+    crc ^= data[i];
+    for(int k = 0; k < 8; k++){
+      crc = crc & 1 ? 0xEDB88320 ^ (crc >> 1) : crc >> 1;
+    }
+  }
+  return ~crc;
+}
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef _FAKE_ESP_TIMER_H
+#define _FAKE_ESP_TIMER_H
+
+#include <Arduino.h>
+
+inline int64_t esp_timer_get_time(){
+  return fakeMicros;
+}
+
+// Timers never fire
+typedef void* esp_timer_handle_t;
+struct esp_timer_create_args_t {
+  void (*callback)(void*);
+  void* arg;
+  const char* name;
+};
+inline int esp_timer_create(const esp_timer_create_args_t* args, esp_timer_handle_t* timer){
+  return 0;
+}
+inline int esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout){
+  return 0;
+}
+
+#endif
@@ -0,0 +1,14 @@
+// State of the fakes, shared by the module under test and the test
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <Preferences.h>
+#include <esp_heap_caps.h>
+#include <esp_partition.h>
+
+uint64_t fakeMicros = 1000000;
+FakeSerial Serial;
+LittleFSFS LittleFS;
+std::map<std::string, std::vector<uint8_t>> fakeNvs;
+size_t fakeLargestFreeBlock = 128 * 1024;
+std::vector<uint8_t> fakePatternStore;
+esp_partition_t fakePatternStorePartition = {0x300000, 0};
@@ -0,0 +1,212 @@
+// Host tests for compressed ('O','Z') patterns: the bundled data/pattern*.oppp files and the app's patterns/*.bmp, encoded
+// like PatternEncoder.compressed() in the app, must decode frame by frame through decodeFrame() to the same pixels,
+// plus the compression ratio of each and a decode ns/pixel benchmark.
+#include "test_util.h"
+#include "../../src/open_pixel_poi_config.cpp"
+
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+#define BENCHMARK_PIXELS 20000000
+
+typedef std::vector<uint8_t> Bytes;
+
+static volatile uint32_t sink; // Keeps the benchmarked decodes from being optimized away
+
+struct RgbPattern {
+  std::string name;
+  uint8_t frameHeight;
+  uint16_t frameCount;
+  Bytes rgb;
+};
+
+static Bytes readFile(const std::string& path){
+  std::ifstream file(path, std::ios::binary);
+  return Bytes(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+static uint32_t littleEndian(const uint8_t* data){
+  return data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+// The bundled .oppp files have no header, they play with the default geometry like any file from before it
+static RgbPattern bundledPattern(int index){
+  RgbPattern pattern;
+  pattern.name = "data/pattern" + std::to_string(index) + ".oppp";
+  pattern.frameHeight = DEFAULT_FRAME_HEIGHT;
+  pattern.frameCount = DEFAULT_FRAME_COUNT;
+  pattern.rgb = readFile(FIRMWARE_DIR "/" + pattern.name);
+  return pattern;
+}
+
+// As the app turns its BMPs into patterns: each column is a frame, top to bottom. The BMPs are bottom-up 24 or 32 bit BGR(A).
+static RgbPattern bmpPattern(int index){
+  RgbPattern pattern;
+  pattern.name = "patterns/pattern" + std::to_string(index) + ".bmp";
+  Bytes bmp = readFile(APP_DIR "/" + pattern.name);
+  if(bmp.size() < 30 || bmp[0] != 'B' || bmp[1] != 'M'){
+    pattern.frameHeight = 0;
+    pattern.frameCount = 0;
+    return pattern;
+  }
+  uint32_t pixelOffset = littleEndian(bmp.data() + 10);
+  uint32_t width = littleEndian(bmp.data() + 18);
+  uint32_t height = littleEndian(bmp.data() + 22);
+  uint32_t pixelSize = (bmp[28] | bmp[29] << 8) / 8;
+  uint32_t rowSize = (width * pixelSize + 3) & ~3;
+  pattern.frameHeight = height;
+  pattern.frameCount = width;
+  for(uint32_t x = 0; x < width; x++){
+    for(uint32_t y = 0; y < height; y++){
+      const uint8_t* pixel = bmp.data() + pixelOffset + (height - 1 - y) * rowSize + x * pixelSize;
+      pattern.rgb.insert(pattern.rgb.end(), {pixel[2], pixel[1], pixel[0]});
+    }
+  }
+  return pattern;
+}
+
+// PatternEncoder.compressed() from the app
+static Bytes compress(const RgbPattern& pattern){
+  int height = pattern.frameHeight;
+  const Bytes& rgb = pattern.rgb;
+  auto color = [&](int frame, int pixel) -> uint32_t {
+    if(frame < 0){
+      return 0;
+    }
+    int i = (frame * height + pixel) * 3;
+    return rgb[i] << 16 | rgb[i + 1] << 8 | rgb[i + 2];
+  };
+  auto kept = [&](int frame, int pixel){
+    int n = 0;
+    while(pixel + n < height && n < 64 && color(frame, pixel + n) == color(frame - 1, pixel + n)){
+      n++;
+    }
+    return n;
+  };
+  auto run = [&](int frame, int pixel){
+    int n = 1;
+    while(pixel + n < height && n < 64 && color(frame, pixel + n) == color(frame, pixel)){
+      n++;
+    }
+    return n;
+  };
+
+  Bytes data;
+  for(int frame = 0; frame < pattern.frameCount; frame++){
+    Bytes ops;
+    int pixel = 0;
+    while(pixel < height){
+      int keep = kept(frame, pixel);
+      int repeat = run(frame, pixel);
+      int i = (frame * height + pixel) * 3;
+      if(keep > 0 && keep >= repeat){
+        ops.push_back(keep - 1);
+        pixel += keep;
+      }else if(repeat >= 2){
+        ops.insert(ops.end(), {(uint8_t)(0x40 | (repeat - 1)), rgb[i], rgb[i + 1], rgb[i + 2]});
+        pixel += repeat;
+      }else{
+        // Literals until something cheaper starts
+        int n = 1;
+        while(pixel + n < height && n < 64 && kept(frame, pixel + n) == 0 && run(frame, pixel + n) < 2){
+          n++;
+        }
+        ops.push_back(0x80 | (n - 1));
+        ops.insert(ops.end(), rgb.begin() + i, rgb.begin() + i + n * 3);
+        pixel += n;
+      }
+    }
+    data.push_back(ops.size() >> 8);
+    data.push_back(ops.size() & 0xFF);
+    data.insert(data.end(), ops.begin(), ops.end());
+  }
+  uint32_t length = data.size();
+  Bytes compressed = {'O', 'Z', (uint8_t)(length >> 24), (uint8_t)(length >> 16), (uint8_t)(length >> 8), (uint8_t)length};
+  compressed.insert(compressed.end(), data.begin(), data.end());
+  return compressed;
+}
+
+// Decodes every frame into out as the loader does, each frame against the one before. Returns false on corrupt data.
+static bool decompress(OpenPixelPoiConfig& config, LoadedPattern& p, const Bytes& compressed, uint8_t* out){
+  size_t position = COMPRESSED_PATTERN_HEADER_SIZE;
+  for(int frame = 0; frame < p.frameCount; frame++){
+    if(position + 2 > compressed.size()){
+      return false;
+    }
+    size_t length = compressed[position] << 8 | compressed[position + 1];
+    position += 2;
+    uint8_t* target = out + frame * p.frameHeight * 3;
+    if(length > COMPRESSED_FRAME_LIMIT || position + length > compressed.size()
+      || !config.decodeFrame(p, compressed.data() + position, length, target, frame == 0 ? NULL : target - p.frameHeight * 3)){
+      return false;
+    }
+    position += length;
+  }
+  return position == compressed.size();
+}
+
+static void checkPatterns(OpenPixelPoiConfig& config, const char* title, std::vector<RgbPattern> patterns){
+  printf("%s\n", title);
+  size_t rawTotal = 0;
+  size_t compressedTotal = 0;
+  for(RgbPattern& pattern : patterns){
+    size_t pixels = pattern.frameHeight * pattern.frameCount;
+    CHECK_EQUAL_TEXT(pattern.name + " size", std::to_string(pattern.rgb.size()), std::to_string(pixels * 3));
+    if(pixels == 0 || pattern.rgb.size() != pixels * 3){
+      continue;
+    }
+    Bytes compressed = compress(pattern);
+    CHECK(OpenPixelPoiConfig::compressedLengthFits(pattern.frameCount, compressed.size()));
+    LoadedPattern p = {};
+    p.frameHeight = pattern.frameHeight;
+    p.frameCount = pattern.frameCount;
+    Bytes decoded(pixels * 3);
+    CHECK_EQUAL_TEXT(pattern.name + " decodes", decompress(config, p, compressed, decoded.data()) ? "yes" : "no", "yes");
+    CHECK(decoded == pattern.rgb);
+
+    auto start = std::chrono::steady_clock::now();
+    int rounds = BENCHMARK_PIXELS / pixels + 1;
+    for(int i = 0; i < rounds; i++){
+      decompress(config, p, compressed, decoded.data());
+      sink += decoded[i % decoded.size()];
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    // The app only sends the compressed encoding when it is smaller than raw RGB
+    printf("- %s (%dx%d): %d -> %d bytes, %.2fx%s, decode %.2f ns/pixel\n", pattern.name.c_str(), pattern.frameHeight,
+      pattern.frameCount, (int)pattern.rgb.size(), (int)compressed.size(), (double)pattern.rgb.size() / compressed.size(),
+      compressed.size() < pattern.rgb.size() ? "" : " (sent raw)", elapsed.count() / ((double)rounds * pixels));
+    rawTotal += pattern.rgb.size();
+    compressedTotal += compressed.size();
+  }
+  printf("- total: %d -> %d bytes, %.2fx\n", (int)rawTotal, (int)compressedTotal, (double)rawTotal / max(compressedTotal, (size_t)1));
+}
+
+// Lengths that can't hold the announced frames are refused before anything is uploaded
+static void checkGeometry(){
+  printf("Geometry\n");
+  CHECK(OpenPixelPoiConfig::compressedLengthFits(1, COMPRESSED_PATTERN_HEADER_SIZE + 3));
+  CHECK(!OpenPixelPoiConfig::compressedLengthFits(1, COMPRESSED_PATTERN_HEADER_SIZE + 2));
+  CHECK(!OpenPixelPoiConfig::compressedLengthFits(1000, COMPRESSED_PATTERN_HEADER_SIZE + 2999));
+  CHECK(OpenPixelPoiConfig::compressedLengthFits(2, COMPRESSED_PATTERN_HEADER_SIZE + 2 * (2 + COMPRESSED_FRAME_LIMIT)));
+  CHECK(!OpenPixelPoiConfig::compressedLengthFits(2, COMPRESSED_PATTERN_HEADER_SIZE + 2 * (2 + COMPRESSED_FRAME_LIMIT) + 1));
+  CHECK(!OpenPixelPoiConfig::compressedLengthFits(0, COMPRESSED_PATTERN_HEADER_SIZE));
+}
+
+int main(){
+  OpenPixelPoiConfig* config = new OpenPixelPoiConfig();
+  std::vector<RgbPattern> bundled;
+  for(int i = 0; i < 15; i++){
+    bundled.push_back(bundledPattern(i));
+  }
+  checkPatterns(*config, "Bundled patterns", bundled);
+  std::vector<RgbPattern> app;
+  for(int i = 1; i <= 10; i++){
+    app.push_back(bmpPattern(i));
+  }
+  checkPatterns(*config, "App patterns", app);
+  checkGeometry();
+  delete config;
+  return testResult("compression");
+}
@@ -0,0 +1,275 @@
+// Host tests for OpenPixelPoiParser: a corpus of messages fed in random fragment splits must give the same
+// messages and streamed bytes as feeding each one whole, plus a bytes/sec benchmark.
+#include "test_util.h"
+#include "../../src/open_pixel_poi_parser.cpp"
+
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+// Codes of the test protocol, CODE_STREAM has a 2 byte header with the number of bytes that follow
+#define CODE_STREAM 0x04
+#define CODE_REJECTED 0x05 // Streamed, beginStream() says no
+#define CODE_MESSAGE 0x02
+
+// Everything the parser told the listener, as text so runs can be compared
+class RecordingListener : public OpenPixelPoiParserListener {
+  public:
+    std::string events;
+    std::vector<uint8_t> streamed;
+    uint64_t streamedBytes = 0;
+    uint32_t checksum = 0;
+    bool keep = true; // Keep streamed bytes, the benchmark only sums them up like an upload would touch them
+
+    size_t streamHeaderSize(uint8_t code){
+      return code == CODE_STREAM || code == CODE_REJECTED ? 2 : 0;
+    }
+    bool beginStream(uint8_t code, const uint8_t* header, size_t length, uint32_t& remaining){
+      remaining = header[0] << 8 | header[1];
+      events += "begin(" + std::to_string(code) + "," + std::to_string(remaining) + ")";
+      streamed.clear();
+      return code != CODE_REJECTED;
+    }
+    void streamData(const uint8_t* data, size_t length){
+      streamedBytes += length;
+      if(keep){
+        streamed.insert(streamed.end(), data, data + length);
+      }else{
+        for(size_t i = 0; i < length; i++){
+          checksum = checksum * 31 + data[i];
+        }
+      }
+    }
+    void finishStream(){
+      events += "finish(" + hex(streamed) + ")";
+    }
+    void cancelStream(){
+      events += "cancel";
+    }
+    void handleMessage(uint8_t code, const uint8_t* payload, size_t length){
+      events += "message(" + std::to_string(code) + "," + hex(std::vector<uint8_t>(payload, payload + length)) + ")";
+    }
+    void messageError(){
+      events += "error";
+    }
+
+    static std::string hex(const std::vector<uint8_t>& data){
+      static const char digits[] = "0123456789abcdef";
+      std::string text;
+      for(uint8_t byte : data){
+        text += digits[byte >> 4];
+        text += digits[byte & 0xF];
+      }
+      return text;
+    }
+};
+
+// A message as the BLE layer hands it to the parser, framed (v1: D0 ... D1) or not (v2: startMessage() first)
+struct Sample {
+  const char* name;
+  std::vector<uint8_t> bytes;
+  bool framed;
+  std::string expected;
+};
+
+static std::vector<uint8_t> framedMessage(uint8_t code, const std::vector<uint8_t>& payload){
+  std::vector<uint8_t> bytes = {0xD0, code};
+  bytes.insert(bytes.end(), payload.begin(), payload.end());
+  bytes.push_back(0xD1);
+  return bytes;
+}
+
+static std::vector<uint8_t> streamPayload(uint16_t announced, const std::vector<uint8_t>& data){
+  std::vector<uint8_t> payload = {(uint8_t)(announced >> 8), (uint8_t)(announced & 0xFF)};
+  payload.insert(payload.end(), data.begin(), data.end());
+  return payload;
+}
+
+static std::vector<uint8_t> pattern(size_t length, uint8_t seed){
+  std::vector<uint8_t> data(length);
+  for(size_t i = 0; i < length; i++){
+    data[i] = (uint8_t)(seed + i * 7);
+  }
+  return data;
+}
+
+static std::vector<Sample> corpus(){
+  std::vector<Sample> samples;
+  std::vector<uint8_t> d1s = {0x10, 0xD1, 0xD1, 0x20, 0xD1, 0xD0, 0xD1};
+  std::string d1sHex = RecordingListener::hex(d1s);
+
+  samples.push_back({"short message", framedMessage(CODE_MESSAGE, {0x2A}), true, "message(2,2a)"});
+  samples.push_back({"empty message", framedMessage(CODE_MESSAGE, {}), true, "message(2,)"});
+  samples.push_back({"message with D1s", framedMessage(CODE_MESSAGE, d1s), true, "message(2," + d1sHex + ")"});
+  samples.push_back({"largest message", framedMessage(CODE_MESSAGE, pattern(PARSER_MESSAGE_LIMIT - 2, 1)), true,
+    "message(2," + RecordingListener::hex(pattern(PARSER_MESSAGE_LIMIT - 2, 1)) + ")"});
+  // PS_MESSAGE overflow: the message is dropped, the next one parses (see checkRecovery())
+  samples.push_back({"overflowing message", framedMessage(CODE_MESSAGE, pattern(PARSER_MESSAGE_LIMIT + 20, 2)), true, "error"});
+  samples.push_back({"unterminated message", {0xD0, CODE_MESSAGE, 0x01, 0x02}, true, "error"});
+  samples.push_back({"code only", {0xD0}, true, "error"});
+  samples.push_back({"noise before D0", {0x00, 0x55, 0xD1, 0xD0, CODE_MESSAGE, 0x07, 0xD1}, true, "message(2,07)"});
+
+  samples.push_back({"stream", framedMessage(CODE_STREAM, streamPayload(300, pattern(300, 3))), true,
+    "begin(4,300)finish(" + RecordingListener::hex(pattern(300, 3)) + ")"});
+  samples.push_back({"stream with D1s", framedMessage(CODE_STREAM, streamPayload(d1s.size(), d1s)), true,
+    "begin(4,7)finish(" + d1sHex + ")"});
+  // Ends before the announced length, the trailing D1 is held back and turns out to be the end
+  samples.push_back({"short stream", framedMessage(CODE_STREAM, streamPayload(1000, d1s)), true,
+    "begin(4,1000)finish(" + d1sHex + ")"});
+  samples.push_back({"short stream ending in D1", framedMessage(CODE_STREAM, streamPayload(1000, {0x01, 0xD1})), true,
+    "begin(4,1000)finish(01d1)"});
+  samples.push_back({"empty stream", framedMessage(CODE_STREAM, streamPayload(0, {})), true, "begin(4,0)finish()"});
+  samples.push_back({"stream missing D1", {0xD0, CODE_STREAM, 0x00, 0x01, 0x33, 0x44}, true, "begin(4,1)errorcancel"});
+  samples.push_back({"cut off header", {0xD0, CODE_STREAM, 0x00}, true, "error"});
+  // PS_SKIP: the rest of the message is dropped
+  samples.push_back({"rejected stream", framedMessage(CODE_REJECTED, streamPayload(600, pattern(600, 4))), true, "begin(5,600)"});
+
+  std::vector<uint8_t> unframed = {CODE_MESSAGE, 0xD1, 0xD0, 0x05};
+  samples.push_back({"unframed message", unframed, false, "message(2,d1d005)"});
+  std::vector<uint8_t> unframedStream = {CODE_STREAM};
+  std::vector<uint8_t> streamData = streamPayload(900, pattern(900, 5));
+  unframedStream.insert(unframedStream.end(), streamData.begin(), streamData.end());
+  samples.push_back({"unframed stream", unframedStream, false, "begin(4,900)finish(" + RecordingListener::hex(pattern(900, 5)) + ")"});
+  std::vector<uint8_t> unframedShort = {CODE_STREAM, 0x01, 0x00, 0x01, 0xD1};
+  samples.push_back({"unframed short stream ending in D1", unframedShort, false, "begin(4,256)finish(01d1)"});
+  return samples;
+}
+
+// Feeds the sample split at the given offsets and ends it like the BLE layer does
+static std::string parse(const Sample& sample, const std::vector<size_t>& splits){
+  RecordingListener listener;
+  OpenPixelPoiParser parser(listener);
+  if(!sample.framed){
+    parser.startMessage();
+  }
+  size_t start = 0;
+  for(size_t split : splits){
+    parser.feed(sample.bytes.data() + start, split - start);
+    start = split;
+  }
+  parser.feed(sample.bytes.data() + start, sample.bytes.size() - start);
+  parser.endMessage();
+  CHECK(!parser.inMessage());
+  return listener.events;
+}
+
+static std::vector<size_t> randomSplits(size_t length, std::mt19937& random){
+  std::vector<size_t> splits;
+  if(length < 2){
+    return splits;
+  }
+  int count = std::uniform_int_distribution<int>(0, std::min<size_t>(length - 1, 40))(random);
+  for(int i = 0; i < count; i++){
+    splits.push_back(std::uniform_int_distribution<size_t>(1, length - 1)(random));
+  }
+  std::sort(splits.begin(), splits.end());
+  splits.erase(std::unique(splits.begin(), splits.end()), splits.end());
+  return splits;
+}
+
+static void checkCorpus(){
+  std::mt19937 random(1234);
+  for(const Sample& sample : corpus()){
+    std::string whole = parse(sample, {});
+    CHECK_EQUAL_TEXT(sample.name, whole, sample.expected);
+    // Every single split, then random multi splits
+    for(size_t split = 1; split < sample.bytes.size(); split++){
+      CHECK_EQUAL_TEXT(sample.name, parse(sample, {split}), sample.expected);
+    }
+    for(int run = 0; run < 500; run++){
+      CHECK_EQUAL_TEXT(sample.name, parse(sample, randomSplits(sample.bytes.size(), random)), sample.expected);
+    }
+  }
+}
+
+// After a dropped, rejected or cut off message the parser is back to normal for the next one
+static void checkRecovery(){
+  std::mt19937 random(99);
+  std::vector<Sample> samples = corpus();
+  for(int run = 0; run < 2000; run++){
+    RecordingListener listener;
+    OpenPixelPoiParser parser(listener);
+    std::string expected;
+    for(int i = 0; i < 8; i++){
+      const Sample& sample = samples[std::uniform_int_distribution<size_t>(0, samples.size() - 1)(random)];
+      if(!sample.framed){
+        parser.startMessage();
+      }
+      std::vector<size_t> splits = randomSplits(sample.bytes.size(), random);
+      size_t start = 0;
+      splits.push_back(sample.bytes.size());
+      for(size_t split : splits){
+        parser.feed(sample.bytes.data() + start, split - start);
+        start = split;
+      }
+      parser.endMessage();
+      expected += sample.expected;
+    }
+    CHECK_EQUAL_TEXT("message sequence", listener.events, expected);
+  }
+}
+
+// A v2 message cut off by a new one is cancelled, a stream under way tells the listener
+static void checkCancel(){
+  RecordingListener listener;
+  OpenPixelPoiParser parser(listener);
+  parser.startMessage();
+  std::vector<uint8_t> start = {CODE_STREAM, 0x01, 0x00, 0x01, 0x02};
+  parser.feed(start.data(), start.size());
+  CHECK(parser.streaming());
+  parser.startMessage();
+  std::vector<uint8_t> next = {CODE_MESSAGE, 0x09};
+  parser.feed(next.data(), next.size());
+  parser.endMessage();
+  CHECK_EQUAL_TEXT("cancelled stream", listener.events, "begin(4,256)cancelmessage(2,09)");
+
+  // Rejected streams were never begun as far as the listener is concerned
+  RecordingListener rejected;
+  OpenPixelPoiParser rejectedParser(rejected);
+  std::vector<uint8_t> bytes = {0xD0, CODE_REJECTED, 0x00, 0x10, 0x01};
+  rejectedParser.feed(bytes.data(), bytes.size());
+  rejectedParser.cancel();
+  CHECK_EQUAL_TEXT("cancelled rejected stream", rejected.events, "begin(5,16)");
+}
+
+// Streamed upload in 509 byte packets, the way v1 sends patterns
+static void benchmark(){
+  const uint32_t length = 60000;
+  std::vector<uint8_t> payload = streamPayload(length, pattern(length, 6));
+  std::vector<uint8_t> bytes = framedMessage(CODE_STREAM, payload);
+  RecordingListener listener;
+  listener.keep = false;
+  OpenPixelPoiParser parser(listener);
+  const int rounds = 2000;
+  auto start = std::chrono::steady_clock::now();
+  for(int round = 0; round < rounds; round++){
+    for(size_t offset = 0; offset < bytes.size(); offset += 509){
+      parser.feed(bytes.data() + offset, std::min<size_t>(509, bytes.size() - offset));
+    }
+    parser.endMessage();
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  CHECK(listener.streamedBytes == (uint64_t)length * rounds);
+  printf("parser: checksum %08x\n", listener.checksum);
+  printf("parser: %.0f MB/s streamed in 509 byte packets (host)\n", (double)bytes.size() * rounds / seconds / 1e6);
+
+  // Whole messages, one per packet
+  std::vector<uint8_t> message = framedMessage(CODE_MESSAGE, pattern(12, 7));
+  const int messages = 2000000;
+  start = std::chrono::steady_clock::now();
+  for(int i = 0; i < messages; i++){
+    parser.feed(message.data(), message.size());
+    parser.endMessage();
+  }
+  seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("parser: %.1f M messages/s (host)\n", messages / seconds / 1e6);
+}
+
+int main(){
+  checkCorpus();
+  checkRecovery();
+  checkCancel();
+  benchmark();
+  return testResult("parser");
+}
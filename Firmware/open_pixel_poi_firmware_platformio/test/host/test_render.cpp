@@ -0,0 +1,181 @@
+// Host tests for the strip render paths: blitRgbFrame() (BlitFrame()) and copyWireFrame() of a baked frame (CopyFrame())
+// must write the same pixels as the per-pixel SetPixelColor() loop they replaced, plus a ns/frame benchmark of them for the
+// 25 and 55 LED kits, with the per-pixel loop both through the old virtual ILedStrip and specialized for the strip.
+// They run on the strips' NeoPixelBusLg, the fake keeps the real pixel layouts and shader.
+// calculateLuminance() must also give what the double precision CalculateLuminance() it replaced did.
+#include "test_util.h"
+#include "../../src/open_pixel_poi_led.cpp"
+
+#include <chrono>
+#include <math.h>
+#include <random>
+#include <vector>
+
+#define FRAME_COUNT 64
+#define BENCHMARK_FRAMES 200000
+
+typedef std::vector<uint8_t> Bytes;
+typedef NeoPixelBusLg<NeoGrbFeature, NeoWs2812xMethod, NeoGammaNullMethod> NeoPixelBus;
+typedef NeoPixelBusLg<DotStarBgrFeature, DotStarSpi20MhzMethod, NeoGammaNullMethod> DotStarBus;
+
+static std::mt19937 rng(1234);
+static volatile uint32_t sink; // Keeps the benchmarked renders from being optimized away
+
+// The render loop from before BlitFrame(): one SetPixelColor() per LED, inverted, the frame repeating down the strip
+template<typename T_BUS>
+void renderPerPixel(T_BUS& bus, const uint8_t* frame, uint8_t frameHeight, uint8_t ledCount){
+  for(int j = 0; j < ledCount; j++){
+    uint8_t red = frame[j%frameHeight*3 + 0];
+    uint8_t green = frame[j%frameHeight*3 + 1];
+    uint8_t blue = frame[j%frameHeight*3 + 2];
+    bus.SetPixelColor(ledCount-1-j, RgbColor(red, green, blue));
+  }
+}
+
+// The strip interface from before the render loop was specialized per strip, a virtual call per pixel
+class ILedStrip {
+  public:
+    virtual void SetPixelColor(uint16_t i, RgbColor color) = 0;
+    virtual ~ILedStrip() = default;
+};
+
+template<typename T_BUS>
+class VirtualStrip : public ILedStrip {
+  public:
+    VirtualStrip(T_BUS& bus): bus(bus){}
+    void SetPixelColor(uint16_t i, RgbColor color){ bus.SetPixelColor(i, color); }
+  private:
+    T_BUS& bus;
+};
+
+template<typename T_FEATURE, typename T_BUS>
+std::string pixelText(T_BUS& bus){
+  std::string text;
+  char hex[3];
+  for(size_t i = 0; i < bus.PixelCount() * T_FEATURE::PixelSize; i++){
+    snprintf(hex, sizeof(hex), "%02X", bus.Pixels()[i]);
+    text += hex;
+  }
+  return text;
+}
+
+// Frames of frameHeight RGB pixels, and the same frames baked for the kit
+struct TestPattern {
+  uint8_t frameHeight;
+  Bytes rgb;
+  Bytes baked;
+};
+
+static TestPattern makePattern(OpenPixelPoiConfig& config, uint8_t frameHeight){
+  TestPattern pattern;
+  pattern.frameHeight = frameHeight;
+  pattern.rgb.resize(FRAME_COUNT * frameHeight * 3);
+  for(uint8_t& byte : pattern.rgb){
+    byte = rng();
+  }
+  LoadedPattern p = {};
+  p.frameHeight = frameHeight;
+  pattern.baked.resize(FRAME_COUNT * config.ledCount * 3);
+  for(int i = 0; i < FRAME_COUNT; i++){
+    config.bakeFrame(p, pattern.rgb.data() + i * frameHeight * 3, pattern.baked.data() + i * config.ledCount * 3);
+  }
+  return pattern;
+}
+
+enum RenderPath { RP_VIRTUAL, RP_PER_PIXEL, RP_BLIT, RP_COPY };
+
+template<typename T_FEATURE, typename T_BUS>
+double nsPerFrame(T_BUS& bus, const TestPattern& pattern, uint8_t ledCount, RenderPath path){
+  VirtualStrip<T_BUS> virtualStrip(bus);
+  ILedStrip* volatile strip = &virtualStrip; // Read each frame, so the compiler can't see through the interface
+  auto start = std::chrono::steady_clock::now();
+  for(int i = 0; i < BENCHMARK_FRAMES; i++){
+    int frame = i % FRAME_COUNT;
+    if(path == RP_VIRTUAL){
+      renderPerPixel(*strip, pattern.rgb.data() + frame * pattern.frameHeight * 3, pattern.frameHeight, ledCount);
+    }else if(path == RP_PER_PIXEL){
+      renderPerPixel(bus, pattern.rgb.data() + frame * pattern.frameHeight * 3, pattern.frameHeight, ledCount);
+    }else if(path == RP_BLIT){
+      blitRgbFrame<T_FEATURE>(bus, pattern.rgb.data() + frame * pattern.frameHeight * 3, pattern.frameHeight);
+    }else{
+      copyWireFrame<T_FEATURE>(bus, pattern.baked.data() + frame * ledCount * 3);
+    }
+    sink += bus.Pixels()[i % ledCount];
+  }
+  std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count() / BENCHMARK_FRAMES;
+}
+
+template<typename T_FEATURE, typename T_BUS>
+void checkKit(const char* name, uint8_t ledType, uint8_t ledCount){
+  OpenPixelPoiConfig* config = new OpenPixelPoiConfig();
+  config->hardwareVersion = 2;
+  config->ledType = ledType;
+  config->ledCount = ledCount;
+  T_BUS reference(ledCount, 0);
+  T_BUS bus(ledCount, 0);
+  // Frames shorter than, as long as and longer than the strip
+  const uint8_t frameHeights[] = {1, 7, ledCount, 200};
+  for(uint8_t frameHeight : frameHeights){
+    TestPattern pattern = makePattern(*config, frameHeight);
+    // Full luminance takes copyWireFrame()'s memcpy path on NeoPixels
+    const uint8_t luminances[] = {1, 26, 100, 255};
+    for(uint8_t luminance : luminances){
+      reference.SetLuminance(luminance);
+      bus.SetLuminance(luminance);
+      for(int i = 0; i < FRAME_COUNT; i++){
+        std::string what = std::string(name) + ", frame " + std::to_string(i) + " of height " + std::to_string(frameHeight)
+          + " at luminance " + std::to_string(luminance);
+        renderPerPixel(reference, pattern.rgb.data() + i * frameHeight * 3, frameHeight, ledCount);
+        std::string expected = pixelText<T_FEATURE>(reference);
+        blitRgbFrame<T_FEATURE>(bus, pattern.rgb.data() + i * frameHeight * 3, frameHeight);
+        CHECK_EQUAL_TEXT(what + ", BlitFrame", pixelText<T_FEATURE>(bus), expected);
+        // The baked frame repeats a short frame, so it covers the whole strip
+        copyWireFrame<T_FEATURE>(bus, pattern.baked.data() + i * ledCount * 3);
+        CHECK_EQUAL_TEXT(what + ", CopyFrame", pixelText<T_FEATURE>(bus), expected);
+      }
+    }
+  }
+
+  // 25% brightness, the app's default slider position
+  TestPattern pattern = makePattern(*config, 20);
+  bus.SetLuminance(64);
+  printf("%s (%d leds, 20 pixel frames)\n", name, ledCount);
+  printf("- SetPixelColor (virtual ILedStrip) = %.0f ns/frame\n", nsPerFrame<T_FEATURE>(bus, pattern, ledCount, RP_VIRTUAL));
+  printf("- SetPixelColor (specialized) = %.0f ns/frame\n", nsPerFrame<T_FEATURE>(bus, pattern, ledCount, RP_PER_PIXEL));
+  printf("- BlitFrame = %.0f ns/frame\n", nsPerFrame<T_FEATURE>(bus, pattern, ledCount, RP_BLIT));
+  printf("- CopyFrame (baked) = %.0f ns/frame\n", nsPerFrame<T_FEATURE>(bus, pattern, ledCount, RP_COPY));
+  delete config;
+}
+
+// The double precision CalculateLuminance() from before, amps in, unrounded
+static double luminanceBefore(uint8_t brightnessSetting, uint8_t ledCount, double consumption, double outputLimit){
+  if(brightnessSetting <= 1){
+    return brightnessSetting;
+  }
+  double consumptionScale = min(1.0, OUTPUT_PCB_CURRENT_LIMIT/(consumption * ledCount * OUTPUT_CHANNELS));
+  return min(outputLimit, brightnessSetting * 2.55 * consumptionScale);
+}
+
+// The integer version rounds up the exact value. The double one can land just above a whole number and round up past it,
+// so the two may only differ by one, where the exact value is whole.
+static void checkLuminance(const char* name, double consumption, uint8_t outputLimit){
+  for(int ledCount = 1; ledCount <= 255; ledCount++){
+    for(int brightness = 0; brightness <= 100; brightness++){
+      double before = luminanceBefore(brightness, ledCount, consumption, outputLimit);
+      uint8_t luminance = calculateLuminance(brightness, ledCount, MILLIAMPS(consumption), outputLimit);
+      if(luminance != ceil(before) && !(luminance == ceil(before) - 1 && fabs(before - luminance) < 1e-9)){
+        CHECK_EQUAL_TEXT(std::string(name) + ", " + std::to_string(ledCount) + " leds at " + std::to_string(brightness) + "%",
+          std::to_string(luminance), std::to_string(ceil(before)));
+      }
+    }
+  }
+}
+
+int main(){
+  checkLuminance("NeoPixel luminance", OUTPUT_WS2812B_5050_DRAW, OUTPUT_WS2812B_5050_LIMIT);
+  checkLuminance("DotStar luminance", OUTPUT_SK9822_2020_DRAW, OUTPUT_SK9822_2020_LIMIT);
+  checkKit<NeoGrbFeature, NeoPixelBus>("NeoPixel kit", 1, 25);
+  checkKit<DotStarBgrFeature, DotStarBus>("DotStar kit", 2, 55);
+  return testResult("render");
+}
@@ -0,0 +1,237 @@
+// Host tests for pattern uploads (beginPatternUpload(), writeUpload(), finishPatternUpload()) on the in-memory LittleFS:
+// uploads arrive in random BLE sized fragments, and one cut off at any offset, by a cancel or a power cut, must leave
+// the previous pattern as it was.
+#include "test_util.h"
+#include "../../src/open_pixel_poi_config.cpp"
+
+#include <random>
+#include <vector>
+
+#define FRAME_HEIGHT 20
+#define FRAME_COUNT 40
+#define FRAGMENT_LIMIT 509 // Largest v1 packet
+
+typedef std::vector<uint8_t> Bytes;
+
+static std::mt19937 rng(1234);
+
+static OpenPixelPoiConfig* boot(){
+  OpenPixelPoiConfig* config = new OpenPixelPoiConfig();
+  config->setup();
+  return config;
+}
+
+// Without closing anything, like a power cut
+static void powerOff(OpenPixelPoiConfig* config){
+  free(config->playing->buffer);
+  delete config;
+}
+
+static Bytes randomPattern(){
+  Bytes data(FRAME_HEIGHT * FRAME_COUNT * 3);
+  for(uint8_t& byte : data){
+    byte = rng();
+  }
+  return data;
+}
+
+// What the .oppp of an RGB upload must hold
+static Bytes patternFile(const Bytes& data){
+  uint32_t length = data.size();
+  uint32_t crc = esp_rom_crc32_le(0, data.data(), length);
+  Bytes file = {'O', 'P', 1, PE_RGB, FRAME_HEIGHT, FRAME_COUNT >> 8, FRAME_COUNT & 0xFF, 0,
+    (uint8_t)(length >> 24), (uint8_t)(length >> 16), (uint8_t)(length >> 8), (uint8_t)length,
+    (uint8_t)(crc >> 24), (uint8_t)(crc >> 16), (uint8_t)(crc >> 8), (uint8_t)crc};
+  file.insert(file.end(), data.begin(), data.end());
+  return file;
+}
+
+static Bytes fileBytes(const char* path){
+  auto found = LittleFS.files.find(path);
+  return found == LittleFS.files.end() ? Bytes() : *found->second;
+}
+
+static bool hasTemporaryFiles(){
+  for(auto& file : LittleFS.files){
+    const std::string& path = file.first;
+    if(path.size() > 4 && path.compare(path.size() - 4, 4, ".tmp") == 0){
+      return true;
+    }
+  }
+  return false;
+}
+
+// Writes data[0, end) in random fragments
+static void writeFragments(OpenPixelPoiConfig& config, const Bytes& data, size_t end){
+  std::uniform_int_distribution<size_t> fragmentSize(1, FRAGMENT_LIMIT);
+  for(size_t offset = 0; offset < end;){
+    size_t length = min(fragmentSize(rng), end - offset);
+    config.writeUpload(data.data() + offset, length);
+    offset += length;
+  }
+}
+
+static bool upload(OpenPixelPoiConfig& config, const Bytes& data){
+  if(!config.beginPatternUpload(PE_RGB, FRAME_HEIGHT, FRAME_COUNT, data.size())){
+    return false;
+  }
+  writeFragments(config, data, data.size());
+  return config.finishPatternUpload();
+}
+
+// The current slot's file holds data, and the playing pattern is loaded from it
+static void checkPlaying(OpenPixelPoiConfig& config, const Bytes& data, const char* what){
+  Bytes expected = patternFile(data);
+  LoadedPattern& p = *config.playing;
+  CHECK_EQUAL_TEXT(what, std::to_string(p.index), std::to_string(config.patternId()));
+  CHECK(fileBytes(config.patternPath(p.index, ".oppp")) == expected);
+  CHECK(p.frameHeight == FRAME_HEIGHT && p.frameCount == FRAME_COUNT);
+  CHECK(p.crc == esp_rom_crc32_le(0, data.data(), data.size()));
+  // Let the loader catch up with a renderer that has reached the last frame
+  for(int i = 0; i < 100 && p.framesResident < p.playbackFrameCount; i++){
+    p.playbackCursor = p.framesResident;
+    config.loop();
+  }
+  CHECK(p.framesResident == FRAME_COUNT);
+  CHECK(memcmp(p.frames, data.data(), data.size()) == 0);
+}
+
+static void checkCompleteUploads(){
+  OpenPixelPoiConfig* config = boot();
+  for(int i = 0; i < 20; i++){
+    Bytes data = randomPattern();
+    CHECK(upload(*config, data));
+    CHECK(!hasTemporaryFiles());
+    checkPlaying(*config, data, "complete upload");
+  }
+  powerOff(config);
+}
+
+// Cancelled at every kind of offset: none written, part of a fragment, all of it but not finished
+static void checkCancelledUploads(){
+  OpenPixelPoiConfig* config = boot();
+  Bytes previous = randomPattern();
+  CHECK(upload(*config, previous));
+  for(int i = 0; i < 200; i++){
+    Bytes data = randomPattern();
+    size_t end = i == 0 ? 0 : i == 1 ? data.size() : std::uniform_int_distribution<size_t>(0, data.size())(rng);
+    CHECK(config->beginPatternUpload(PE_RGB, FRAME_HEIGHT, FRAME_COUNT, data.size()));
+    writeFragments(*config, data, end);
+    config->cancelUpload();
+    CHECK(!hasTemporaryFiles());
+    checkPlaying(*config, previous, "cancelled upload");
+    config->loadPattern();
+    checkPlaying(*config, previous, "cancelled upload, reloaded");
+  }
+  // A cancel with nothing under way changes nothing, and the next upload goes through
+  config->cancelUpload();
+  Bytes data = randomPattern();
+  CHECK(upload(*config, data));
+  checkPlaying(*config, data, "upload after cancels");
+  powerOff(config);
+}
+
+// The power goes before the upload is finished, the .tmp is left behind
+static void checkPowerCuts(){
+  OpenPixelPoiConfig* config = boot();
+  Bytes previous = randomPattern();
+  CHECK(upload(*config, previous));
+  for(int i = 0; i < 50; i++){
+    Bytes data = randomPattern();
+    CHECK(config->beginPatternUpload(PE_RGB, FRAME_HEIGHT, FRAME_COUNT, data.size()));
+    writeFragments(*config, data, std::uniform_int_distribution<size_t>(0, data.size())(rng));
+    powerOff(config);
+    config = boot();
+    checkPlaying(*config, previous, "after a power cut");
+  }
+  Bytes data = randomPattern();
+  CHECK(upload(*config, data));
+  CHECK(!hasTemporaryFiles());
+  powerOff(config);
+  config = boot();
+  checkPlaying(*config, data, "upload after power cuts, rebooted");
+  powerOff(config);
+}
+
+// A stream that ends early is padded with black, the header's length and CRC cover the padding
+static void checkShortUploads(){
+  OpenPixelPoiConfig* config = boot();
+  for(int i = 0; i < 50; i++){
+    Bytes data = randomPattern();
+    size_t end = i == 0 ? 0 : std::uniform_int_distribution<size_t>(0, data.size() - 1)(rng);
+    CHECK(config->beginPatternUpload(PE_RGB, FRAME_HEIGHT, FRAME_COUNT, data.size()));
+    writeFragments(*config, data, end);
+    CHECK(config->finishPatternUpload());
+    std::fill(data.begin() + end, data.end(), 0);
+    CHECK(!hasTemporaryFiles());
+    checkPlaying(*config, data, "short upload");
+  }
+  // Bytes beyond the announced length are dropped
+  Bytes data = randomPattern();
+  CHECK(config->beginPatternUpload(PE_RGB, FRAME_HEIGHT, FRAME_COUNT, data.size()));
+  writeFragments(*config, data, data.size());
+  config->writeUpload(data.data(), 100);
+  CHECK(config->finishPatternUpload());
+  checkPlaying(*config, data, "long upload");
+  powerOff(config);
+}
+
+// Patterns without pixels are refused, the renderer would divide by their frame count
+static void checkEmptyPatterns(){
+  OpenPixelPoiConfig* config = boot();
+  Bytes previous = randomPattern();
+  CHECK(upload(*config, previous));
+  const PatternEncoding encodings[] = {PE_RGB, PE_INDEXED, PE_COMPRESSED};
+  for(PatternEncoding encoding : encodings){
+    CHECK(!config->beginPatternUpload(encoding, FRAME_HEIGHT, 0, 100));
+    CHECK(!config->beginPatternUpload(encoding, 0, FRAME_COUNT, 100));
+    CHECK(!config->finishPatternUpload());
+    CHECK(!hasTemporaryFiles());
+    checkPlaying(*config, previous, "after an empty upload");
+  }
+  // One already stored, its lengths add up, plays the placeholder
+  Bytes data = {'O', 'I', 4, 0, 0, 0, 0xFF, 0xFF, 0xFF};
+  uint32_t length = data.size();
+  uint32_t crc = esp_rom_crc32_le(0, data.data(), length);
+  Bytes file = {'O', 'P', 1, PE_INDEXED, FRAME_HEIGHT, 0, 0, 0,
+    (uint8_t)(length >> 24), (uint8_t)(length >> 16), (uint8_t)(length >> 8), (uint8_t)length,
+    (uint8_t)(crc >> 24), (uint8_t)(crc >> 16), (uint8_t)(crc >> 8), (uint8_t)crc};
+  file.insert(file.end(), data.begin(), data.end());
+  File written = LittleFS.open(config->patternPath(config->patternId(), ".oppp"), FILE_WRITE);
+  written.write(file.data(), file.size());
+  written.close();
+  config->loadPattern();
+  LoadedPattern& p = *config->playing;
+  CHECK(p.frameHeight == DEFAULT_FRAME_HEIGHT && p.frameCount == DEFAULT_FRAME_COUNT);
+  CHECK(p.playbackFrameCount > 0);
+  powerOff(config);
+}
+
+// An upload whose frames don't fit the buffer is reported, the placeholder plays, or nothing if not even that fits
+static void checkUnplayableUploads(){
+  OpenPixelPoiConfig* config = boot();
+  LoadedPattern& p = *config->playing;
+  size_t bufferSize = p.bufferSize;
+  p.bufferSize = FRAME_HEIGHT * 3 - 1;
+  CHECK(!upload(*config, randomPattern()));
+  CHECK(!hasTemporaryFiles());
+  CHECK(p.frameHeight == DEFAULT_FRAME_HEIGHT && p.frameCount == DEFAULT_FRAME_COUNT);
+  CHECK(p.playbackFrameCount > 0 && p.framesResident == p.playbackFrameCount);
+  p.bufferSize = DEFAULT_FRAME_HEIGHT * 3 - 1;
+  config->loadPattern();
+  CHECK(p.playbackFrameCount == 0);
+  p.bufferSize = bufferSize;
+  config->loadPattern();
+  CHECK(p.frameHeight == FRAME_HEIGHT && p.playbackFrameCount == FRAME_COUNT);
+  powerOff(config);
+}
+
+int main(){
+  checkCompleteUploads();
+  checkCancelledUploads();
+  checkPowerCuts();
+  checkShortUploads();
+  checkEmptyPatterns();
+  checkUnplayableUploads();
+  return testResult("upload");
+}
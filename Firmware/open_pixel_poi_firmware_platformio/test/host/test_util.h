@@ -0,0 +1,32 @@
+#ifndef _TEST_UTIL_H
+#define _TEST_UTIL_H
+
+#include <stdio.h>
+#include <algorithm>
+#include <string>
+
+// Minimal checks for the host tests, failures are printed and counted, testResult() is the exit code
+static int testFailures = 0;
+
+#define CHECK(condition) if(!(condition)){ testFailures++; printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); }
+#define CHECK_EQUAL_TEXT(what, actual, expected) checkEqualText(__FILE__, __LINE__, what, actual, expected)
+
+static void checkEqualText(const char* file, int line, const std::string& what, const std::string& actual, const std::string& expected){
+  if(actual != expected){
+    // One report per check is plenty when it fails in a loop
+    if(testFailures++ < 20){
+      printf("%s:%d: %s\n  expected: %.300s\n  actual:   %.300s\n", file, line, what.c_str(), expected.c_str(), actual.c_str());
+    }
+  }
+}
+
+static int testResult(const char* name){
+  if(testFailures > 0){
+    printf("%s: %d checks failed\n", name, testFailures);
+    return 1;
+  }
+  printf("%s: all checks passed\n", name);
+  return 0;
+}
+
+#endif
@@ -1,4 +1,5 @@
 import 'dart:async';
+import 'dart:io' show Platform;
 
 import 'package:flutter_blue_plus/flutter_blue_plus.dart';
 // import 'package:flutter_blue_plus_windows/flutter_blue_plus_windows.dart';
@@ -17,26 +18,41 @@ class BLEUart {
   late BluetoothCharacteristic notifyCharacteristic;
 
   late Future<bool> isIntialized;
+  // How long the last init() took to connect and find the UART service
+  Duration? connectTime;
 
   BLEUart(this.device) {
     isIntialized = init();
   }
 
   Future<bool> init() async {
+    Stopwatch stopwatch = Stopwatch()..start();
 
-    if (await device.connectionState.first.timeout(Duration(seconds: 1), onTimeout: () => BluetoothConnectionState.disconnected) == BluetoothConnectionState.connected) {
-      await device.disconnect();
+    // A link that is still up is reused instead of torn down and made again
+    if (await device.connectionState.first.timeout(Duration(seconds: 1), onTimeout: () => BluetoothConnectionState.disconnected) != BluetoothConnectionState.connected) {
+      try{
+        await device
+            .connect(timeout: Duration(seconds: 5), autoConnect: false)
+            .timeout(Duration(milliseconds: 5250), onTimeout: () => throw Exception("Connection Timeout"));
+      }catch(e){
+        // Retry once
+        await device
+            .connect(timeout: Duration(seconds: 5), autoConnect: false)
+            .timeout(Duration(milliseconds: 5250), onTimeout: () => throw Exception("Connection Timeout"));
+      }
     }
+    Duration connected = stopwatch.elapsed;
 
-    try{
-      await device
-          .connect(timeout: Duration(seconds: 5), autoConnect: false)
-          .timeout(Duration(milliseconds: 5250), onTimeout: () => throw Exception("Connection Timeout"));
-    }catch(e){
-      // Retry once
-      await device
-          .connect(timeout: Duration(seconds: 5), autoConnect: false)
-          .timeout(Duration(milliseconds: 5250), onTimeout: () => throw Exception("Connection Timeout"));
+    // Android only keeps the GATT table of bonded devices cached, so bond once (Just Works, no pin) and later
+    // discoveries come from the cache. iOS caches without it.
+    if (Platform.isAndroid) {
+      try {
+        if (await device.bondState.first != BluetoothBondState.bonded) {
+          await device.createBond(timeout: 10);
+        }
+      } catch (e) {
+        print("Unable to bond: $e");
+      }
     }
 
     List<BluetoothService> services = await device.discoverServices(timeout: 5);
@@ -61,14 +77,36 @@ class BLEUart {
       throw Exception("Device does not have UART NOTIFY characteristic");
     }
 
-    // No longer using notifications!
-    // bool notificationsEnabled = await notifyCharacteristic.setNotifyValue(true);
-    // if (notificationsEnabled == false) {
-    //   throw Exception("Unable to enable message notification");
-    // }
+    // Only protocol v2 acks come as notifications, without them uploads use v1
+    try {
+      await notifyCharacteristic.setNotifyValue(true);
+    } catch (e) {
+      print("Unable to enable notifications: $e");
+    }
+    connectTime = stopwatch.elapsed;
+    print("Connected in ${connectTime!.inMilliseconds} ms (link ${connected.inMilliseconds} ms, services ${(connectTime! - connected).inMilliseconds} ms)");
     return true;
   }
 
+  // Longest write without response the link takes
+  int get writeLimit => device.mtuNow - 3;
+
+  // Bulk transfers ask for the shortest connection interval and the 2M PHY, after them the link goes back to saving power.
+  // Only Android lets apps ask, iOS picks by itself (the poi asks too).
+  Future<void> setBulkTransfer(bool bulk) async {
+    if(!Platform.isAndroid){
+      return;
+    }
+    try {
+      await device.requestConnectionPriority(connectionPriorityRequest: bulk ? ConnectionPriority.high : ConnectionPriority.balanced);
+      if(bulk){
+        await device.setPreferredPhy(txPhy: Phy.le2m.mask, rxPhy: Phy.le2m.mask, option: PhyCoding.noPreferred);
+      }
+    } catch (e) {
+      print("Unable to change link parameters: $e");
+    }
+  }
+
   Future<void> write(List<int> value, {bool withoutResponse = false}) {
     return rxCharacteristic.write(value, withoutResponse: withoutResponse);
   }
@@ -77,9 +115,9 @@ class BLEUart {
     return rxCharacteristic.write(value, withoutResponse: withoutResponse);
   }
 
-  // Stream<List<int>> getDataStream() {
-  //   return notifyCharacteristic.value;
-  // }
+  Stream<List<int>> getDataStream() {
+    return notifyCharacteristic.onValueReceived;
+  }
 
   Future disconnect() async {
     try {
@@ -20,4 +20,14 @@ enum CommCode {
   CC_SET_SPEED_OPTION,            // 18
   CC_SET_SPEED_OPTIONS,           // 19
   CC_SET_PATTERN_SHUFFLE_DURATION,// 20
+  CC_GET_FRAME_STATS,             // 21
+  CC_SET_INDEXED_PATTERN,         // 22
+  CC_SET_COMPRESSED_PATTERN,      // 23
+  CC_SET_TIMELINE,                // 24
+  CC_GET_LIBRARY,                 // 25
+  CC_SET_LIBRARY_LAYOUT,          // 26
+  CC_GET_PATTERN_HASHES,          // 27
+  CC_LINK_PATTERN,                // 28
+  CC_GET_PROTOCOL,                // 29
+  CC_TEST_THROUGHPUT,             // 30
 }
@@ -0,0 +1,60 @@
+import '../parse_util.dart';
+
+class FrameStats {
+  int windowMicros = 0;
+  int framesShown = 0;
+  int framesSkipped = 0;
+  int maxFrameGapMicros = 0;
+  int busBlockedCount = 0;
+  int busWaitMicros = 0;
+  // Loop period histogram, bucket n counts loops shorter than 16 << n us, the last bucket the rest
+  List<int> loopHistogram = [];
+  int maxFrameLatencyMicros = 0;
+  // Frame start latency (jitter) histogram, bucket n counts frames started less than 4 << n us late, the last bucket the rest
+  List<int> latencyHistogram = [];
+  int patternTransitions = 0;
+  int transitionsNotPrefetched = 0;
+  int maxTransitionLatencyMicros = 0;
+  // Times playback reached a frame that wasn't loaded yet and held the last loaded one
+  int loaderStalls = 0;
+  int loaderStallMicros = 0;
+  // Settings flash writes saved by batching setting changes
+  int settingsWritesAvoided = 0;
+
+  FrameStats(List<int> data){
+    windowMicros = ParseUtil.takeInt32(data);
+    framesShown = ParseUtil.takeInt32(data);
+    framesSkipped = ParseUtil.takeInt32(data);
+    maxFrameGapMicros = ParseUtil.takeInt32(data);
+    busBlockedCount = ParseUtil.takeInt32(data);
+    busWaitMicros = ParseUtil.takeInt32(data);
+    for(int i = 0; i < 8 && data.length >= 4; i++){
+      loopHistogram.add(ParseUtil.takeInt32(data));
+    }
+    // Only sent by firmware with the render task
+    if(data.length >= 4){
+      maxFrameLatencyMicros = ParseUtil.takeInt32(data);
+    }
+    for(int i = 0; i < 8 && data.length >= 4; i++){
+      latencyHistogram.add(ParseUtil.takeInt32(data));
+    }
+    // Only sent by firmware that prefetches shuffle and sequencer steps
+    if(data.length >= 12){
+      patternTransitions = ParseUtil.takeInt32(data);
+      transitionsNotPrefetched = ParseUtil.takeInt32(data);
+      maxTransitionLatencyMicros = ParseUtil.takeInt32(data);
+    }
+    // Only sent by firmware with the read-ahead loader
+    if(data.length >= 8){
+      loaderStalls = ParseUtil.takeInt32(data);
+      loaderStallMicros = ParseUtil.takeInt32(data);
+    }
+    if(data.length >= 4){
+      settingsWritesAvoided = ParseUtil.takeInt32(data);
+    }
+  }
+
+  double get achievedFps => windowMicros == 0 ? 0 : framesShown * 1000000 / windowMicros;
+
+  double get skippedPercent => framesShown + framesSkipped == 0 ? 0 : framesSkipped * 100 / (framesShown + framesSkipped);
+}
@@ -0,0 +1,15 @@
+import '../parse_util.dart';
+
+// Content hashes of the patterns stored on a poi, from CC_GET_PATTERN_HASHES
+class PatternHashes {
+  // Pattern id of each hash
+  Map<int, int> ids = {};
+
+  PatternHashes(List<int> data){
+    int count = ParseUtil.takeInt8(data);
+    for(int i = 0; i < count; i++){
+      int id = ParseUtil.takeInt8(data);
+      ids[ParseUtil.takeInt32(data)] = id;
+    }
+  }
+}
@@ -0,0 +1,27 @@
+import '../parse_util.dart';
+
+// A poi's pattern library, from CC_GET_LIBRARY. Banks hold a variable number of slots, each showing a pattern id.
+class PatternLibrary {
+  int freeBytes = 0;
+  int patternBytes = 0;
+  // Pattern id of each slot, per bank
+  List<List<int>> banks = [];
+  // Size of each pattern id in a slot
+  Map<int, int> patternSizes = {};
+
+  PatternLibrary(List<int> data){
+    freeBytes = ParseUtil.takeInt32(data);
+    patternBytes = ParseUtil.takeInt32(data);
+    int bankCount = ParseUtil.takeInt8(data);
+    List<int> slotCounts = ParseUtil.takeInt8List(data, bankCount);
+    for(int slotCount in slotCounts){
+      List<int> ids = [];
+      for(int i = 0; i < slotCount; i++){
+        int id = ParseUtil.takeInt8(data);
+        patternSizes[id] = ParseUtil.takeInt32(data);
+        ids.add(id);
+      }
+      banks.add(ids);
+    }
+  }
+}
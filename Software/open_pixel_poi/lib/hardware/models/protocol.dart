@@ -0,0 +1,16 @@
+import '../parse_util.dart';
+
+// The poi's framing, from CC_GET_PROTOCOL
+class Protocol {
+  int version = 1;
+  int window = 1; // Packets in flight
+  int payloadLimit = 0; // Message bytes per packet
+  int nextSequence = 0;
+
+  Protocol(List<int> data){
+    version = ParseUtil.takeInt8(data);
+    window = ParseUtil.takeInt8(data);
+    payloadLimit = ParseUtil.takeInt16(data);
+    nextSequence = ParseUtil.takeInt16(data);
+  }
+}
@@ -0,0 +1,19 @@
+import '../parse_util.dart';
+
+// CC_TEST_THROUGHPUT result, as the poi saw the upload
+class Throughput {
+  int bytes = 0;
+  int micros = 0; // From the first packet to the last one
+  int mtu = 0;
+  // Set by the app, from starting the send to the response
+  int appMicros = 0;
+
+  Throughput(List<int> data){
+    bytes = ParseUtil.takeInt32(data);
+    micros = ParseUtil.takeInt32(data);
+    mtu = ParseUtil.takeInt16(data);
+  }
+
+  double get kbPerSecond => micros == 0 ? 0 : bytes * 1000 / 1024 / (micros / 1000);
+  double get appKbPerSecond => appMicros == 0 ? 0 : bytes * 1000 / 1024 / (appMicros / 1000);
+}
@@ -0,0 +1,139 @@
+import 'dart:typed_data';
+
+class PatternEncoder {
+  static final List<int> _crcTable = List.generate(256, (n) {
+    int c = n;
+    for(int k = 0; k < 8; k++){
+      c = (c & 1) != 0 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+    }
+    return c;
+  });
+
+  static int crc32(List<int> data, [int crc = 0]) {
+    crc = crc ^ 0xFFFFFFFF;
+    for(int byte in data){
+      crc = _crcTable[(crc ^ byte) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFF;
+  }
+
+  // The .oppp header the poi stores the pattern with: 'O', 'P', file version 1, encoding (0 = RGB, 1 = indexed, 2 = compressed),
+  // height, count (2 bytes), color order 0, length of the data (4 bytes) and CRC32 of the data (4 bytes).
+  // CC_LINK_PATTERN sends it, so the poi can check the pattern it links.
+  static List<int> fileHeader(int encoding, int height, int count, List<int> data) {
+    int crc = crc32(data);
+    return [0x4F, 0x50, 1, encoding, height, (count >> 8) & 0xFF, count & 0xFF, 0,
+      (data.length >> 24) & 0xFF, (data.length >> 16) & 0xFF, (data.length >> 8) & 0xFF, data.length & 0xFF,
+      (crc >> 24) & 0xFF, (crc >> 16) & 0xFF, (crc >> 8) & 0xFF, crc & 0xFF];
+  }
+
+  // The poi's content hash of a pattern (see CC_GET_PATTERN_HASHES): CRC32 of its fileHeader()
+  static int contentHash(List<int> fileHeader) {
+    return crc32(fileHeader);
+  }
+
+  // Palette encoding for CC_SET_INDEXED_PATTERN: 'O', 'I', bits per index, palette size - 1, cycle speed (2 bytes),
+  // the palette (R,G,B per color) and frames of palette indices, 4 bit indices packed high nibble first.
+  // Returns null when the pattern has more than 256 colors.
+  static List<int>? indexed(int height, int count, Uint8List rgb, {int cycleSpeed = 0}) {
+    int pixelCount = height * count;
+    if(pixelCount == 0 || rgb.length < pixelCount * 3){
+      return null;
+    }
+    Map<int, int> indexOfColor = {};
+    List<int> palette = [];
+    List<int> indices = List.filled(pixelCount, 0);
+    for(int i = 0; i < pixelCount; i++){
+      int color = (rgb[i * 3] << 16) | (rgb[i * 3 + 1] << 8) | rgb[i * 3 + 2];
+      int? index = indexOfColor[color];
+      if(index == null){
+        if(indexOfColor.length == 256){
+          return null;
+        }
+        index = indexOfColor.length;
+        indexOfColor[color] = index;
+        palette.addAll([rgb[i * 3], rgb[i * 3 + 1], rgb[i * 3 + 2]]);
+      }
+      indices[i] = index;
+    }
+
+    int bits = indexOfColor.length <= 16 ? 4 : 8;
+    List<int> encoded = [0x4F, 0x49, bits, indexOfColor.length - 1, (cycleSpeed >> 8) & 0xFF, cycleSpeed & 0xFF];
+    encoded.addAll(palette);
+    for(int frame = 0; frame < count; frame++){
+      int start = frame * height;
+      if(bits == 8){
+        encoded.addAll(indices.sublist(start, start + height));
+      }else{
+        // Each frame starts on a whole byte
+        for(int j = 0; j < height; j += 2){
+          int low = j + 1 < height ? indices[start + j + 1] : 0;
+          encoded.add(indices[start + j] << 4 | low);
+        }
+      }
+    }
+    return encoded;
+  }
+
+  // Encoding for CC_SET_COMPRESSED_PATTERN: 'O', 'Z', length of the frame data (4 bytes), then per frame a 2 byte length and ops.
+  // Each op is (op << 6 | pixel count - 1) for up to 64 pixels: 0 = keep the previous frame's pixels (black before the first frame),
+  // 1 = run of the R,G,B that follows, 2 = that many literal R,G,B.
+  static List<int>? compressed(int height, int count, Uint8List rgb) {
+    if(height == 0 || count == 0 || rgb.length < height * count * 3){
+      return null;
+    }
+    int color(int frame, int pixel) {
+      if(frame < 0){
+        return 0;
+      }
+      int i = (frame * height + pixel) * 3;
+      return (rgb[i] << 16) | (rgb[i + 1] << 8) | rgb[i + 2];
+    }
+    int kept(int frame, int pixel) {
+      int n = 0;
+      while(pixel + n < height && n < 64 && color(frame, pixel + n) == color(frame - 1, pixel + n)){
+        n++;
+      }
+      return n;
+    }
+    int run(int frame, int pixel) {
+      int n = 1;
+      while(pixel + n < height && n < 64 && color(frame, pixel + n) == color(frame, pixel)){
+        n++;
+      }
+      return n;
+    }
+
+    List<int> data = [];
+    for(int frame = 0; frame < count; frame++){
+      List<int> ops = [];
+      int pixel = 0;
+      while(pixel < height){
+        int keep = kept(frame, pixel);
+        int repeat = run(frame, pixel);
+        if(keep > 0 && keep >= repeat){
+          ops.add(keep - 1);
+          pixel += keep;
+        }else if(repeat >= 2){
+          int i = (frame * height + pixel) * 3;
+          ops.addAll([0x40 | (repeat - 1), rgb[i], rgb[i + 1], rgb[i + 2]]);
+          pixel += repeat;
+        }else{
+          // Literals until something cheaper starts
+          int n = 1;
+          while(pixel + n < height && n < 64 && kept(frame, pixel + n) == 0 && run(frame, pixel + n) < 2){
+            n++;
+          }
+          int i = (frame * height + pixel) * 3;
+          ops.add(0x80 | (n - 1));
+          ops.addAll(rgb.sublist(i, i + n * 3));
+          pixel += n;
+        }
+      }
+      data.addAll([(ops.length >> 8) & 0xFF, ops.length & 0xFF]);
+      data.addAll(ops);
+    }
+    int length = data.length;
+    return [0x4F, 0x5A, (length >> 24) & 0xFF, (length >> 16) & 0xFF, (length >> 8) & 0xFF, length & 0xFF] + data;
+  }
+}
@@ -1,4 +1,5 @@
 import 'dart:async';
+import 'dart:math';
 
 import 'package:flutter_blue_plus/flutter_blue_plus.dart';
 // import 'package:flutter_blue_plus_windows/flutter_blue_plus_windows.dart';
@@ -10,8 +11,14 @@ import '../pages/pattern_creators/create_sequence.dart';
 import './models/comm_code.dart';
 import 'ble_uart.dart';
 import 'models/confirmtation.dart';
+import 'models/frame_stats.dart';
 import 'models/led_pattern.dart';
+import 'models/pattern_hashes.dart';
+import 'models/pattern_library.dart';
+import 'models/protocol.dart';
+import 'models/throughput.dart';
 import 'parse_util.dart';
+import 'pattern_encoder.dart';
 
 class PoiHardware {
   BLEUart uart;
@@ -20,20 +27,159 @@ class PoiHardware {
   BehaviorSubject<double> largeSendProgress = BehaviorSubject<double>.seeded(0);
   late StreamSubscription<BluetoothConnectionState> subscription;
   bool isConncted = false;
+  // Content hashes the poi has stored, fetched on the first pattern send
+  Set<int>? _patternHashes;
+  // False once the poi turned out to only know protocol v1
+  bool _framingSupported = true;
+  // Notifications that a response is ready to read, v2 acks (D3) don't count
+  late StreamSubscription<List<int>> notifySubscription;
+  int _responseCount = 0;
+  int _requestResponseCount = 0;
+  Completer<void>? _responseReady;
 
   PoiHardware(this.uart) {
     subscription = uart.device.connectionState.listen((event) {
       state.add(event);
       isConncted = event == BluetoothConnectionState.connected;
     });
+    notifySubscription = uart.getDataStream().listen((value) {
+      if(value.isNotEmpty && value[0] == 0xD3){
+        return;
+      }
+      _responseCount++;
+      if(_responseReady != null && !_responseReady!.isCompleted){
+        _responseReady!.complete();
+      }
+    });
   }
 
-  Future<bool> _sendIt(List<int> message, [bool confirmation = true]) {
+  Future<bool> _sendIt(List<int> message, [bool confirmation = true]) async {
     if(message.length < 509 && confirmation){
       return _writePacketWithConfirmation(_buildRequest(message));
-    }else {
-      return _writePackets(_buildRequest(message));
     }
+    Protocol? protocol = await _readProtocol();
+    await uart.setBulkTransfer(true);
+    try{
+      if(protocol != null){
+        return await _writeFramed(message, protocol);
+      }
+      return await _writePackets(_buildRequest(message));
+    }finally{
+      await uart.setBulkTransfer(false);
+    }
+  }
+
+  // Starts a v2 transfer, null if the poi only knows v1
+  Future<Protocol?> _readProtocol() async {
+    if(!_framingSupported){
+      return null;
+    }
+    try{
+      await _writePacketWithConfirmation(_buildRequest([CommCode.CC_GET_PROTOCOL.index]));
+      dynamic response = await readResponse();
+      if(response is Protocol && response.version >= 2){
+        return response;
+      }
+    }catch(e){
+      print("Protocol request failed: $e");
+      return null;
+    }
+    _framingSupported = false;
+    return null;
+  }
+
+  // Protocol v2 packet: D2, flags (1 = first, 2 = last), sequence (2 bytes), payload length (2 bytes), payload, CRC32 of the rest (4 bytes)
+  List<int> _buildFrame(int flags, int sequence, List<int> payload) {
+    List<int> frame = [0xD2, flags];
+    ParseUtil.putInt16(frame, sequence);
+    ParseUtil.putInt16(frame, payload.length);
+    frame.addAll(payload);
+    ParseUtil.putInt32(frame, PatternEncoder.crc32(frame));
+    return frame;
+  }
+
+  // Keeps up to a window of packets in flight and resends only the ones the poi's acks show missing
+  Future<bool> _writeFramed(List<int> message, Protocol protocol) async {
+    // Packets fit the negotiated MTU, iOS often settles on less than the poi takes
+    int payloadLimit = min(protocol.payloadLimit, uart.writeLimit - 10);
+    List<List<int>> frames = [];
+    for(int offset = 0; offset < message.length; offset += payloadLimit){
+      int end = min(offset + payloadLimit, message.length);
+      int flags = (offset == 0 ? 1 : 0) | (end == message.length ? 2 : 0);
+      frames.add(_buildFrame(flags, (protocol.nextSequence + frames.length) & 0xFFFF, message.sublist(offset, end)));
+    }
+    print("Write framed: message length = ${message.length}, ${frames.length} packets, window = ${protocol.window}, MTU = ${uart.device.mtuNow}");
+    largeSendProgress.add(0);
+
+    int acked = 0; // Frames before this one are acked
+    int next = 0; // Next frame sent for the first time
+    Set<int> held = {}; // Frames past acked the poi holds
+    List<DateTime> sentAt = List.filled(frames.length, DateTime(0));
+    Completer<void> wake = Completer<void>();
+    StreamSubscription<List<int>> acks = uart.getDataStream().listen((ack) {
+      // D3, next sequence expected (2 bytes), bit n = sequence + 1 + n held
+      if(ack.length < 4 || ack[0] != 0xD3){
+        return;
+      }
+      int expected = ((ack[1] << 8 | ack[2]) - protocol.nextSequence) & 0xFFFF;
+      if(expected < acked || expected > frames.length){
+        return; // From before this transfer
+      }
+      acked = expected;
+      held = {};
+      for(int i = 0; i < protocol.window - 1; i++){
+        if((ack[3] >> i) & 1 != 0){
+          held.add(acked + 1 + i);
+        }
+      }
+      largeSendProgress.add(acked / frames.length);
+      if(!wake.isCompleted){
+        wake.complete();
+      }
+    });
+
+    Future<bool> send(int frame) async {
+      try{
+        await uart.write(frames[frame], withoutResponse: true);
+        sentAt[frame] = DateTime.now();
+        return true;
+      }catch(e){
+        print("Write frame $frame failed: $e");
+        return false;
+      }
+    }
+
+    const Duration resendAfter = Duration(milliseconds: 300);
+    int stalls = 0;
+    try{
+      while(acked < frames.length){
+        // Acks that come in while sending wake the wait below straight away
+        wake = Completer<void>();
+        while(next < frames.length && next < acked + protocol.window){
+          if(!await send(next)){
+            break;
+          }
+          next++;
+        }
+        bool progressed = await wake.future.then((_) => true).timeout(resendAfter, onTimeout: () => false);
+        stalls = progressed ? 0 : stalls + 1;
+        if(stalls > 10){
+          print("Write framed: no acks, giving up at $acked/${frames.length}");
+          return true;
+        }
+        // A held frame past the first unacked one means that one got lost, otherwise resend what has gone unacked too long
+        DateTime now = DateTime.now();
+        for(int frame = acked; frame < next; frame++){
+          if(!held.contains(frame) && now.difference(sentAt[frame]) > (held.isNotEmpty ? resendAfter ~/ 4 : resendAfter)){
+            print("Write framed: resending $frame");
+            await send(frame);
+          }
+        }
+      }
+    }finally{
+      await acks.cancel();
+    }
+    return false;
   }
 
   Future<bool> _writePackets(List<int> request) async {
@@ -75,6 +221,7 @@ class PoiHardware {
     if(request.length > 512){
       return true;
     }
+    _requestResponseCount = _responseCount;
     return await uart.write(request).then((value) {
       print("Write Success!");
       return false;
@@ -102,6 +249,12 @@ class PoiHardware {
   }
 
   Future<dynamic> readResponse() async {
+    // The poi handles requests in its main loop, after the write went through, and notifies once the response is set
+    if(_responseCount == _requestResponseCount){
+      _responseReady = Completer<void>();
+      await _responseReady!.future.timeout(const Duration(seconds: 2), onTimeout: () {});
+      _responseReady = null;
+    }
     try{
       await uart.txCharacteristic.read();
     }catch(e){
@@ -144,6 +297,16 @@ class PoiHardware {
         return Confirmation(false);
       case CommCode.CC_GET_FW_VERSION:
         return FWVersion(message[0]);
+      case CommCode.CC_GET_FRAME_STATS:
+        return FrameStats(message);
+      case CommCode.CC_GET_LIBRARY:
+        return PatternLibrary(message);
+      case CommCode.CC_GET_PATTERN_HASHES:
+        return PatternHashes(message);
+      case CommCode.CC_GET_PROTOCOL:
+        return Protocol(message);
+      case CommCode.CC_TEST_THROUGHPUT:
+        return Throughput(message);
      default:
         print("Unhandled message recieved: code = $commCode, message = $message");
         return null;
@@ -216,26 +379,151 @@ class PoiHardware {
     return _sendIt(message);
   }
 
-  Future<bool> sendPattern2(DBImage pattern) {
+  Future<bool> sendPattern2(DBImage pattern, {int paletteCycleSpeed = 0}) async {
     List<int> message = [];
-    ParseUtil.putInt8(message, CommCode.CC_SET_PATTERN.index);
+    // Patterns with up to 256 colors can go out as palette indices, a third of the size or less,
+    // otherwise runs and unchanged pixels are compressed, whichever is smaller. Raw RGB when neither helps.
+    List<int>? indexed = PatternEncoder.indexed(pattern.height, pattern.count, pattern.bytes, cycleSpeed: paletteCycleSpeed);
+    List<int>? compressed = PatternEncoder.compressed(pattern.height, pattern.count, pattern.bytes);
+    CommCode code;
+    List<int> data;
+    if(indexed != null && (paletteCycleSpeed != 0 || (indexed.length < pattern.bytes.length && (compressed == null || indexed.length <= compressed.length)))){
+      code = CommCode.CC_SET_INDEXED_PATTERN;
+      data = indexed;
+    }else if(compressed != null && compressed.length < pattern.bytes.length){
+      code = CommCode.CC_SET_COMPRESSED_PATTERN;
+      data = compressed;
+    }else{
+      code = CommCode.CC_SET_PATTERN;
+      data = pattern.bytes;
+    }
+
+    // Patterns the poi already has are linked to the slot instead of sent again
+    int encoding = code == CommCode.CC_SET_INDEXED_PATTERN ? 1 : code == CommCode.CC_SET_COMPRESSED_PATTERN ? 2 : 0;
+    List<int> header = PatternEncoder.fileHeader(encoding, pattern.height, pattern.count, data);
+    int hash = PatternEncoder.contentHash(header);
+    if((await _readPatternHashes()).contains(hash)){
+      if(await _linkPattern(header)){
+        print("Linked pattern $hash, upload skipped");
+        return false;
+      }
+      _patternHashes = null;
+    }
+
+    ParseUtil.putInt8(message, code.index);
     ParseUtil.putInt8(message, pattern.height);
     ParseUtil.putInt16(message, pattern.count);
-    ParseUtil.putInt8List(message, pattern.bytes);
-    return _sendIt(message);
+    ParseUtil.putInt8List(message, data);
+    bool failed = await _sendIt(message);
+    if(!failed){
+      _patternHashes?.add(hash);
+    }
+    return failed;
+  }
+
+  // Uploads the given number of bytes the poi counts and drops, null if the poi doesn't support the test
+  Future<Throughput?> testThroughput(int bytes) async {
+    List<int> message = [];
+    ParseUtil.putInt8(message, CommCode.CC_TEST_THROUGHPUT.index);
+    ParseUtil.putInt32(message, bytes);
+    message.addAll(List.filled(bytes, 0x55));
+    Stopwatch stopwatch = Stopwatch()..start();
+    if(await _sendIt(message)){
+      return null;
+    }
+    dynamic response = await readResponse();
+    if(response is! Throughput){
+      return null;
+    }
+    response.appMicros = stopwatch.elapsedMicroseconds;
+    return response;
+  }
+
+  Future<Set<int>> _readPatternHashes() async {
+    if(_patternHashes == null){
+      try{
+        await sendCommCode(CommCode.CC_GET_PATTERN_HASHES);
+        dynamic response = await readResponse();
+        // Older firmware errors on the request, then nothing is linked
+        _patternHashes = response is PatternHashes ? response.ids.keys.toSet() : {};
+      }catch(e){
+        return {};
+      }
+    }
+    return _patternHashes!;
+  }
+
+  // Firmware that only takes the hash errors on the header, then the pattern is uploaded
+  Future<bool> _linkPattern(List<int> header) async {
+    List<int> message = [];
+    ParseUtil.putInt8(message, CommCode.CC_LINK_PATTERN.index);
+    ParseUtil.putInt8List(message, header);
+    if(await _sendIt(message)){
+      return false;
+    }
+    dynamic response = await readResponse();
+    return response is Confirmation && response.success;
   }
 
-  Future<bool> sendSequence(List<SegmentValues> segments) {
+  // Each bank lists the pattern id of its slots
+  Future<bool> sendLibraryLayout(List<List<int>> banks) {
     List<int> message = [];
-    ParseUtil.putInt8(message, CommCode.CC_SET_SEQUENCER.index);
-    ParseUtil.putInt16(message, segments.length * 7);
+    ParseUtil.putInt8(message, CommCode.CC_SET_LIBRARY_LAYOUT.index);
+    ParseUtil.putInt8(message, banks.length);
+    for(List<int> bank in banks){
+      ParseUtil.putInt8(message, bank.length);
+    }
+    for(List<int> bank in banks){
+      ParseUtil.putInt8List(message, bank);
+    }
+    return _sendIt(message);
+  }
+
+  // Null if the poi's firmware has no library to read
+  Future<PatternLibrary?> _readLibrary() async {
+    try{
+      await sendCommCode(CommCode.CC_GET_LIBRARY);
+      dynamic response = await readResponse();
+      return response is PatternLibrary ? response : null;
+    }catch(e){
+      return null;
+    }
+  }
+
+  // Library position of a slot and bank (counted from 1), wrapped around the poi's layout like CC_SET_SEQUENCER does.
+  // Without a library the default layout of 5 slots per bank is assumed.
+  int _libraryPosition(PatternLibrary? library, int slot, int bank){
+    if(library == null || library.banks.isEmpty){
+      return (slot - 1) + (bank - 1) * 5;
+    }
+    int wrappedBank = (bank - 1) % library.banks.length;
+    int position = 0;
+    for(int i = 0; i < wrappedBank; i++){
+      position += library.banks[i].length;
+    }
+    return position + (slot - 1) % max(library.banks[wrappedBank].length, 1);
+  }
+
+  // Compiled into a CC_SET_TIMELINE timeline (version 2): each step starts (in ms) when the one before has run for its duration
+  Future<bool> sendSequence(List<SegmentValues> segments) async {
+    PatternLibrary? library = await _readLibrary();
+    List<int> steps = [];
+    int start = 0;
     for(SegmentValues segment in segments){
-      ParseUtil.putInt8(message, segment.pattern - 1);
-      ParseUtil.putInt8(message, segment.bank - 1);
-      ParseUtil.putInt8(message, segment.brightness);
-      ParseUtil.putInt16(message, segment.speed);
-      ParseUtil.putInt16(message, segment.duration);
+      ParseUtil.putInt8(steps, 10); // Record length
+      ParseUtil.putInt32(steps, start);
+      ParseUtil.putInt8(steps, _libraryPosition(library, segment.pattern, segment.bank));
+      ParseUtil.putInt8(steps, 0x03); // Brightness and speed follow
+      ParseUtil.putInt8(steps, segment.brightness);
+      ParseUtil.putInt16(steps, segment.speed);
+      start += segment.duration;
     }
+    List<int> message = [];
+    ParseUtil.putInt8(message, CommCode.CC_SET_TIMELINE.index);
+    ParseUtil.putInt8List(message, [0x4F, 0x54, 2, 0]);
+    ParseUtil.putInt32(message, segments.length);
+    ParseUtil.putInt32(message, steps.length);
+    ParseUtil.putInt8List(message, steps);
     return _sendIt(message);
   }
 }
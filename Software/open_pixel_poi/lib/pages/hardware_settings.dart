@@ -2,6 +2,8 @@ import 'dart:convert';
 import 'package:flutter/material.dart';
 import 'package:flutter/services.dart';
 import 'package:open_pixel_poi/hardware/models/confirmtation.dart';
+import 'package:open_pixel_poi/hardware/models/frame_stats.dart';
+import 'package:open_pixel_poi/hardware/models/throughput.dart';
 import 'package:provider/provider.dart';
 
 import '../../model.dart';
@@ -44,6 +46,10 @@ class _HardwareSettingsState extends State<HardwareSettingsPage> {
   List<int> brightnesses = [0,0,0,0,0,0];
   List<int> animationSpeeds = [0,0,0,0,0,0];
   bool saving = false;
+  bool measuring = false;
+  List<FrameStats?> frameStats = [];
+  bool testingThroughput = false;
+  List<Throughput?> throughputs = [];
 
   @override
   Widget build(BuildContext context) {
@@ -97,10 +103,182 @@ class _HardwareSettingsState extends State<HardwareSettingsPage> {
         getHardwareVersion(),
         getSpeeds(),
         getBrightnesses(),
+        getFrameStats(),
+        getThroughput(),
       ],
     );
   }
 
+  Widget getFrameStats(){
+    return Card(
+      elevation: 5,
+      child: Padding(
+        padding: const EdgeInsets.all(10.0),
+        child: Column(
+            crossAxisAlignment: CrossAxisAlignment.start,
+            children: [
+              Text(
+                "Render Performance:",
+                style: TextStyle(
+                  fontSize: 24,
+                  color: Colors.blue,
+                ),
+              ),
+              Text(
+                "Measures the frame rate each Poi actually delivers for its current pattern and speed over 5 seconds.",
+                style: TextStyle(
+                  fontSize: 16,
+                  color: Colors.black,
+                ),
+              ),
+              ...frameStats.asMap().entries.map((entry) => Text(
+                describeFrameStats(entry.key, entry.value),
+                style: TextStyle(
+                  fontSize: 16,
+                  color: Colors.black,
+                ),
+              )),
+              SizedBox(
+                width: double.infinity,
+                height: 60,
+                child: ElevatedButton(
+                  onPressed: measuring ? null : () async {
+                    setState(() {
+                      measuring = true;
+                      frameStats = [];
+                    });
+                    List<PoiHardware> pois = Provider.of<Model>(context, listen: false).connectedPoi!;
+                    // The first request only starts a fresh measurement window
+                    for(PoiHardware poi in pois){
+                      await poi.sendCommCode(CommCode.CC_GET_FRAME_STATS).timeout(Duration(seconds: 5));
+                    }
+                    await Future.delayed(const Duration(seconds: 5));
+                    List<FrameStats?> results = [];
+                    for(PoiHardware poi in pois){
+                      await poi.sendCommCode(CommCode.CC_GET_FRAME_STATS).timeout(Duration(seconds: 5));
+                      dynamic response = await poi.readResponse().timeout(Duration(seconds: 5));
+                      results.add(response is FrameStats ? response : null);
+                    }
+                    setState(() {
+                      frameStats = results;
+                      measuring = false;
+                    });
+                  },
+                  child: Text(
+                    measuring ? "Measuring..." : "Measure",
+                    style: TextStyle(
+                      fontSize: 24,
+                      fontWeight: FontWeight.bold,
+                    ),
+                  ),
+                ),
+              ),
+            ]
+        ),
+      ),
+    );
+  }
+
+  Widget getThroughput(){
+    return Card(
+      elevation: 5,
+      child: Padding(
+        padding: const EdgeInsets.all(10.0),
+        child: Column(
+            crossAxisAlignment: CrossAxisAlignment.start,
+            children: [
+              Text(
+                "Upload Speed:",
+                style: TextStyle(
+                  fontSize: 24,
+                  color: Colors.blue,
+                ),
+              ),
+              Text(
+                "Uploads 64 KB of test data to each Poi, which it throws away, to compare phones and connections.",
+                style: TextStyle(
+                  fontSize: 16,
+                  color: Colors.black,
+                ),
+              ),
+              ...throughputs.asMap().entries.map((entry) => Text(
+                describeThroughput(entry.key, entry.value),
+                style: TextStyle(
+                  fontSize: 16,
+                  color: Colors.black,
+                ),
+              )),
+              SizedBox(
+                width: double.infinity,
+                height: 60,
+                child: ElevatedButton(
+                  onPressed: testingThroughput ? null : () async {
+                    setState(() {
+                      testingThroughput = true;
+                      throughputs = [];
+                    });
+                    List<Throughput?> results = [];
+                    for(PoiHardware poi in Provider.of<Model>(context, listen: false).connectedPoi!){
+                      try{
+                        results.add(await poi.testThroughput(64 * 1024).timeout(Duration(seconds: 60)));
+                      }catch(e){
+                        results.add(null);
+                      }
+                    }
+                    setState(() {
+                      throughputs = results;
+                      testingThroughput = false;
+                    });
+                  },
+                  child: Text(
+                    testingThroughput ? "Testing..." : "Test",
+                    style: TextStyle(
+                      fontSize: 24,
+                      fontWeight: FontWeight.bold,
+                    ),
+                  ),
+                ),
+              ),
+            ]
+        ),
+      ),
+    );
+  }
+
+  String describeThroughput(int index, Throughput? throughput){
+    if(throughput == null){
+      return "Poi ${index + 1}: test failed (firmware may be outdated)";
+    }
+    return "Poi ${index + 1}: ${throughput.kbPerSecond.toStringAsFixed(1)} KB/s received, "
+        + "${throughput.appKbPerSecond.toStringAsFixed(1)} KB/s end to end, MTU ${throughput.mtu}";
+  }
+
+  String describeFrameStats(int index, FrameStats? stats){
+    if(stats == null){
+      return "Poi ${index + 1}: no stats received (firmware may be outdated)";
+    }
+    List<String> loopBuckets = [];
+    for(int i = 0; i < stats.loopHistogram.length; i++){
+      String bound = i < stats.loopHistogram.length - 1 ? "<${16 << i}us" : "longer";
+      loopBuckets.add("$bound: ${stats.loopHistogram[i]}");
+    }
+    List<String> latencyBuckets = [];
+    for(int i = 0; i < stats.latencyHistogram.length; i++){
+      String bound = i < stats.latencyHistogram.length - 1 ? "<${4 << i}us" : "later";
+      latencyBuckets.add("$bound: ${stats.latencyHistogram[i]}");
+    }
+    return "Poi ${index + 1}: ${stats.achievedFps.toStringAsFixed(0)} fps achieved, "
+        + "${stats.skippedPercent.toStringAsFixed(1)}% frames skipped, "
+        + "max frame gap ${(stats.maxFrameGapMicros / 1000).toStringAsFixed(2)} ms, "
+        + "${(stats.busWaitMicros / 1000).toStringAsFixed(0)} ms waiting on LEDs\n"
+        + "Loop times: ${loopBuckets.join(", ")}\n"
+        + "Frame latency (max ${stats.maxFrameLatencyMicros}us): ${latencyBuckets.join(", ")}\n"
+        + "Pattern switches: ${stats.patternTransitions} (${stats.transitionsNotPrefetched} not prefetched), "
+        + "max ${(stats.maxTransitionLatencyMicros / 1000).toStringAsFixed(2)} ms late\n"
+        + "Loader stalls: ${stats.loaderStalls}, ${(stats.loaderStallMicros / 1000).toStringAsFixed(0)} ms holding a frame\n"
+        + "Settings flash writes avoided: ${stats.settingsWritesAvoided}";
+  }
+
   Widget getPatternShuffleDuration(){
     List<DropdownMenuItem<int>> dropdownItems = [DropdownMenuItem(value: -1, child: Center(child: Text("------")))];
     for(int i = 1; i <= 120; i++){